@@ -0,0 +1,626 @@
+#include "jsonmodoki.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * CBOR (RFC 8949)
+ *
+ * 木とCBORを相互に変換する。配列とオブジェクトは長さを前置し、整数の
+ * 数値は整数として、それ以外は値を失わない範囲で短い浮動小数点数とし
+ * て書く。読むときは長さ不定の文字列、配列、マップとタグにも対応する。
+ * JSONで表せないバイト列、UTF-8として正しくない文字列、NaNと無限大、
+ * 名前が文字列でないマップはエラーにする。
+ *
+ * どちらも再帰せず、開いている配列やオブジェクトのスタックを使う。
+ */
+
+enum cbor_major {
+	CBOR_MAJOR_UINT,
+	CBOR_MAJOR_NEGINT,
+	CBOR_MAJOR_BYTES,
+	CBOR_MAJOR_TEXT,
+	CBOR_MAJOR_ARRAY,
+	CBOR_MAJOR_MAP,
+	CBOR_MAJOR_TAG,
+	CBOR_MAJOR_SIMPLE
+};
+
+#define CBOR_INFO_INDEFINITE 31
+#define CBOR_BREAK 0xff
+
+/* 2^64 */
+#define CBOR_UINT64_LIMIT 18446744073709551616.0
+
+/*
+ * 書き込み
+ */
+
+/*
+ * 種別と引数を、引数が収まる最短の形で書く。
+ */
+void
+cbor_put_head(string_t *out, enum cbor_major major, uint64_t arg)
+{
+	char buf[9];
+	size_t n;
+
+	if (arg < 24) {
+		buf[0] = major << 5 | arg;
+		string_append_n(out, buf, 1);
+		return;
+	}
+
+	if (arg <= UINT8_MAX) {
+		buf[0] = major << 5 | 24;
+		n = 1;
+	} else if (arg <= UINT16_MAX) {
+		buf[0] = major << 5 | 25;
+		n = 2;
+	} else if (arg <= UINT32_MAX) {
+		buf[0] = major << 5 | 26;
+		n = 4;
+	} else {
+		buf[0] = major << 5 | 27;
+		n = 8;
+	}
+
+	/* ビッグエンディアン */
+	for (size_t i = 0; i < n; i++)
+		buf[n - i] = (arg >> (i * 8)) & 0xff;
+	string_append_n(out, buf, n + 1);
+}
+
+void
+cbor_put_number(string_t *out, double num)
+{
+	if (num == floor(num) && !(num == 0 && signbit(num))) {
+		if (num >= 0 && num < CBOR_UINT64_LIMIT) {
+			cbor_put_head(out, CBOR_MAJOR_UINT, (uint64_t)num);
+			return;
+		}
+		if (num < 0 && -num < CBOR_UINT64_LIMIT) {
+			/* -1 - nで表す。nは整数の演算で求める */
+			cbor_put_head(
+			    out, CBOR_MAJOR_NEGINT, (uint64_t)-num - 1);
+			return;
+		}
+	}
+
+	/* floatの範囲外の有限値をfloatにすると未定義動作 */
+	if (!isfinite(num) || fabs(num) <= FLT_MAX) {
+		float f = (float)num;
+		if ((double)f == num || isnan(num)) {
+			uint32_t bits;
+			memcpy(&bits, &f, sizeof(bits));
+			string_add_char(out, CBOR_MAJOR_SIMPLE << 5 | 26);
+			for (int i = 3; i >= 0; i--)
+				string_add_char(
+				    out, (bits >> (i * 8)) & 0xff);
+			return;
+		}
+	}
+
+	uint64_t bits;
+	memcpy(&bits, &num, sizeof(bits));
+	string_add_char(out, CBOR_MAJOR_SIMPLE << 5 | 27);
+	for (int i = 7; i >= 0; i--)
+		string_add_char(out, (bits >> (i * 8)) & 0xff);
+}
+
+void
+cbor_put_text(string_t *out, const string_t *s)
+{
+	cbor_put_head(out, CBOR_MAJOR_TEXT, s->len);
+	string_append_n(out, s->bytes, s->len);
+}
+
+size_t
+cbor_count_elems(node_t *container)
+{
+	size_t n = 0;
+
+	if (container->tag == NODE_TAG_ARRAY)
+		return node_array_len(container);
+	for (node_t *e = container->head; e != NULL; e = e->next)
+		n++;
+	return n;
+}
+
+/*
+ * nodeをCBORにしてoutの末尾に書き込む。
+ */
+void
+jm_cbor_encode(node_t *node, string_t *out)
+{
+	node_t **stack = NULL; /* 次に書き込む要素 */
+	size_t stack_len = 0, stack_capacity = 0;
+	node_t *value = node;
+
+	for (;;) {
+		switch (value->tag) {
+		case NODE_TAG_NULL:
+			string_add_char(out, CBOR_MAJOR_SIMPLE << 5 | 22);
+			break;
+		case NODE_TAG_BOOL:
+			string_add_char(out, CBOR_MAJOR_SIMPLE << 5 |
+			        (value->boolean ? 21 : 20));
+			break;
+		case NODE_TAG_NUMBER:
+			cbor_put_number(out, value->num);
+			break;
+		case NODE_TAG_STRING:
+			cbor_put_text(out, &value->str);
+			break;
+		case NODE_TAG_ARRAY:
+		case NODE_TAG_OBJECT:
+			cbor_put_head(out,
+			    value->tag == NODE_TAG_ARRAY ? CBOR_MAJOR_ARRAY
+			                                 : CBOR_MAJOR_MAP,
+			    cbor_count_elems(value));
+			for (size_t i = 0; i < value->packed_len; i++)
+				cbor_put_number(
+				    out, node_packed_get(value, i));
+			if (value->head == NULL)
+				break;
+			if (stack_len == stack_capacity) {
+				stack_capacity = stack_capacity == 0
+				    ? 16
+				    : stack_capacity * 2;
+				stack = xrealloc(stack,
+				    sizeof(node_t *) * stack_capacity);
+			}
+			stack[stack_len++] = value->head;
+			break;
+		default:
+			BUG(1);
+		}
+
+		/* 次の要素 */
+		while (stack_len > 0 && stack[stack_len - 1] == NULL)
+			stack_len--;
+		if (stack_len == 0)
+			break;
+
+		node_t *elem = stack[stack_len - 1];
+		stack[stack_len - 1] = elem->next;
+		if (elem->tag == NODE_TAG_OBJECT_ELEM)
+			cbor_put_text(out, &elem->name);
+		value = elem->val;
+	}
+
+	free(stack);
+}
+
+/*
+ * 読み込み
+ */
+
+typedef struct cbor_decoder {
+	const unsigned char *buf;
+	size_t len;
+	size_t pos;
+
+	/* 直前に読んだ項目の先頭の位置(1から) */
+	size_t ordinal;
+
+	error_t *error;
+} cbor_decoder_t;
+
+/* 読んでいる配列かオブジェクト */
+typedef struct cbor_frame {
+	node_t *node;
+	node_t *tail;
+	uint64_t remaining; /* 残りの要素数 */
+	int indefinite; /* 長さ不定なら1で、remainingは使わない */
+	size_t index; /* for array */
+	string_t name; /* for object: 値を待っている名前 */
+	int has_name;
+} cbor_frame_t;
+
+void
+cbor_set_error(cbor_decoder_t *d)
+{
+	*d->error = (error_t){.kind = ERROR_GENERAL, .ordinal = d->ordinal};
+}
+
+/*
+ * 項目の先頭を読む。
+ *
+ * info: 長さ不定ならCBOR_INFO_INDEFINITE
+ *
+ * return: 成功なら0。エラーなら-1。
+ */
+int
+cbor_read_head(
+    cbor_decoder_t *d, enum cbor_major *major, int *info, uint64_t *arg)
+{
+	size_t n;
+
+	d->ordinal = d->pos + 1;
+	if (d->pos == d->len) {
+		logmsg("unexpected end of CBOR.\n");
+		goto error;
+	}
+
+	*major = d->buf[d->pos] >> 5;
+	*info = d->buf[d->pos] & 0x1f;
+	d->pos++;
+
+	if (*info < 24) {
+		*arg = *info;
+		return 0;
+	}
+	if (*info == CBOR_INFO_INDEFINITE) {
+		*arg = 0;
+		return 0;
+	}
+	if (*info > 27) {
+		logmsg("reserved CBOR additional information: %d\n", *info);
+		goto error;
+	}
+
+	n = (size_t)1 << (*info - 24);
+	if (d->len - d->pos < n) {
+		logmsg("unexpected end of CBOR.\n");
+		goto error;
+	}
+	*arg = 0;
+	for (size_t i = 0; i < n; i++)
+		*arg = *arg << 8 | d->buf[d->pos++];
+	return 0;
+
+error:
+	cbor_set_error(d);
+	return -1;
+}
+
+double
+cbor_half_to_double(uint16_t half)
+{
+	int exp = (half >> 10) & 0x1f;
+	int mant = half & 0x3ff;
+	double val;
+
+	if (exp == 0)
+		val = ldexp(mant, -24);
+	else if (exp != 31)
+		val = ldexp(mant + 1024, exp - 25);
+	else
+		val = mant == 0 ? INFINITY : NAN;
+	return half & 0x8000 ? -val : val;
+}
+
+/*
+ * sがUTF-8として正しければ1。冗長な符号化、サロゲート、U+10FFFFを超
+ * える符号位置は正しくない。
+ */
+int
+cbor_is_utf8(const unsigned char *s, size_t len)
+{
+	size_t i = 0;
+
+	while (i < len) {
+		unsigned char c = s[i];
+		size_t n;
+		uint32_t cp;
+
+		if (c < 0x80) {
+			i++;
+			continue;
+		}
+		if (c >= 0xc2 && c <= 0xdf) {
+			n = 1;
+			cp = c & 0x1f;
+		} else if (c >= 0xe0 && c <= 0xef) {
+			n = 2;
+			cp = c & 0x0f;
+		} else if (c >= 0xf0 && c <= 0xf4) {
+			n = 3;
+			cp = c & 0x07;
+		} else {
+			return 0;
+		}
+
+		if (len - i - 1 < n)
+			return 0;
+		for (size_t j = 1; j <= n; j++) {
+			if ((s[i + j] & 0xc0) != 0x80)
+				return 0;
+			cp = cp << 6 | (s[i + j] & 0x3f);
+		}
+		if ((n == 2 && cp < 0x800) || (n == 3 && cp < 0x10000) ||
+		    (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff)
+			return 0;
+		i += n + 1;
+	}
+	return 1;
+}
+
+/*
+ * 長さlenの文字列またはその断片をstrに加える。
+ *
+ * return: 成功なら0。エラーなら-1。
+ */
+int
+cbor_append_text(cbor_decoder_t *d, uint64_t len, string_t *str)
+{
+	if (len > d->len - d->pos) {
+		logmsg("unexpected end of CBOR.\n");
+		cbor_set_error(d);
+		return -1;
+	}
+	if (!cbor_is_utf8(d->buf + d->pos, len)) {
+		logmsg("CBOR text string is not valid UTF-8.\n");
+		cbor_set_error(d);
+		return -1;
+	}
+	string_append_n(str, (const char *)d->buf + d->pos, len);
+	d->pos += len;
+	return 0;
+}
+
+/*
+ * 文字列を読む。長さ不定なら、続く断片をつなげる。断片はそれぞれ
+ * UTF-8として正しくなければならない。
+ *
+ * return: 成功なら0。エラーなら-1で、*strは解放済み。
+ */
+int
+cbor_read_text(cbor_decoder_t *d, int info, uint64_t len, string_t *str)
+{
+	*str = string_new();
+
+	if (info != CBOR_INFO_INDEFINITE) {
+		if (cbor_append_text(d, len, str) == -1)
+			goto error;
+		return 0;
+	}
+
+	for (;;) {
+		enum cbor_major major;
+
+		if (d->pos < d->len && d->buf[d->pos] == CBOR_BREAK) {
+			d->pos++;
+			return 0;
+		}
+		if (cbor_read_head(d, &major, &info, &len) == -1)
+			goto error;
+		if (major != CBOR_MAJOR_TEXT || info == CBOR_INFO_INDEFINITE) {
+			logmsg("invalid chunk of CBOR text string.\n");
+			cbor_set_error(d);
+			goto error;
+		}
+		if (cbor_append_text(d, len, str) == -1)
+			goto error;
+	}
+
+error:
+	free(str->bytes);
+	return -1;
+}
+
+/*
+ * スカラー値を読む。配列とオブジェクトは空のノードを返し、要素は呼び
+ * 出し側が読む。
+ *
+ * len: 配列とオブジェクトの要素数
+ * indefinite: 配列とオブジェクトが長さ不定なら1
+ *
+ * return: ノード。長さ不定の項目の終わりなら*is_breakが1でNULL。エラー
+ *         ならNULL。
+ */
+node_t *
+cbor_read_value(
+    cbor_decoder_t *d, uint64_t *len, int *indefinite, int *is_break)
+{
+	enum cbor_major major;
+	int info;
+	uint64_t arg;
+	string_t str;
+	double num;
+
+	*is_break = 0;
+
+	/* タグは意味を解釈せず、中身だけを読む */
+	do {
+		if (cbor_read_head(d, &major, &info, &arg) == -1)
+			return NULL;
+	} while (major == CBOR_MAJOR_TAG && info != CBOR_INFO_INDEFINITE);
+
+	if (info == CBOR_INFO_INDEFINITE) {
+		switch (major) {
+		case CBOR_MAJOR_TEXT:
+		case CBOR_MAJOR_ARRAY:
+		case CBOR_MAJOR_MAP:
+			break;
+		case CBOR_MAJOR_SIMPLE:
+			*is_break = 1;
+			return NULL;
+		default:
+			logmsg("invalid indefinite-length CBOR item.\n");
+			cbor_set_error(d);
+			return NULL;
+		}
+	}
+
+	switch (major) {
+	case CBOR_MAJOR_UINT:
+		return node_new_with_number(d->ordinal, (double)arg);
+	case CBOR_MAJOR_NEGINT:
+		return node_new_with_number(d->ordinal, -1 - (double)arg);
+	case CBOR_MAJOR_TEXT:
+		if (cbor_read_text(d, info, arg, &str) == -1)
+			return NULL;
+		return node_new_with_string(d->ordinal, str);
+	case CBOR_MAJOR_ARRAY:
+	case CBOR_MAJOR_MAP:
+		*len = arg;
+		*indefinite = info == CBOR_INFO_INDEFINITE;
+		if (major == CBOR_MAJOR_ARRAY)
+			return node_new_array(d->ordinal);
+		return node_new_object(d->ordinal);
+	case CBOR_MAJOR_SIMPLE:
+		switch (info) {
+		case 20:
+		case 21:
+			return node_new_with_bool(d->ordinal, info == 21);
+		case 22:
+		case 23: /* undefined */
+			return node_new_null(d->ordinal);
+		case 25:
+			num = cbor_half_to_double(arg);
+			break;
+		case 26: {
+			uint32_t bits = arg;
+			float f;
+			memcpy(&f, &bits, sizeof(f));
+			num = f;
+			break;
+		}
+		case 27:
+			memcpy(&num, &arg, sizeof(num));
+			break;
+		default:
+			logmsg("unsupported CBOR simple value: %d\n", info);
+			cbor_set_error(d);
+			return NULL;
+		}
+		/* JSONの数値で表せない */
+		if (!isfinite(num)) {
+			logmsg("CBOR NaN and infinity are not supported.\n");
+			cbor_set_error(d);
+			return NULL;
+		}
+		return node_new_with_number(d->ordinal, num);
+	default:
+		logmsg("CBOR byte strings are not supported.\n");
+		cbor_set_error(d);
+		return NULL;
+	}
+}
+
+void
+cbor_frames_free(cbor_frame_t *stack, size_t stack_len)
+{
+	for (size_t i = 0; i < stack_len; i++)
+		if (stack[i].has_name)
+			free(stack[i].name.bytes);
+	free(stack);
+}
+
+/*
+ * CBORの項目を1つ読んで木にする。2^53を超える整数は丸められる。
+ *
+ * return: ルートのノード。エラーならNULLで、*errorにエラーが設定され
+ *         る。ordinalは項目の先頭のバイトの位置(1から)。
+ */
+node_t *
+jm_cbor_decode(const char *buf, size_t len, error_t *error)
+{
+	cbor_decoder_t d = {.buf = (const unsigned char *)buf,
+	    .len = len,
+	    .pos = 0,
+	    .ordinal = 0,
+	    .error = error};
+	cbor_frame_t *stack = NULL;
+	size_t stack_len = 0, stack_capacity = 0;
+	node_t *root = NULL;
+
+	for (;;) {
+		cbor_frame_t *f = stack_len > 0 ? &stack[stack_len - 1] : NULL;
+		uint64_t elems = 0;
+		int indefinite = 0, is_break;
+		node_t *value =
+		    cbor_read_value(&d, &elems, &indefinite, &is_break);
+
+		if (is_break) {
+			if (f == NULL || !f->indefinite || f->has_name) {
+				logmsg("unexpected CBOR break.\n");
+				cbor_set_error(&d);
+				goto error;
+			}
+			f->indefinite = 0;
+			f->remaining = 0;
+			goto pop;
+		}
+		if (value == NULL)
+			goto error;
+
+		if (f != NULL && f->node->tag == NODE_TAG_OBJECT &&
+		    !f->has_name) {
+			if (value->tag != NODE_TAG_STRING) {
+				logmsg("CBOR map key is not a text string.\n");
+				cbor_set_error(&d);
+				node_free(value);
+				goto error;
+			}
+			f->name = value->str;
+			f->has_name = 1;
+			free(value);
+			continue;
+		}
+
+		/* 親につなぐ */
+		if (f == NULL) {
+			root = value;
+		} else {
+			node_t *elem = f->node->tag == NODE_TAG_ARRAY
+			    ? node_new_aelem(value->ordinal, f->index++, value)
+			    : node_new_oelem(value->ordinal, f->name, value);
+			if (f->tail != NULL)
+				f->tail->next = elem;
+			else
+				f->node->head = elem;
+			f->tail = elem;
+			f->has_name = 0;
+			if (!f->indefinite)
+				f->remaining--;
+		}
+
+		if (value->tag == NODE_TAG_ARRAY ||
+		    value->tag == NODE_TAG_OBJECT) {
+			if (stack_len == stack_capacity) {
+				stack_capacity = stack_capacity == 0
+				    ? 16
+				    : stack_capacity * 2;
+				stack = xrealloc(stack,
+				    sizeof(cbor_frame_t) * stack_capacity);
+			}
+			stack[stack_len++] = (cbor_frame_t){.node = value,
+			    .tail = NULL,
+			    .remaining = elems,
+			    .indefinite = indefinite,
+			    .index = 0,
+			    .has_name = 0};
+		}
+
+	pop:
+		while (stack_len > 0 && !stack[stack_len - 1].indefinite &&
+		    stack[stack_len - 1].remaining == 0)
+			stack_len--;
+		if (stack_len == 0)
+			break;
+	}
+
+	if (d.pos != d.len) {
+		d.ordinal = d.pos + 1;
+		logmsg("unexpected data after CBOR item.\n");
+		cbor_set_error(&d);
+		goto error;
+	}
+
+	free(stack);
+	*error = (error_t){.kind = SUCCESS, .ordinal = d.pos};
+	return root;
+
+error:
+	/* 作りかけの配列とオブジェクトはrootから辿れる */
+	cbor_frames_free(stack, stack_len);
+	node_free(root);
+	return NULL;
+}
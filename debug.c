@@ -1,12 +1,14 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "jsonmodoki.h"
-#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-char *
+const char *
 token_stringify_tag(enum token_tag tag)
 {
-	static char *table[] = {[TOKEN_TAG_NULL] = "null",
+	static const char *const table[] = {[TOKEN_TAG_NULL] = "null",
 	    [TOKEN_TAG_BOOL] = "bool",
 	    [TOKEN_TAG_NUMBER] = "number",
 	    [TOKEN_TAG_STRING] = "string",
@@ -21,41 +23,82 @@ token_stringify_tag(enum token_tag tag)
 	return table[tag];
 }
 
-char *
-token_dump_str(token_t *first)
+/*
+ * トークン列をfpに書き出す。
+ *
+ * max_tokens: 0でなければ、書き出すトークンの数の上限
+ */
+void
+token_dump_fp(FILE *fp, token_t *first, size_t max_tokens)
 {
-	string_t ret;
-	ret = string_new();
+	size_t n = 0;
 
-	strprintf(&ret, "dump token:\n");
-	strprintf(&ret, "--------------------\n");
+	fputs("dump token:\n", fp);
+	fputs("--------------------\n", fp);
 
 	for (token_t *cur = first; cur != NULL; cur = cur->next) {
-		strprintf(&ret, "- ordinal: %zd\n", cur->ordinal);
-		strprintf(&ret, "  tag: %s\n", token_stringify_tag(cur->tag));
-		if (cur->tag == TOKEN_TAG_BOOL)
-			strprintf(&ret, "  boolean: %d\n", cur->boolean);
-		else if (cur->tag == TOKEN_TAG_NUMBER)
-			strprintf(&ret, "  number: %lf\n", cur->number);
-		else if (cur->tag == TOKEN_TAG_STRING)
-			strprintf(&ret, "  string: %s\n", cur->string.bytes);
+		if (max_tokens != 0 && n++ == max_tokens) {
+			fputs("- ... (truncated)\n", fp);
+			break;
+		}
+
+		fprintf(fp, "- ordinal: %zu\n", cur->ordinal);
+		fprintf(fp, "  tag: %s\n", token_stringify_tag(cur->tag));
+		if (cur->tag == TOKEN_TAG_BOOL) {
+			fprintf(fp, "  boolean: %d\n", cur->boolean);
+		} else if (cur->tag == TOKEN_TAG_NUMBER) {
+			char num[JM_DTOA_BUFSIZE];
+			jm_dtoa(cur->number, num);
+			fprintf(fp, "  number: %s\n", num);
+		} else if (cur->tag == TOKEN_TAG_STRING) {
+			fprintf(fp, "  string: %s\n", cur->string.bytes);
+		}
 	}
 
-	strprintf(&ret, "--------------------\n");
+	fputs("--------------------\n", fp);
+}
 
-	return ret.bytes;
+/*
+ * return: fpに書き出したものをmallocした文字列
+ */
+char *
+dump_str(void (*dump)(FILE *, void *), void *arg)
+{
+	char *ret;
+	size_t len;
+	FILE *fp = open_memstream(&ret, &len);
+
+	if (fp == NULL) {
+		logmsg("open_memstream failed.\n");
+		abort();
+	}
+	dump(fp, arg);
+	fclose(fp);
+	return ret;
 }
 
 void
-token_dump(token_t *first)
+token_dump_all(FILE *fp, void *first)
 {
-	printf("%s", token_dump_str(first));
+	token_dump_fp(fp, first, 0);
 }
 
 char *
+token_dump_str(token_t *first)
+{
+	return dump_str(token_dump_all, first);
+}
+
+void
+token_dump(token_t *first)
+{
+	token_dump_fp(stdout, first, 0);
+}
+
+const char *
 node_stringify_tag(enum node_tag tag)
 {
-	static char *table[] = {[NODE_TAG_NULL] = "null",
+	static const char *const table[] = {[NODE_TAG_NULL] = "null",
 	    [NODE_TAG_BOOL] = "bool",
 	    [NODE_TAG_ARRAY] = "array",
 	    [NODE_TAG_STRING] = "string",
@@ -68,69 +111,140 @@ node_stringify_tag(enum node_tag tag)
 	return table[tag];
 }
 
+/* 走査中の要素の列 */
+typedef struct dump_frame {
+	node_t *next;
+	size_t limit; /* 書き出す要素の数の上限 */
+} dump_frame_t;
+
+/*
+ * 木をfpに書き出す。再帰せず、字下げには1つのバッファを使い回す。
+ *
+ * max_depth: 0でなければ、字下げの段数の上限。それより深い要素は省く。
+ * max_elems: 0でなければ、配列やオブジェクトごとに書き出す要素の数の
+ *            上限
+ */
 void
-node_dump_str_recur(node_t *cur, string_t *buf, size_t depth)
+node_dump_fp(FILE *fp, node_t *root, size_t max_depth, size_t max_elems)
 {
-	string_t s = string_new();
-	for (size_t i = 0; i < depth; i++)
-		string_add_string(&s, "  ");
-
-	if (cur == NULL) {
-		strprintf(buf, "%s- NULL POINTER\n", s.bytes);
-		return;
+	dump_frame_t *stack = xmalloc(sizeof(dump_frame_t));
+	size_t stack_len = 1, stack_capacity = 1;
+	string_t indent = string_new();
+
+	fputs("dump node:\n", fp);
+	fputs("--------------------\n", fp);
+
+	if (root == NULL)
+		fputs("- NULL POINTER\n", fp);
+	stack[0] = (dump_frame_t){.next = root, .limit = SIZE_MAX};
+
+	while (stack_len > 0) {
+		dump_frame_t *f = &stack[stack_len - 1];
+		node_t *cur = f->next;
+		int n = (stack_len - 1) * 2; /* 字下げの幅 */
+		const char *s;
+
+		if (cur == NULL) {
+			stack_len--;
+			continue;
+		}
+
+		while (indent.len < (size_t)n + 2)
+			string_append_n(&indent, "  ", 2);
+		s = indent.bytes;
+
+		if (f->limit-- == 0) {
+			fprintf(fp, "%.*s- ... (truncated)\n", n, s);
+			stack_len--;
+			continue;
+		}
+		f->next = cur->next;
+
+		fprintf(fp, "%.*s- ordinal: %zu\n", n, s, cur->ordinal);
+		fprintf(fp, "%.*s  tag: %s\n", n, s,
+		    node_stringify_tag(cur->tag));
+
+		node_t *child = NULL;
+		size_t limit = SIZE_MAX;
+
+		switch (cur->tag) {
+		case NODE_TAG_NULL:
+			break;
+		case NODE_TAG_BOOL:
+			fprintf(fp, "%.*s  boolean: %d\n", n, s, cur->boolean);
+			break;
+		case NODE_TAG_STRING:
+			fprintf(fp, "%.*s  string: %s\n", n, s,
+			    cur->str.bytes);
+			break;
+		case NODE_TAG_NUMBER: {
+			char num[JM_DTOA_BUFSIZE];
+			jm_dtoa(cur->num, num);
+			fprintf(fp, "%.*s  number: %s\n", n, s, num);
+			break;
+		}
+		case NODE_TAG_ARRAY:
+			if (cur->packing == NODE_PACKED_DOUBLE)
+				fprintf(fp, "%.*s  packed: %zu doubles\n", n,
+				    s, cur->packed_len);
+			if (cur->packing == NODE_PACKED_INT64)
+				fprintf(fp, "%.*s  packed: %zu int64s\n", n,
+				    s, cur->packed_len);
+			/* FALLTHROUGH */
+		case NODE_TAG_OBJECT:
+			child = cur->head;
+			if (max_elems != 0)
+				limit = max_elems;
+			break;
+		case NODE_TAG_OBJECT_ELEM:
+			fprintf(fp, "%.*s  key: %s\n", n, s, cur->name.bytes);
+			child = cur->val;
+			if (child == NULL)
+				fprintf(fp, "%.*s- NULL POINTER\n", n + 2, s);
+			break;
+		case NODE_TAG_ARRAY_ELEM:
+			fprintf(fp, "%.*s  index: %zu\n", n, s, cur->index);
+			child = cur->val;
+			if (child == NULL)
+				fprintf(fp, "%.*s- NULL POINTER\n", n + 2, s);
+			break;
+		}
+
+		if (child == NULL)
+			continue;
+		if (max_depth != 0 && stack_len >= max_depth) {
+			fprintf(fp, "%.*s- ... (truncated)\n", n + 2, s);
+			continue;
+		}
+
+		if (stack_len == stack_capacity) {
+			stack_capacity *= 2;
+			stack = xrealloc(
+			    stack, sizeof(dump_frame_t) * stack_capacity);
+		}
+		stack[stack_len++] =
+		    (dump_frame_t){.next = child, .limit = limit};
 	}
 
-	strprintf(buf, "%s- ordinal: %zd\n", s.bytes, cur->ordinal);
-	strprintf(buf, "%s  tag: %s\n", s.bytes, node_stringify_tag(cur->tag));
-	switch (cur->tag) {
-	case NODE_TAG_NULL:
-		break;
-	case NODE_TAG_BOOL:
-		strprintf(buf, "%s  boolean: %d\n", s.bytes, cur->boolean);
-		break;
-	case NODE_TAG_STRING:
-		strprintf(buf, "%s  string: %s\n", s.bytes, cur->str.bytes);
-		break;
-	case NODE_TAG_NUMBER:
-		strprintf(buf, "%s  number: %lf\n", s.bytes, cur->num);
-		break;
-	case NODE_TAG_OBJECT:
-		for (node_t *oe = cur->head; oe != NULL; oe = oe->next)
-			node_dump_str_recur(oe, buf, depth + 1);
-		break;
-	case NODE_TAG_ARRAY:
-		for (node_t *ae = cur->head; ae != NULL; ae = ae->next)
-			node_dump_str_recur(ae, buf, depth + 1);
-		break;
-	case NODE_TAG_OBJECT_ELEM:
-		strprintf(buf, "%s  key: %s\n", s.bytes, cur->name.bytes);
-		node_dump_str_recur(cur->val, buf, depth + 1);
-		break;
-	case NODE_TAG_ARRAY_ELEM:
-		strprintf(buf, "%s  index: %zu\n", s.bytes, cur->index);
-		node_dump_str_recur(cur->val, buf, depth + 1);
-		break;
-	}
+	fputs("--------------------\n", fp);
+	free(indent.bytes);
+	free(stack);
+}
+
+void
+node_dump_all(FILE *fp, void *root)
+{
+	node_dump_fp(fp, root, 0, 0);
 }
 
 char *
 node_dump_str(node_t *root)
 {
-	string_t ret;
-	ret = string_new();
-
-	strprintf(&ret, "dump node:\n");
-	strprintf(&ret, "--------------------\n");
-
-	node_dump_str_recur(root, &ret, 0);
-
-	strprintf(&ret, "--------------------\n");
-
-	return ret.bytes;
+	return dump_str(node_dump_all, root);
 }
 
 void
 node_dump(node_t *root)
 {
-	printf("%s", node_dump_str(root));
+	node_dump_fp(stdout, root, 0, 0);
 }
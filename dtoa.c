@@ -0,0 +1,550 @@
+#include "jsonmodoki.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * 浮動小数点数の文字列化
+ *
+ * 読み戻すと同じ値になる最短の10進表記を作る。最短の候補が複数あれば、
+ * 元の値に最も近いものを選ぶ。Grisu3(Florian Loitsch, "Printing
+ * Floating-Point Numbers Quickly and Accurately with Integers", PLDI
+ * 2010)による。Grisu3は64ビットの整数演算の誤差のために最短と保証で
+ * きない数(0.5%ほど)を見分けるので、それらはprintf()とstrtod()で桁
+ * 数を1つずつ増やして確かめる。
+ *
+ * 2^53未満の整数は割り算だけで書く。
+ */
+
+typedef struct diy_fp {
+	uint64_t f;
+	int e;
+} diy_fp_t;
+
+#define DTOA_SIGNIFICAND_SIZE 52
+#define DTOA_HIDDEN_BIT ((uint64_t)1 << DTOA_SIGNIFICAND_SIZE)
+#define DTOA_EXPONENT_BIAS (0x3ff + DTOA_SIGNIFICAND_SIZE)
+
+/* 10^-348から10^340まで8乗ごとの10の冪。仮数は64ビットに正規化済み */
+static const diy_fp_t cached_powers[] = {
+	{0xfa8fd5a0081c0288, -1220}, /* 1e-348 */
+	{0xbaaee17fa23ebf76, -1193}, /* 1e-340 */
+	{0x8b16fb203055ac76, -1166}, /* 1e-332 */
+	{0xcf42894a5dce35ea, -1140}, /* 1e-324 */
+	{0x9a6bb0aa55653b2d, -1113}, /* 1e-316 */
+	{0xe61acf033d1a45df, -1087}, /* 1e-308 */
+	{0xab70fe17c79ac6ca, -1060}, /* 1e-300 */
+	{0xff77b1fcbebcdc4f, -1034}, /* 1e-292 */
+	{0xbe5691ef416bd60c, -1007}, /* 1e-284 */
+	{0x8dd01fad907ffc3c, -980}, /* 1e-276 */
+	{0xd3515c2831559a83, -954}, /* 1e-268 */
+	{0x9d71ac8fada6c9b5, -927}, /* 1e-260 */
+	{0xea9c227723ee8bcb, -901}, /* 1e-252 */
+	{0xaecc49914078536d, -874}, /* 1e-244 */
+	{0x823c12795db6ce57, -847}, /* 1e-236 */
+	{0xc21094364dfb5637, -821}, /* 1e-228 */
+	{0x9096ea6f3848984f, -794}, /* 1e-220 */
+	{0xd77485cb25823ac7, -768}, /* 1e-212 */
+	{0xa086cfcd97bf97f4, -741}, /* 1e-204 */
+	{0xef340a98172aace5, -715}, /* 1e-196 */
+	{0xb23867fb2a35b28e, -688}, /* 1e-188 */
+	{0x84c8d4dfd2c63f3b, -661}, /* 1e-180 */
+	{0xc5dd44271ad3cdba, -635}, /* 1e-172 */
+	{0x936b9fcebb25c996, -608}, /* 1e-164 */
+	{0xdbac6c247d62a584, -582}, /* 1e-156 */
+	{0xa3ab66580d5fdaf6, -555}, /* 1e-148 */
+	{0xf3e2f893dec3f126, -529}, /* 1e-140 */
+	{0xb5b5ada8aaff80b8, -502}, /* 1e-132 */
+	{0x87625f056c7c4a8b, -475}, /* 1e-124 */
+	{0xc9bcff6034c13053, -449}, /* 1e-116 */
+	{0x964e858c91ba2655, -422}, /* 1e-108 */
+	{0xdff9772470297ebd, -396}, /* 1e-100 */
+	{0xa6dfbd9fb8e5b88f, -369}, /* 1e-92 */
+	{0xf8a95fcf88747d94, -343}, /* 1e-84 */
+	{0xb94470938fa89bcf, -316}, /* 1e-76 */
+	{0x8a08f0f8bf0f156b, -289}, /* 1e-68 */
+	{0xcdb02555653131b6, -263}, /* 1e-60 */
+	{0x993fe2c6d07b7fac, -236}, /* 1e-52 */
+	{0xe45c10c42a2b3b06, -210}, /* 1e-44 */
+	{0xaa242499697392d3, -183}, /* 1e-36 */
+	{0xfd87b5f28300ca0e, -157}, /* 1e-28 */
+	{0xbce5086492111aeb, -130}, /* 1e-20 */
+	{0x8cbccc096f5088cc, -103}, /* 1e-12 */
+	{0xd1b71758e219652c, -77}, /* 1e-4 */
+	{0x9c40000000000000, -50}, /* 1e4 */
+	{0xe8d4a51000000000, -24}, /* 1e12 */
+	{0xad78ebc5ac620000, 3}, /* 1e20 */
+	{0x813f3978f8940984, 30}, /* 1e28 */
+	{0xc097ce7bc90715b3, 56}, /* 1e36 */
+	{0x8f7e32ce7bea5c70, 83}, /* 1e44 */
+	{0xd5d238a4abe98068, 109}, /* 1e52 */
+	{0x9f4f2726179a2245, 136}, /* 1e60 */
+	{0xed63a231d4c4fb27, 162}, /* 1e68 */
+	{0xb0de65388cc8ada8, 189}, /* 1e76 */
+	{0x83c7088e1aab65db, 216}, /* 1e84 */
+	{0xc45d1df942711d9a, 242}, /* 1e92 */
+	{0x924d692ca61be758, 269}, /* 1e100 */
+	{0xda01ee641a708dea, 295}, /* 1e108 */
+	{0xa26da3999aef774a, 322}, /* 1e116 */
+	{0xf209787bb47d6b85, 348}, /* 1e124 */
+	{0xb454e4a179dd1877, 375}, /* 1e132 */
+	{0x865b86925b9bc5c2, 402}, /* 1e140 */
+	{0xc83553c5c8965d3d, 428}, /* 1e148 */
+	{0x952ab45cfa97a0b3, 455}, /* 1e156 */
+	{0xde469fbd99a05fe3, 481}, /* 1e164 */
+	{0xa59bc234db398c25, 508}, /* 1e172 */
+	{0xf6c69a72a3989f5c, 534}, /* 1e180 */
+	{0xb7dcbf5354e9bece, 561}, /* 1e188 */
+	{0x88fcf317f22241e2, 588}, /* 1e196 */
+	{0xcc20ce9bd35c78a5, 614}, /* 1e204 */
+	{0x98165af37b2153df, 641}, /* 1e212 */
+	{0xe2a0b5dc971f303a, 667}, /* 1e220 */
+	{0xa8d9d1535ce3b396, 694}, /* 1e228 */
+	{0xfb9b7cd9a4a7443c, 720}, /* 1e236 */
+	{0xbb764c4ca7a44410, 747}, /* 1e244 */
+	{0x8bab8eefb6409c1a, 774}, /* 1e252 */
+	{0xd01fef10a657842c, 800}, /* 1e260 */
+	{0x9b10a4e5e9913129, 827}, /* 1e268 */
+	{0xe7109bfba19c0c9d, 853}, /* 1e276 */
+	{0xac2820d9623bf429, 880}, /* 1e284 */
+	{0x80444b5e7aa7cf85, 907}, /* 1e292 */
+	{0xbf21e44003acdd2d, 933}, /* 1e300 */
+	{0x8e679c2f5e44ff8f, 960}, /* 1e308 */
+	{0xd433179d9c8cb841, 986}, /* 1e316 */
+	{0x9e19db92b4e31ba9, 1013}, /* 1e324 */
+	{0xeb96bf6ebadf77d9, 1039}, /* 1e332 */
+	{0xaf87023b9bf0ee6b, 1066}, /* 1e340 */
+};
+
+static const uint64_t pow10_table[] = {1ULL, 10ULL, 100ULL, 1000ULL,
+    10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL,
+    1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+    10000000000000ULL, 100000000000000ULL, 1000000000000000ULL,
+    10000000000000000ULL, 100000000000000000ULL, 1000000000000000000ULL,
+    10000000000000000000ULL};
+
+diy_fp_t
+diy_fp_from_double(double d)
+{
+	uint64_t u;
+	int biased_e;
+	uint64_t significand;
+
+	memcpy(&u, &d, sizeof(u));
+	biased_e = (u >> DTOA_SIGNIFICAND_SIZE) & 0x7ff;
+	significand = u & (DTOA_HIDDEN_BIT - 1);
+
+	if (biased_e == 0) /* 非正規化数 */
+		return (diy_fp_t){
+		    .f = significand, .e = 1 - DTOA_EXPONENT_BIAS};
+	return (diy_fp_t){.f = significand + DTOA_HIDDEN_BIT,
+	    .e = biased_e - DTOA_EXPONENT_BIAS};
+}
+
+/*
+ * 128ビットの積の上位64ビットを丸めて返す。
+ */
+diy_fp_t
+diy_fp_multiply(diy_fp_t x, diy_fp_t y)
+{
+	const uint64_t m32 = 0xffffffffULL;
+	uint64_t a = x.f >> 32, b = x.f & m32;
+	uint64_t c = y.f >> 32, d = y.f & m32;
+	uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+	uint64_t tmp = (bd >> 32) + (ad & m32) + (bc & m32);
+
+	tmp += 1ULL << 31;
+	return (diy_fp_t){.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32),
+	    .e = x.e + y.e + 64};
+}
+
+diy_fp_t
+diy_fp_normalize(diy_fp_t x)
+{
+	while (!(x.f & (1ULL << 63))) {
+		x.f <<= 1;
+		x.e--;
+	}
+	return x;
+}
+
+/*
+ * vと隣の値との中点を、同じ指数で正規化して求める。
+ */
+void
+diy_fp_boundaries(diy_fp_t v, diy_fp_t *minus, diy_fp_t *plus)
+{
+	diy_fp_t pl = {.f = (v.f << 1) + 1, .e = v.e - 1};
+	diy_fp_t mi;
+
+	while (!(pl.f & (DTOA_HIDDEN_BIT << 1))) {
+		pl.f <<= 1;
+		pl.e--;
+	}
+	pl.f <<= 64 - DTOA_SIGNIFICAND_SIZE - 2;
+	pl.e -= 64 - DTOA_SIGNIFICAND_SIZE - 2;
+
+	/* 2の冪のすぐ下の値との間隔は半分。ただし非正規化数との間は除く */
+	if (v.f == DTOA_HIDDEN_BIT && v.e > 1 - DTOA_EXPONENT_BIAS)
+		mi = (diy_fp_t){.f = (v.f << 2) - 1, .e = v.e - 2};
+	else
+		mi = (diy_fp_t){.f = (v.f << 1) - 1, .e = v.e - 1};
+	mi.f <<= mi.e - pl.e;
+	mi.e = pl.e;
+
+	*minus = mi;
+	*plus = pl;
+}
+
+/*
+ * 2進指数eの数に掛けると指数が[-60, -32]に入る10の冪を返す。
+ *
+ * k: 10の冪の指数の符号を反転したもの
+ */
+diy_fp_t
+dtoa_cached_power(int e, int *k)
+{
+	/* 0.30102999566398114 = log10(2) */
+	double dk = (-61 - e) * 0.30102999566398114 + 347;
+	int ik = (int)dk;
+	size_t index;
+
+	if (dk - ik > 0.0)
+		ik++;
+	index = (size_t)((ik >> 3) + 1);
+	*k = -(-348 + (int)index * 8);
+	return cached_powers[index];
+}
+
+/*
+ * 末尾の桁を、範囲内に収まる限り真の値に近づける。そのうえで、掛け算
+ * の誤差(unit)があっても結果が範囲内にあり、最も近いと言えるか調べる。
+ *
+ * args: wp_w: 範囲の上端と真の値との差
+ *       delta: 範囲の幅
+ *       rest: 範囲の上端と今の桁列との差
+ *       ten_kappa: 末尾の桁の1
+ * return: 言えるなら1
+ */
+int
+dtoa_round_weed(char *buf, size_t len, uint64_t wp_w, uint64_t delta,
+    uint64_t rest, uint64_t ten_kappa, uint64_t unit)
+{
+	uint64_t wp_w_up = wp_w - unit;
+	uint64_t wp_w_down = wp_w + unit;
+
+	while (rest < wp_w_up && delta - rest >= ten_kappa &&
+	    (rest + ten_kappa < wp_w_up ||
+	        wp_w_up - rest >= rest + ten_kappa - wp_w_up)) {
+		buf[len - 1]--;
+		rest += ten_kappa;
+	}
+
+	/* 誤差の反対の端から見ると、もっと下げるべきかもしれない */
+	if (rest < wp_w_down && delta - rest >= ten_kappa &&
+	    (rest + ten_kappa < wp_w_down ||
+	        wp_w_down - rest > rest + ten_kappa - wp_w_down))
+		return 0;
+
+	/* 誤差のせいで範囲の外にあるかもしれない */
+	return 2 * unit <= rest && rest <= delta - 4 * unit;
+}
+
+int
+dtoa_count_digits(uint32_t n)
+{
+	int digits = 1;
+
+	while (n >= 10) {
+		n /= 10;
+		digits++;
+	}
+	return digits;
+}
+
+/*
+ * 誤差を見込んで広げた範囲(low, high)に入る最短の桁列を作る。
+ *
+ * return: 最短で最も近いと保証できれば1。*lenに桁数を設定し、*kには
+ *         10進指数を足す。
+ */
+int
+dtoa_digit_gen(diy_fp_t low, diy_fp_t w, diy_fp_t high, char *buf,
+    size_t *len, int *k)
+{
+	uint64_t unit = 1;
+	const diy_fp_t too_low = {.f = low.f - unit, .e = low.e};
+	const diy_fp_t too_high = {.f = high.f + unit, .e = high.e};
+	uint64_t delta = too_high.f - too_low.f;
+	const diy_fp_t one = {.f = 1ULL << -w.e, .e = w.e};
+	uint32_t p1 = (uint32_t)(too_high.f >> -one.e);
+	uint64_t p2 = too_high.f & (one.f - 1);
+	int kappa = dtoa_count_digits(p1);
+
+	*len = 0;
+
+	/* 整数部 */
+	while (kappa > 0) {
+		uint32_t d = p1 / (uint32_t)pow10_table[kappa - 1];
+		p1 %= (uint32_t)pow10_table[kappa - 1];
+		buf[(*len)++] = '0' + d;
+		kappa--;
+
+		uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+		if (rest < delta) {
+			*k += kappa;
+			return dtoa_round_weed(buf, *len, too_high.f - w.f,
+			    delta, rest, pow10_table[kappa] << -one.e, unit);
+		}
+	}
+
+	/* 小数部 */
+	for (;;) {
+		p2 *= 10;
+		unit *= 10;
+		delta *= 10;
+		buf[(*len)++] = '0' + (char)(p2 >> -one.e);
+		p2 &= one.f - 1;
+		kappa--;
+		if (p2 < delta) {
+			*k += kappa;
+			return dtoa_round_weed(buf, *len,
+			    (too_high.f - w.f) * unit, delta, p2, one.f, unit);
+		}
+	}
+}
+
+/*
+ * 正の有限な数を桁列と10進指数にする。値はbuf * 10^kになる。
+ *
+ * return: 最短で最も近いと保証できれば1。*lenに桁数を設定する。
+ */
+int
+dtoa_grisu3(double value, char *buf, size_t *len, int *k)
+{
+	diy_fp_t v = diy_fp_from_double(value);
+	diy_fp_t w_m, w_p;
+	diy_fp_t c_mk;
+
+	diy_fp_boundaries(v, &w_m, &w_p);
+	c_mk = dtoa_cached_power(w_p.e, k);
+	return dtoa_digit_gen(diy_fp_multiply(w_m, c_mk),
+	    diy_fp_multiply(diy_fp_normalize(v), c_mk),
+	    diy_fp_multiply(w_p, c_mk), buf, len, k);
+}
+
+/* 5^0から5^27まで */
+static const uint64_t pow5_table[] = {1ULL, 5ULL, 25ULL, 125ULL, 625ULL,
+    3125ULL, 15625ULL, 78125ULL, 390625ULL, 1953125ULL, 9765625ULL,
+    48828125ULL, 244140625ULL, 1220703125ULL, 6103515625ULL,
+    30517578125ULL, 152587890625ULL, 762939453125ULL, 3814697265625ULL,
+    19073486328125ULL, 95367431640625ULL, 476837158203125ULL,
+    2384185791015625ULL, 11920928955078125ULL, 59604644775390625ULL,
+    298023223876953125ULL, 1490116119384765625ULL, 7450580596923828125ULL};
+
+/*
+ * Grisu3は範囲の端を含めない。仮数が偶数なら端もvalueに読み戻される
+ * ので、端が桁列buf * 10^kより短く書けるなら、そちらが最短になる。端
+ * の値(2f ± 1) * 2^(e - 1)が短く書けるのは10^kで割り切れるときだけで、
+ * 端が整数になるe >= 1でしか起きない。
+ *
+ * return: 端のほうが短いかもしれなければ1
+ */
+int
+dtoa_boundary_may_be_shorter(double value, int k)
+{
+	diy_fp_t v = diy_fp_from_double(value);
+
+	if ((v.f & 1) != 0 || v.e < 1)
+		return 0;
+	if (k < 0)
+		return 1;
+	if (v.e - 1 < k || (size_t)k >= array_len(pow5_table))
+		return 0;
+
+	uint64_t p = pow5_table[k];
+	return (2 * v.f + 1) % p == 0 || (2 * v.f - 1) % p == 0 ||
+	    (4 * v.f - 1) % p == 0;
+}
+
+/*
+ * 桁列に末尾の桁の1を足すか(dir > 0)引く。桁数は変えず、繰り上がりや
+ * 繰り下がりで桁数が変わるなら*kを調整する。
+ */
+void
+dtoa_step(char *buf, size_t len, int *k, int dir)
+{
+	size_t i = len;
+
+	if (dir > 0) {
+		while (i > 0 && buf[i - 1] == '9')
+			buf[--i] = '0';
+		if (i > 0) {
+			buf[i - 1]++;
+		} else {
+			/* 999 -> 100e1 */
+			buf[0] = '1';
+			(*k)++;
+		}
+	} else {
+		while (i > 0 && buf[i - 1] == '0')
+			buf[--i] = '9';
+		buf[i - 1]--;
+		if (buf[0] == '0') {
+			/* 100 -> 999e-1 */
+			memset(buf, '9', len);
+			(*k)--;
+		}
+	}
+}
+
+/*
+ * 桁数を1つずつ増やしながら、読み戻すとvalueになる最初の桁列を探す。
+ * 各桁数では、printf()で正しく丸めた桁列と、それとともにvalueを挟む
+ * もう一方の桁列を試す。最短の桁列はこのどちらかにある。
+ *
+ * return: 桁数
+ */
+size_t
+dtoa_exact(double value, char *buf, int *k)
+{
+	char tmp[64];
+
+	for (int prec = 1; prec <= 17; prec++) {
+		size_t len = 0;
+		const char *p;
+
+		snprintf(tmp, sizeof(tmp), "%.*e", prec - 1, value);
+		for (p = tmp; *p != 'e'; p++)
+			if (*p >= '0' && *p <= '9')
+				buf[len++] = *p;
+		*k = atoi(p + 1) - (prec - 1);
+
+		double back = strtod(tmp, NULL);
+		if (back == value)
+			return len;
+
+		dtoa_step(buf, len, k, back < value ? 1 : -1);
+		snprintf(tmp, sizeof(tmp), "%.*se%d", (int)len, buf, *k);
+		if (strtod(tmp, NULL) == value)
+			return len;
+	}
+
+	/* 17桁あれば必ず読み戻せる */
+	BUG(1);
+	return 0;
+}
+
+size_t
+dtoa_write_uint(char *buf, uint64_t n)
+{
+	char tmp[20];
+	size_t len = 0;
+
+	do {
+		tmp[len++] = '0' + n % 10;
+		n /= 10;
+	} while (n != 0);
+
+	for (size_t i = 0; i < len; i++)
+		buf[i] = tmp[len - 1 - i];
+	return len;
+}
+
+/*
+ * 桁列digits * 10^kをJSONの数値の形にする。小数点の位置が-5桁目から
+ * 21桁目までなら指数表記にしない。
+ *
+ * return: 長さ
+ */
+size_t
+dtoa_format(char *buf, const char *digits, size_t len, int k)
+{
+	int point = (int)len + k; /* 小数点の位置 */
+	size_t n = 0;
+
+	if (k >= 0 && point <= 21) {
+		/* 123e2 -> 12300 */
+		memcpy(buf, digits, len);
+		memset(buf + len, '0', k);
+		return len + k;
+	}
+
+	if (point > 0 && point <= 21) {
+		/* 1234e-2 -> 12.34 */
+		memcpy(buf, digits, point);
+		buf[point] = '.';
+		memcpy(buf + point + 1, digits + point, len - point);
+		return len + 1;
+	}
+
+	if (point > -6 && point <= 0) {
+		/* 1234e-6 -> 0.001234 */
+		buf[n++] = '0';
+		buf[n++] = '.';
+		memset(buf + n, '0', -point);
+		n += -point;
+		memcpy(buf + n, digits, len);
+		return n + len;
+	}
+
+	/* 1234e30 -> 1.234e33 */
+	buf[n++] = digits[0];
+	if (len > 1) {
+		buf[n++] = '.';
+		memcpy(buf + n, digits + 1, len - 1);
+		n += len - 1;
+	}
+	buf[n++] = 'e';
+	if (point - 1 < 0)
+		buf[n++] = '-';
+	n += dtoa_write_uint(buf + n, point - 1 < 0 ? 1 - point : point - 1);
+	return n;
+}
+
+/*
+ * numを、読み戻すと同じ値になる短い10進表記にする。bufには
+ * JM_DTOA_BUFSIZEバイト以上必要。無限大とNaNは"inf"、"-inf"、"nan"に
+ * なるが、これらはJSONの数値ではない。
+ *
+ * return: 書き込んだ長さ。bufはnul終端される。
+ */
+size_t
+jm_dtoa(double num, char *buf)
+{
+	char digits[24];
+	size_t n = 0, len;
+	int k = 0;
+
+	if (isnan(num)) {
+		memcpy(buf, "nan", 4);
+		return 3;
+	}
+
+	if (signbit(num)) {
+		buf[n++] = '-';
+		num = -num;
+	}
+
+	if (isinf(num)) {
+		memcpy(buf + n, "inf", 4);
+		return n + 3;
+	}
+
+	/* 整数 */
+	if (num < 9007199254740992.0 && num == (double)(uint64_t)num) {
+		n += dtoa_write_uint(buf + n, (uint64_t)num);
+		buf[n] = '\0';
+		return n;
+	}
+
+	if (!dtoa_grisu3(num, digits, &len, &k) ||
+	    dtoa_boundary_may_be_shorter(num, k))
+		len = dtoa_exact(num, digits, &k);
+	n += dtoa_format(buf + n, digits, len, k);
+	buf[n] = '\0';
+	return n;
+}
@@ -0,0 +1,296 @@
+#include "jsonmodoki.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * 複数パスの抽出器
+ *
+ * 登録したJSON Pointerを1つのトライ(オートマトン)にまとめ、リーダー
+ * のイベント列の上で実行する。どのパスにも乗らない部分木は読み飛ばし、
+ * パスの終わりに着いた値だけを実体化してコールバックに渡す。したがっ
+ * て入力を1回走査するだけですべてのパスの値が得られる。
+ *
+ * 実体化した値は抽出器が持ち、コールバックをすべて呼び終えたら解放す
+ * る。深いパスの値は浅いパスの値の部分木として渡すので、コールバック
+ * は渡されたノードを解放したり、戻った後に参照したりしてはならない。
+ */
+
+size_t
+jm_extractor_add_state(jm_extractor_t *x)
+{
+	x->states = xrealloc(
+	    x->states, sizeof(jm_extractor_state_t) * (x->states_len + 1));
+	x->states[x->states_len] = (jm_extractor_state_t){.edges = NULL,
+	    .edges_len = 0,
+	    .accepts = NULL,
+	    .accepts_len = 0};
+	return x->states_len++;
+}
+
+jm_extractor_t *
+jm_extractor_new(void)
+{
+	jm_extractor_t *x = xmalloc(sizeof(jm_extractor_t));
+
+	*x = (jm_extractor_t){.states = NULL,
+	    .states_len = 0,
+	    .paths_len = 0};
+	jm_extractor_add_state(x);
+	return x;
+}
+
+void
+jm_extractor_free(jm_extractor_t *x)
+{
+	for (size_t i = 0; i < x->states_len; i++) {
+		jm_extractor_state_t *st = &x->states[i];
+		for (size_t j = 0; j < st->edges_len; j++)
+			free(st->edges[j].key.bytes);
+		free(st->edges);
+		free(st->accepts);
+	}
+	free(x->states);
+	free(x);
+}
+
+int
+jm_extractor_edge_cmp(const void *a, const void *b)
+{
+	const string_t *ka = &((const jm_extractor_edge_t *)a)->key;
+	const string_t *kb = &((const jm_extractor_edge_t *)b)->key;
+
+	if (ka->len != kb->len)
+		return ka->len < kb->len ? -1 : 1;
+	return memcmp(ka->bytes, kb->bytes, ka->len);
+}
+
+/*
+ * パスを登録する。遷移は二分探索できるようにkeyの順に挿入する。
+ *
+ * return: パスの番号(登録順に0から)。構文が誤っていれば-1。
+ */
+long
+jm_extractor_add(jm_extractor_t *x, const char *path)
+{
+	jm_pointer_t *ptr = jm_pointer_compile(path);
+	size_t state = 0;
+
+	if (ptr == NULL)
+		return -1;
+
+	for (size_t i = 0; i < ptr->len; i++) {
+		jm_extractor_state_t *st = &x->states[state];
+		jm_extractor_edge_t edge = {.key = ptr->segs[i],
+		    .index = ptr->indices[i],
+		    .target = 0};
+		size_t lo = 0, hi = st->edges_len;
+
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (jm_extractor_edge_cmp(&st->edges[mid], &edge) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if (lo < st->edges_len &&
+		    jm_extractor_edge_cmp(&st->edges[lo], &edge) == 0) {
+			state = st->edges[lo].target;
+			continue;
+		}
+
+		edge.target = jm_extractor_add_state(x);
+		st = &x->states[state]; /* reallocされたかもしれない */
+		st->edges = xrealloc(st->edges,
+		    sizeof(jm_extractor_edge_t) * (st->edges_len + 1));
+		memmove(&st->edges[lo + 1], &st->edges[lo],
+		    sizeof(jm_extractor_edge_t) * (st->edges_len - lo));
+		st->edges[lo] = edge;
+		st->edges_len++;
+		ptr->segs[i] = string_new(); /* 所有権を移した */
+		state = edge.target;
+	}
+
+	jm_extractor_state_t *st = &x->states[state];
+	st->accepts =
+	    xrealloc(st->accepts, sizeof(size_t) * (st->accepts_len + 1));
+	st->accepts[st->accepts_len++] = x->paths_len;
+
+	jm_pointer_free(ptr);
+	return x->paths_len++;
+}
+
+/*
+ * return: 遷移先の状態。なければSIZE_MAX。
+ */
+size_t
+jm_extractor_step_name(
+    const jm_extractor_t *x, size_t state, const string_t *name)
+{
+	jm_extractor_state_t *st = &x->states[state];
+	jm_extractor_edge_t key = {.key = *name};
+	jm_extractor_edge_t *e;
+
+	if (st->edges_len == 0)
+		return SIZE_MAX;
+
+	e = bsearch(&key, st->edges, st->edges_len,
+	    sizeof(jm_extractor_edge_t), jm_extractor_edge_cmp);
+	return e == NULL ? SIZE_MAX : e->target;
+}
+
+size_t
+jm_extractor_step_index(const jm_extractor_t *x, size_t state, size_t index)
+{
+	jm_extractor_state_t *st = &x->states[state];
+
+	for (size_t i = 0; i < st->edges_len; i++)
+		if (st->edges[i].index == index)
+			return st->edges[i].target;
+
+	return SIZE_MAX;
+}
+
+typedef struct extract_run {
+	const jm_extractor_t *x;
+	jm_extractor_cb cb;
+	void *ctx;
+	int stopped;
+} extract_run_t;
+
+/*
+ * 実体化した値の中にある、さらに深いパスの値を渡す。
+ */
+void
+extract_from_node(extract_run_t *run, size_t state, node_t *node)
+{
+	jm_extractor_state_t *st = &run->x->states[state];
+
+	for (size_t i = 0; i < st->accepts_len && !run->stopped; i++)
+		run->stopped = run->cb(st->accepts[i], node, run->ctx) != 0;
+
+	if (node->tag != NODE_TAG_OBJECT && node->tag != NODE_TAG_ARRAY)
+		return;
+
+	/* 詰めた配列は展開せず、要素を一時的なノードで渡す */
+	if (node->tag == NODE_TAG_ARRAY && node->packing != NODE_PACKED_NONE) {
+		for (size_t i = 0; i < node->packed_len && !run->stopped;
+		     i++) {
+			size_t target =
+			    jm_extractor_step_index(run->x, state, i);
+			node_t elem;
+			if (target == SIZE_MAX)
+				continue;
+			elem = node_packed_view(node, i);
+			extract_from_node(run, target, &elem);
+		}
+		return;
+	}
+
+	for (node_t *e = node->head; e != NULL && !run->stopped; e = e->next) {
+		size_t target = node->tag == NODE_TAG_OBJECT
+		    ? jm_extractor_step_name(run->x, state, &e->name)
+		    : jm_extractor_step_index(run->x, state, e->index);
+		if (target != SIZE_MAX)
+			extract_from_node(run, target, e->val);
+	}
+}
+
+/*
+ * 現在のイベントから始まる値をstateで処理する。
+ *
+ * return: 成功なら0。エラーなら-1。
+ */
+int
+extract_value(extract_run_t *run, jm_reader_t *r, size_t state)
+{
+	jm_extractor_state_t *st = &run->x->states[state];
+	jm_event_t ev;
+
+	if (run->stopped)
+		return jm_reader_skip(r);
+
+	if (st->accepts_len > 0) {
+		node_t *node = jm_reader_build_value(r);
+		if (node == NULL)
+			return -1;
+		extract_from_node(run, state, node);
+		node_free(node);
+		return 0;
+	}
+
+	if (st->edges_len == 0)
+		return jm_reader_skip(r);
+
+	switch (r->event.tag) {
+	case JM_EVENT_TAG_BEGIN_OBJECT:
+		for (;;) {
+			if (jm_reader_next(r, &ev) == -1)
+				return -1;
+			if (ev.tag == JM_EVENT_TAG_END_OBJECT)
+				return 0;
+
+			size_t target =
+			    jm_extractor_step_name(run->x, state, &ev.string);
+			if (target == SIZE_MAX) {
+				if (jm_reader_skip(r) == -1)
+					return -1;
+				continue;
+			}
+			if (jm_reader_next(r, &ev) == -1 ||
+			    extract_value(run, r, target) == -1)
+				return -1;
+		}
+	case JM_EVENT_TAG_BEGIN_ARRAY:
+		for (size_t index = 0;; index++) {
+			if (jm_reader_next(r, &ev) == -1)
+				return -1;
+			if (ev.tag == JM_EVENT_TAG_END_ARRAY)
+				return 0;
+
+			size_t target =
+			    jm_extractor_step_index(run->x, state, index);
+			if (target == SIZE_MAX) {
+				if (jm_reader_skip(r) == -1)
+					return -1;
+				continue;
+			}
+			if (extract_value(run, r, target) == -1)
+				return -1;
+		}
+	default:
+		/* パスはまだ続くがスカラー値だった */
+		return 0;
+	}
+}
+
+/*
+ * リーダーからルートの値を1つ読み、登録したパスの値を見つけるたびに
+ * cbに渡す。cbが0以外を返したら、それ以降の値は渡さずに読み飛ばす。
+ *
+ * NDJSONのように複数の文書を読むときは、jm_reader_next_document()と
+ * 交互に呼び出す。抽出器は書き換えないので、リーダーが別々なら同じ抽
+ * 出器を複数のスレッドから同時に使ってよい。
+ *
+ * return: 成功なら0。エラーなら-1で、r->errorにエラーが設定される。
+ */
+int
+jm_extractor_run(
+    const jm_extractor_t *x, jm_reader_t *r, jm_extractor_cb cb, void *ctx)
+{
+	extract_run_t run = {.x = x, .cb = cb, .ctx = ctx, .stopped = 0};
+
+	if (jm_reader_next(r, NULL) == -1)
+		return -1;
+	if (r->event.tag == JM_EVENT_TAG_EOF) {
+		logmsg("unexpected EOF.\n");
+		r->error = (error_t){
+		    .kind = ERROR_GENERAL, .ordinal = r->event.ordinal};
+		return -1;
+	}
+
+	return extract_value(&run, r, 0);
+}
@@ -2,6 +2,7 @@
 
 #include <errno.h>
 #include <inttypes.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,13 +13,34 @@
  * file
  */
 
+/*
+ * strはnul文字で終端していなくてもよい。
+ */
 file_t
-file_new_with_string(char *str)
+file_new_with_buffer(char *str, size_t len)
 {
 	return (file_t){.tag = FILE_TAG_STRING,
 	    .file = NULL,
 	    .str = str,
-	    .str_len = strlen(str),
+	    .str_len = len,
+	    .str_index = 0,
+	    .buf = {0},
+	    .buf_len = 0};
+}
+
+file_t
+file_new_with_string(char *str)
+{
+	return file_new_with_buffer(str, strlen(str));
+}
+
+file_t
+file_new_with_file(FILE *file)
+{
+	return (file_t){.tag = FILE_TAG_FILE,
+	    .file = file,
+	    .str = NULL,
+	    .str_len = 0,
 	    .str_index = 0,
 	    .buf = {0},
 	    .buf_len = 0};
@@ -106,6 +128,8 @@ lexer_set_general_error(lexer_t *l)
 }
 
 /*
+ * 期待と異なる文字は読まなかったことにする。
+ *
  * args: e: unsigned charとしての文字かEOF
  */
 #define lexer_expected(l, expected) \
@@ -121,6 +145,8 @@ lexer_set_general_error(lexer_t *l)
 			    glue(RESERVED, expected_), \
 			    glue(RESERVED, actual)); \
 			lexer_set_general_error(glue(RESERVED, l_)); \
+			file_unread(&glue(RESERVED, l_)->file, \
+			    glue(RESERVED, actual)); \
 			return NULL; \
 		} \
 	} while (0)
@@ -141,6 +167,8 @@ lexer_set_general_error(lexer_t *l)
 			    "actual char: %c\n", \
 			    glue(RESERVED, actual)); \
 			lexer_set_general_error(glue(RESERVED, l_)); \
+			file_unread(&glue(RESERVED, l_)->file, \
+			    glue(RESERVED, actual)); \
 			return NULL; \
 		} \
 		file_unread( \
@@ -148,18 +176,35 @@ lexer_set_general_error(lexer_t *l)
 	} while (0)
 
 lexer_t
-lexer_new_with_string(char *str)
+lexer_new(file_t file)
 {
 	return (lexer_t){.tokbuf = string_new(),
+	    .stack = string_new(),
+	    .tokfree = NULL,
 	    .tokenhead = NULL,
 	    .tokentail = NULL,
 	    .error = (error_t){.kind = ERROR_GENERAL, .ordinal = 0},
 
-	    .file = file_new_with_string(str),
+	    .file = file,
 	    .tokencurr = NULL,
 	    .ordinal = 0,
 	    .buf = {NULL},
-	    .buf_len = 0};
+	    .buf_len = 0,
+	    .ring = NULL,
+	    .tokprev = NULL,
+	    .raw = 0};
+}
+
+lexer_t
+lexer_new_with_string(char *str)
+{
+	return lexer_new(file_new_with_string(str));
+}
+
+lexer_t
+lexer_new_with_file(FILE *file)
+{
+	return lexer_new(file_new_with_file(file));
 }
 
 void
@@ -172,43 +217,59 @@ lexer_add_token(lexer_t *l, token_t *tok)
 	l->tokentail = tok;
 }
 
+/*
+ * 捨てたトークンがあれば使い回す。
+ */
 token_t *
-token_new(token_t tok)
+token_new(lexer_t *l, token_t tok)
 {
-	token_t *ret = xmalloc(sizeof(token_t));
+	token_t *ret = l->tokfree;
+
+	if (ret != NULL)
+		l->tokfree = ret->next;
+	else
+		ret = xmalloc(sizeof(token_t));
 	*ret = tok;
 	return ret;
 }
 
+void
+token_free(token_t *tok)
+{
+	if (tok->tag == TOKEN_TAG_STRING)
+		free(tok->string.bytes);
+	free(tok);
+}
+
 token_t *
-token_new_with_tag(size_t ordinal, enum token_tag tag)
+token_new_with_tag(lexer_t *l, size_t ordinal, enum token_tag tag)
 {
 	return token_new(
-	    (token_t){.ordinal = ordinal, .tag = tag, .next = NULL});
+	    l, (token_t){.ordinal = ordinal, .tag = tag, .next = NULL});
 }
 
 token_t *
-token_new_with_bool(size_t ordinal, int boolean)
+token_new_with_bool(lexer_t *l, size_t ordinal, int boolean)
 {
-	return token_new((token_t){.ordinal = ordinal,
+	return token_new(l, (token_t){.ordinal = ordinal,
 	    .tag = TOKEN_TAG_BOOL,
 	    .boolean = boolean,
 	    .next = NULL});
 }
 
 token_t *
-token_new_with_number(size_t ordinal, double number)
+token_new_with_number(lexer_t *l, size_t ordinal, double number)
 {
-	return token_new((token_t){.ordinal = ordinal,
+	return token_new(l, (token_t){.ordinal = ordinal,
 	    .tag = TOKEN_TAG_NUMBER,
 	    .number = number,
 	    .next = NULL});
 }
 
 token_t *
-token_new_with_string(size_t ordinal, string_t string)
+token_new_with_string(lexer_t *l, size_t ordinal, string_t string)
 {
-	return token_new((token_t){.ordinal = ordinal,
+	return token_new(l, (token_t){.ordinal = ordinal,
 	    .tag = TOKEN_TAG_STRING,
 	    .string = string,
 	    .next = NULL});
@@ -223,7 +284,7 @@ lexer_lex_null(lexer_t *l)
 	lexer_expected(l, 'l');
 	lexer_expected(l, 'l');
 	lexer_peek_end_value(l);
-	return token_new_with_tag(ordinal, TOKEN_TAG_NULL);
+	return token_new_with_tag(l, ordinal, TOKEN_TAG_NULL);
 }
 
 token_t *
@@ -235,7 +296,7 @@ lexer_lex_true(lexer_t *l)
 	lexer_expected(l, 'u');
 	lexer_expected(l, 'e');
 	lexer_peek_end_value(l);
-	return token_new_with_bool(ordinal, 1);
+	return token_new_with_bool(l, ordinal, 1);
 }
 
 token_t *
@@ -248,20 +309,20 @@ lexer_lex_false(lexer_t *l)
 	lexer_expected(l, 's');
 	lexer_expected(l, 'e');
 	lexer_peek_end_value(l);
-	return token_new_with_bool(ordinal, 0);
+	return token_new_with_bool(l, ordinal, 0);
 }
 
 token_t *
 lexer_lex_number(lexer_t *l)
 {
 	int c;
-	size_t ordinal;
+	size_t ordinal = 0;
 
 	/* for strtod */
 	char *rest;
 	double d;
 
-	l->tokbuf = string_new();
+	string_clear(&l->tokbuf);
 
 	enum state {
 		STATE_BEGIN,
@@ -447,6 +508,9 @@ lexer_lex_number(lexer_t *l)
 	}
 
 parse:
+	if (l->raw)
+		return token_new_with_tag(l, ordinal, TOKEN_TAG_NUMBER);
+
 	errno = 0;
 	d = strtod(l->tokbuf.bytes, &rest);
 	if (errno != 0 || l->tokbuf.bytes == rest || *rest != '\0') {
@@ -455,7 +519,7 @@ parse:
 		return NULL;
 	}
 
-	return token_new_with_number(ordinal, d);
+	return token_new_with_number(l, ordinal, d);
 }
 
 int
@@ -550,15 +614,28 @@ hexctoi(int c)
 	return -1;
 }
 
+/*
+ * エスケープを解除した文字を追加する。rawモードでは入力のまま残すので
+ * 何もしない。
+ */
+void
+lexer_add_unescaped(lexer_t *l, int c)
+{
+	if (!l->raw)
+		string_add_char(&l->tokbuf, c);
+}
+
 token_t *
 lexer_lex_string(lexer_t *l)
 {
 	int c;
 	size_t ordinal;
-	l->tokbuf = string_new();
+	string_clear(&l->tokbuf);
 
 	lexer_expected(l, '"');
 	ordinal = l->file.ordinal;
+	if (l->raw)
+		string_add_char(&l->tokbuf, '"');
 
 	enum state {
 		STATE_NORMAL,
@@ -585,6 +662,8 @@ lexer_lex_string(lexer_t *l)
 			lexer_set_general_error(l);
 			return NULL;
 		}
+		if (l->raw)
+			string_add_char(&l->tokbuf, c);
 
 		switch (st) {
 		case STATE_NORMAL: {
@@ -610,7 +689,7 @@ lexer_lex_string(lexer_t *l)
 				 * octet
 				 */
 
-				string_add_char(&l->tokbuf, c);
+				lexer_add_unescaped(l, c);
 			} else if (c == '\\') {
 				st = STATE_ESCAPE;
 			} else if (c == '"') {
@@ -618,6 +697,8 @@ lexer_lex_string(lexer_t *l)
 			} else {
 				logmsg("unexpected character: %c\n", c);
 				lexer_set_general_error(l);
+				/* 改行なら行単位の再同期に使えるよう残す */
+				file_unread(&l->file, c);
 				return NULL;
 			}
 			break;
@@ -625,35 +706,35 @@ lexer_lex_string(lexer_t *l)
 		case STATE_ESCAPE: {
 			switch (c) {
 			case '"':
-				string_add_char(&l->tokbuf, '"');
+				lexer_add_unescaped(l, '"');
 				st = STATE_NORMAL;
 				break;
 			case '\\':
-				string_add_char(&l->tokbuf, '\\');
+				lexer_add_unescaped(l, '\\');
 				st = STATE_NORMAL;
 				break;
 			case '/':
-				string_add_char(&l->tokbuf, '/');
+				lexer_add_unescaped(l, '/');
 				st = STATE_NORMAL;
 				break;
 			case 'b':
-				string_add_char(&l->tokbuf, '\b');
+				lexer_add_unescaped(l, '\b');
 				st = STATE_NORMAL;
 				break;
 			case 'f':
-				string_add_char(&l->tokbuf, '\f');
+				lexer_add_unescaped(l, '\f');
 				st = STATE_NORMAL;
 				break;
 			case 'n':
-				string_add_char(&l->tokbuf, '\n');
+				lexer_add_unescaped(l, '\n');
 				st = STATE_NORMAL;
 				break;
 			case 'r':
-				string_add_char(&l->tokbuf, '\r');
+				lexer_add_unescaped(l, '\r');
 				st = STATE_NORMAL;
 				break;
 			case 't':
-				string_add_char(&l->tokbuf, '\t');
+				lexer_add_unescaped(l, '\t');
 				st = STATE_NORMAL;
 				break;
 			case 'u':
@@ -725,7 +806,7 @@ lexer_lex_string(lexer_t *l)
 				return NULL;
 			}
 			for (int i = 0; i < len; i++)
-				string_add_char(&l->tokbuf, bytes[i]);
+				lexer_add_unescaped(l, bytes[i]);
 			st = STATE_NORMAL;
 			break;
 		}
@@ -803,7 +884,7 @@ lexer_lex_string(lexer_t *l)
 				return NULL;
 			}
 			for (int i = 0; i < len; i++)
-				string_add_char(&l->tokbuf, bytes[i]);
+				lexer_add_unescaped(l, bytes[i]);
 			st = STATE_NORMAL;
 			break;
 		}
@@ -812,87 +893,410 @@ lexer_lex_string(lexer_t *l)
 
 finish:
 	lexer_peek_end_value(l);
-	return token_new_with_string(ordinal, l->tokbuf);
+	if (l->raw)
+		return token_new_with_tag(l, ordinal, TOKEN_TAG_STRING);
+
+	/* tokbufの所有権はトークンに移すので、作業用バッファを作り直す */
+	token_t *tok = token_new_with_string(l, ordinal, l->tokbuf);
+	l->tokbuf = string_new();
+	return tok;
 }
 
-void
-lexer_lex(lexer_t *l)
+/*
+ * 次のトークンを1つだけ字句解析して返す。
+ *
+ * return: トークン。EOFに達したか、エラーが発生した場合はNULL。両者
+ *         はl->error.kindで区別する。
+ */
+token_t *
+lexer_lex_token(lexer_t *l)
 {
 	for (;;) {
 		int c = file_read(&l->file);
 		size_t ordinal = l->file.ordinal;
-		token_t *tok;
 
 		switch (c) {
 		case EOF:
 			l->error =
 			    (error_t){.kind = SUCCESS, .ordinal = ordinal};
-			return;
+			return NULL;
 		case_whitespace:
 			/* whitespace */
 			break;
 		case 'n':
 			file_unread(&l->file, c);
-			if ((tok = lexer_lex_null(l)) == NULL)
-				return;
-			lexer_add_token(l, tok);
-			break;
+			return lexer_lex_null(l);
 		case 't':
 			file_unread(&l->file, c);
-			if ((tok = lexer_lex_true(l)) == NULL)
-				return;
-			lexer_add_token(l, tok);
-			break;
+			return lexer_lex_true(l);
 		case 'f':
 			file_unread(&l->file, c);
-			if ((tok = lexer_lex_false(l)) == NULL)
-				return;
-			lexer_add_token(l, tok);
-			break;
+			return lexer_lex_false(l);
 		case_digit:
 		case '-':
 			file_unread(&l->file, c);
-			if ((tok = lexer_lex_number(l)) == NULL)
-				return;
-			lexer_add_token(l, tok);
-			break;
+			return lexer_lex_number(l);
 		case '"':
 			file_unread(&l->file, c);
-			if ((tok = lexer_lex_string(l)) == NULL)
-				return;
-			lexer_add_token(l, tok);
-			break;
+			return lexer_lex_string(l);
 		case '[':
-			lexer_add_token(l,
-			    token_new_with_tag(
-			        ordinal, TOKEN_TAG_BEGIN_ARRAY));
-			break;
+			return token_new_with_tag(
+			    l, ordinal, TOKEN_TAG_BEGIN_ARRAY);
 		case '{':
-			lexer_add_token(l,
-			    token_new_with_tag(
-			        ordinal, TOKEN_TAG_BEGIN_OBJECT));
-			break;
+			return token_new_with_tag(
+			    l, ordinal, TOKEN_TAG_BEGIN_OBJECT);
 		case ']':
-			lexer_add_token(l,
-			    token_new_with_tag(ordinal, TOKEN_TAG_END_ARRAY));
-			break;
+			return token_new_with_tag(
+			    l, ordinal, TOKEN_TAG_END_ARRAY);
 		case '}':
-			lexer_add_token(l,
-			    token_new_with_tag(ordinal, TOKEN_TAG_END_OBJECT));
-			break;
+			return token_new_with_tag(
+			    l, ordinal, TOKEN_TAG_END_OBJECT);
 		case ':':
-			lexer_add_token(l,
-			    token_new_with_tag(ordinal, TOKEN_TAG_NAME_SEP));
-			break;
+			return token_new_with_tag(
+			    l, ordinal, TOKEN_TAG_NAME_SEP);
 		case ',':
-			lexer_add_token(l,
-			    token_new_with_tag(ordinal, TOKEN_TAG_VALUE_SEP));
-			break;
+			return token_new_with_tag(
+			    l, ordinal, TOKEN_TAG_VALUE_SEP);
 		default:
 			logmsg("unexpected character: %c\n", c);
 			l->error = (error_t){
 			    .kind = ERROR_GENERAL, .ordinal = ordinal};
-			return;
+			return NULL;
+		}
+	}
+}
+
+void
+lexer_lex(lexer_t *l)
+{
+	token_t *tok;
+
+	while ((tok = lexer_lex_token(l)) != NULL)
+		lexer_add_token(l, tok);
+}
+
+/*
+ * トークン列を捨てる。トークンは後で使い回すために取っておく。
+ *
+ * args: free_strings: 文字列トークンの中身も解放するなら1。構文解析が
+ *                     成功したあとは中身をノードが所有しているので0に
+ *                     する。ノードに移した中身はトークンから外してある
+ *                     ので、1にしても二重には解放しない。
+ */
+void
+lexer_release_tokens(lexer_t *l, int free_strings)
+{
+	if (l->tokentail != NULL) {
+		if (free_strings)
+			for (token_t *tok = l->tokenhead; tok != NULL;
+			     tok = tok->next)
+				if (tok->tag == TOKEN_TAG_STRING)
+					free(tok->string.bytes);
+		l->tokentail->next = l->tokfree;
+		l->tokfree = l->tokenhead;
+	}
+
+	l->tokenhead = l->tokentail = l->tokencurr = NULL;
+	l->ordinal = 0;
+	l->buf_len = 0;
+}
+
+/*
+ * 字句解析器が持つバッファを解放する。トークン列は
+ * lexer_release_tokens()で捨てておくこと。
+ */
+void
+lexer_free(lexer_t *l)
+{
+	token_t *next;
+
+	BUG(l->tokenhead != NULL);
+	for (token_t *tok = l->tokfree; tok != NULL; tok = next) {
+		next = tok->next;
+		free(tok);
+	}
+	l->tokfree = NULL;
+	free(l->tokbuf.bytes);
+	free(l->stack.bytes);
+	l->tokbuf.bytes = l->stack.bytes = NULL;
+}
+
+/*
+ * ルートの値を1つ分だけ字句解析する。以前のトークン列は
+ * lexer_release_tokens()などで捨てておくこと。
+ *
+ * 括弧の対応だけを検査し、値が閉じた時点で止まる。それ以降の入力には
+ * 触れないので、続けて呼び出せば次の値を字句解析できる。
+ *
+ * return: 成功なら0。入力の終わりなら1。エラーなら-1。
+ */
+int
+lexer_lex_value(lexer_t *l)
+{
+	string_t *stack = &l->stack;
+	token_t *tok;
+
+	BUG(l->tokenhead != NULL);
+	string_clear(stack);
+
+	while ((tok = lexer_lex_token(l)) != NULL) {
+		lexer_add_token(l, tok);
+
+		switch (tok->tag) {
+		case TOKEN_TAG_BEGIN_ARRAY:
+			string_add_char(stack, TOKEN_TAG_END_ARRAY);
+			continue;
+		case TOKEN_TAG_BEGIN_OBJECT:
+			string_add_char(stack, TOKEN_TAG_END_OBJECT);
+			continue;
+		case TOKEN_TAG_END_ARRAY:
+		case TOKEN_TAG_END_OBJECT:
+			if (stack->len == 0 ||
+			    stack->bytes[stack->len - 1] != (char)tok->tag) {
+				logmsg("unexpected token: %s\n",
+				    token_stringify_tag(tok->tag));
+				l->error = (error_t){.kind = ERROR_GENERAL,
+				    .ordinal = tok->ordinal};
+				return -1;
+			}
+			stack->len--;
+			break;
+		default:
+			break;
+		}
+
+		if (stack->len == 0) {
+			l->error = (error_t){
+			    .kind = SUCCESS, .ordinal = tok->ordinal};
+			return 0;
+		}
+	}
+
+	if (l->error.kind != SUCCESS)
+		return -1;
+	if (l->tokenhead == NULL)
+		return 1;
+	logmsg("unexpected EOF.\n");
+	l->error.kind = ERROR_GENERAL;
+	return -1;
+}
+
+/*
+ * 読み飛ばし
+ *
+ * 括弧の深さと文字列の境界だけを追跡し、文字列のエスケープ解除や数値
+ * の変換は行わない。構文の検査もほとんど行わないので、読み飛ばした部
+ * 分に誤りがあっても検出されない。
+ */
+
+typedef struct skip_state {
+	size_t depth;
+	int in_string;
+	int escaped;
+} skip_state_t;
+
+/*
+ * return: 読み飛ばしが完了したら1。
+ */
+int
+skip_state_feed(skip_state_t *st, int c)
+{
+	if (st->in_string) {
+		if (st->escaped)
+			st->escaped = 0;
+		else if (c == '\\')
+			st->escaped = 1;
+		else if (c == '"')
+			st->in_string = 0;
+		return !st->in_string && st->depth == 0;
+	}
+
+	switch (c) {
+	case '"':
+		st->in_string = 1;
+		break;
+	case '[':
+	case '{':
+		st->depth++;
+		break;
+	case ']':
+	case '}':
+		BUG(st->depth == 0);
+		return --st->depth == 0;
+	}
+
+	return 0;
+}
+
+/*
+ * 8バイトずつ読み、wordにbと等しいバイトが含まれるかを調べる(SWAR)。
+ * https://graphics.stanford.edu/~seander/bithacks.html#ValueInWord
+ */
+#define SWAR_ONES UINT64_C(0x0101010101010101)
+#define SWAR_HIGHS UINT64_C(0x8080808080808080)
+#define swar_has_zero(v) (((v)-SWAR_ONES) & ~(v)&SWAR_HIGHS)
+#define swar_has_byte(v, b) swar_has_zero((v) ^ (SWAR_ONES * (b)))
+
+/*
+ * 文字列の外で、構造に関わらないバイトを読み飛ばす。
+ */
+const unsigned char *
+skip_plain(const unsigned char *p, const unsigned char *end)
+{
+	uint64_t w;
+
+	while (end - p >= 8) {
+		memcpy(&w, p, 8);
+		if (swar_has_byte(w, '"') || swar_has_byte(w, '[') ||
+		    swar_has_byte(w, ']') || swar_has_byte(w, '{') ||
+		    swar_has_byte(w, '}'))
+			break;
+		p += 8;
+	}
+
+	for (; p < end; p++) {
+		switch (*p) {
+		case '"':
+		case '[':
+		case ']':
+		case '{':
+		case '}':
+			return p;
+		}
+	}
+
+	return p;
+}
+
+/*
+ * 文字列の中で、'"'と'\\'以外のバイトを読み飛ばす。
+ */
+const unsigned char *
+skip_string_body(const unsigned char *p, const unsigned char *end)
+{
+	uint64_t w;
+
+	while (end - p >= 8) {
+		memcpy(&w, p, 8);
+		if (swar_has_byte(w, '"') || swar_has_byte(w, '\\'))
+			break;
+		p += 8;
+	}
+
+	for (; p < end; p++)
+		if (*p == '"' || *p == '\\')
+			return p;
+
+	return p;
+}
+
+/*
+ * return: 成功なら0。EOFに達したら-1。
+ */
+int
+file_skip(file_t *f, skip_state_t *st)
+{
+	/* unreadされた文字と実ファイルは1文字ずつ読む */
+	while (f->buf_len > 0 || f->tag == FILE_TAG_FILE) {
+		int c = file_read(f);
+		if (c == EOF)
+			return -1;
+		if (skip_state_feed(st, c))
+			return 0;
+	}
+
+	const unsigned char *begin =
+	    (const unsigned char *)f->str + f->str_index;
+	const unsigned char *end = (const unsigned char *)f->str + f->str_len;
+	const unsigned char *p = begin;
+	int done = 0;
+
+	while (p < end) {
+		if (!st->in_string)
+			p = skip_plain(p, end);
+		else if (!st->escaped)
+			p = skip_string_body(p, end);
+		if (p == end)
+			break;
+		if (skip_state_feed(st, *p++)) {
+			done = 1;
+			break;
+		}
+	}
+
+	f->str_index += p - begin;
+	f->ordinal += p - begin;
+	return done ? 0 : -1;
+}
+
+/*
+ * 配列かオブジェクトの開始の直後から、対応する終端の直後までを読み飛
+ * ばす。
+ *
+ * return: 成功なら0。エラーなら-1。
+ */
+int
+lexer_skip_container(lexer_t *l)
+{
+	skip_state_t st = {.depth = 1, .in_string = 0, .escaped = 0};
+
+	if (file_skip(&l->file, &st) == -1) {
+		logmsg("unexpected EOF\n");
+		lexer_set_general_error(l);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * 値を1つ読み飛ばす。
+ *
+ * return: 成功なら0。エラーなら-1。
+ */
+int
+lexer_skip_value(lexer_t *l)
+{
+	skip_state_t st = {.depth = 0, .in_string = 0, .escaped = 0};
+	int c;
+
+	do {
+		c = file_read(&l->file);
+	} while (c == ' ' || c == '\t' || c == '\n' || c == '\r');
+
+	switch (c) {
+	case '[':
+	case '{':
+		return lexer_skip_container(l);
+	case '"':
+		st.in_string = 1;
+		if (file_skip(&l->file, &st) == -1) {
+			logmsg("unexpected EOF\n");
+			lexer_set_general_error(l);
+			return -1;
+		}
+		return 0;
+	case EOF:
+		logmsg("unexpected EOF\n");
+		lexer_set_general_error(l);
+		return -1;
+	default:
+		/*
+		 * null, true, false, 数値。中身は検査しないが、空の値やほか
+		 * の文字で始まる値は誤り。
+		 */
+		if (c == '\0' || strchr("-0123456789tfn", c) == NULL) {
+			logmsg("unexpected character: %c\n", c);
+			lexer_set_general_error(l);
+			return -1;
+		}
+		for (;;) {
+			switch (c) {
+			case_end_value:
+				file_unread(&l->file, c);
+				return 0;
+			}
+			c = file_read(&l->file);
 		}
 	}
 }
@@ -906,6 +1310,19 @@ lexer_read(lexer_t *l)
 		return l->buf[--l->buf_len];
 	}
 
+	if (l->ring != NULL) {
+		/*
+		 * 構文解析器は直前に読んだトークンしか参照しないので、その前
+		 * のトークンを解放する。ノードに移された文字列はNULLになって
+		 * いて、残っているのは誰も所有していない文字列だけである。
+		 */
+		if (l->tokprev != NULL)
+			token_free(l->tokprev);
+		l->tokprev = jm_ring_pop(l->ring);
+		l->ordinal++;
+		return l->tokprev;
+	}
+
 	token_t *ret = l->tokencurr;
 	if (l->tokencurr != NULL)
 		l->tokencurr = l->tokencurr->next;
@@ -995,6 +1412,290 @@ node_new_with_string(size_t ordinal, string_t str)
 	    (node_t){.ordinal = ordinal, .tag = NODE_TAG_STRING, .str = str});
 }
 
+/*
+ * nodeとその子孫をすべて解放する。nodeが要素なら、後ろの兄弟は解放し
+ * ない。深い木でもスタックを使わないように、解放前のノードのnextを作
+ * 業リストとしてつなぎ直す。
+ */
+void
+node_free(node_t *node)
+{
+	node_t *list = node;
+
+	while (list != NULL) {
+		node_t *n = list;
+		list = n == node ? NULL : n->next;
+
+		if (n->val != NULL) {
+			n->val->next = list;
+			list = n->val;
+		}
+		if (n->head != NULL) {
+			node_t *tail = n->head;
+			while (tail->next != NULL)
+				tail = tail->next;
+			tail->next = list;
+			list = n->head;
+		}
+
+		free(n->str.bytes);
+		free(n->name.bytes);
+		free(n->packed);
+		free(n);
+	}
+}
+
+/*
+ * return: 名前がnameである最初の要素の値。なければNULL。
+ */
+node_t *
+node_object_get(node_t *object, const char *name)
+{
+	BUG(object->tag != NODE_TAG_OBJECT);
+
+	for (node_t *oe = object->head; oe != NULL; oe = oe->next)
+		if (strcmp(oe->name.bytes, name) == 0)
+			return oe->val;
+
+	return NULL;
+}
+
+/*
+ * 詰めた配列の要素にはノードがないので、数値を返す。木は書き換えない
+ * ので、複数のスレッドから同時に呼んでよい。
+ *
+ * args: num: NULLなら詰めた配列の要素の数値を設定しない
+ *
+ * return: index番目の要素がノードなら0で、*outに設定される。詰めた配
+ *         列の要素なら1で、*numに設定される。なければ-1。
+ */
+int
+node_array_get(node_t *array, size_t index, node_t **out, double *num)
+{
+	BUG(array->tag != NODE_TAG_ARRAY);
+
+	if (array->packing != NODE_PACKED_NONE) {
+		if (index >= array->packed_len)
+			return -1;
+		if (num != NULL)
+			*num = node_packed_get(array, index);
+		return 1;
+	}
+
+	for (node_t *ae = array->head; ae != NULL; ae = ae->next) {
+		if (ae->index == index) {
+			*out = ae->val;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * return: 要素の数。詰めた配列なら詰めた数値の数。
+ */
+size_t
+node_array_len(node_t *array)
+{
+	size_t len = 0;
+
+	BUG(array->tag != NODE_TAG_ARRAY);
+
+	if (array->packing != NODE_PACKED_NONE)
+		return array->packed_len;
+	for (node_t *ae = array->head; ae != NULL; ae = ae->next)
+		len++;
+	return len;
+}
+
+/*
+ * 詰めた配列を、要素のノードをつないだ普通の配列にする。詰めていなけ
+ * れば何もしない。要素の位置は記録していないので、要素のordinalは配列
+ * と同じにする。
+ */
+void
+node_unpack(node_t *array)
+{
+	node_t *tail = NULL;
+
+	BUG(array->tag != NODE_TAG_ARRAY);
+
+	if (array->packing == NODE_PACKED_NONE)
+		return;
+
+	for (size_t i = 0; i < array->packed_len; i++) {
+		node_t *value = node_new_with_number(
+		    array->ordinal, node_packed_get(array, i));
+		node_t *elem = node_new_aelem(array->ordinal, i, value);
+		if (tail != NULL)
+			tail->next = elem;
+		else
+			array->head = elem;
+		tail = elem;
+	}
+
+	free(array->packed);
+	array->packing = NODE_PACKED_NONE;
+	array->packed = NULL;
+	array->packed_len = 0;
+}
+
+/*
+ * return: numをNODE_PACKED_INT64で詰めてよければ1。
+ */
+int
+node_packable_int(double num)
+{
+	/* 2^53 */
+	return num == trunc(num) && fabs(num) <= 9007199254740992.0 &&
+	    !(num == 0 && signbit(num));
+}
+
+/*
+ * node_unpack()の逆。要素がすべて数値なら、parser_t.pack_numbersで構
+ * 文解析したときと同じように詰める。
+ *
+ * return: 詰めたか、すでに詰めてあれば0。詰められなければ-1。
+ */
+int
+node_pack(node_t *array)
+{
+	size_t len = 0;
+	int is_int = 1;
+
+	BUG(array->tag != NODE_TAG_ARRAY);
+
+	if (array->packing != NODE_PACKED_NONE)
+		return 0;
+	for (node_t *ae = array->head; ae != NULL; ae = ae->next, len++) {
+		if (ae->index != len || ae->val->tag != NODE_TAG_NUMBER)
+			return -1;
+		if (!node_packable_int(ae->val->num))
+			is_int = 0;
+	}
+	if (len == 0)
+		return -1;
+
+	double *nums = xmalloc(sizeof(double) * len);
+	node_t *next;
+	len = 0;
+	for (node_t *ae = array->head; ae != NULL; ae = next) {
+		if (is_int) {
+			int64_t n = (int64_t)ae->val->num;
+			memcpy(&nums[len++], &n, sizeof(n));
+		} else {
+			nums[len++] = ae->val->num;
+		}
+		next = ae->next;
+		node_free(ae);
+	}
+
+	array->head = NULL;
+	array->packing = is_int ? NODE_PACKED_INT64 : NODE_PACKED_DOUBLE;
+	array->packed = nums;
+	array->packed_len = len;
+	return 0;
+}
+
+/*
+ * 詰めた配列のindex番目の要素。
+ */
+double
+node_packed_get(node_t *array, size_t index)
+{
+	BUG(index >= array->packed_len);
+
+	switch (array->packing) {
+	case NODE_PACKED_DOUBLE:
+		return ((const double *)array->packed)[index];
+	case NODE_PACKED_INT64:
+		return ((const int64_t *)array->packed)[index];
+	default:
+		BUG(1);
+	}
+}
+
+/*
+ * 詰めた配列のindex番目の要素を、確保しない数値のノードにする。木に
+ * はつながっていないので、解放しない。要素の位置は記録していないので、
+ * ordinalは配列と同じ。
+ */
+node_t
+node_packed_view(node_t *array, size_t index)
+{
+	return (node_t){.ordinal = array->ordinal,
+	    .tag = NODE_TAG_NUMBER,
+	    .num = node_packed_get(array, index)};
+}
+
+/*
+ * return: doubleで詰めた配列なら要素の列。そうでなければNULL。
+ */
+const double *
+node_packed_doubles(node_t *array, size_t *len)
+{
+	BUG(array->tag != NODE_TAG_ARRAY);
+
+	if (array->packing != NODE_PACKED_DOUBLE)
+		return NULL;
+	*len = array->packed_len;
+	return array->packed;
+}
+
+/*
+ * return: int64_tで詰めた配列なら要素の列。そうでなければNULL。
+ */
+const int64_t *
+node_packed_ints(node_t *array, size_t *len)
+{
+	BUG(array->tag != NODE_TAG_ARRAY);
+
+	if (array->packing != NODE_PACKED_INT64)
+		return NULL;
+	*len = array->packed_len;
+	return array->packed;
+}
+
+/*
+ * 詰めているかどうかにかかわらず、数値の要素を読む。詰めた配列を展開
+ * しない。
+ *
+ * return: index番目の要素が数値なら0。そうでなければ-1。
+ */
+int
+node_array_get_number(node_t *array, size_t index, double *num)
+{
+	BUG(array->tag != NODE_TAG_ARRAY);
+
+	if (array->packing != NODE_PACKED_NONE) {
+		if (index >= array->packed_len)
+			return -1;
+		*num = node_packed_get(array, index);
+		return 0;
+	}
+
+	for (node_t *ae = array->head; ae != NULL; ae = ae->next) {
+		if (ae->index != index)
+			continue;
+		if (ae->val->tag != NODE_TAG_NUMBER)
+			return -1;
+		*num = ae->val->num;
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * 入力の範囲を消す。以後jm_serialize()はこのノードを入力から写さない。
+ */
+void
+node_clear_span(node_t *node)
+{
+	node->src = NULL;
+	node->src_len = 0;
+}
+
 /*
  * parser
  */
@@ -1026,13 +1727,57 @@ node_new_with_string(size_t ordinal, string_t str)
 	} while (0)
 
 parser_t
-parser_new_with_string(char *str)
+parser_new(lexer_t lexer)
 {
 	return (parser_t){.noderoot = NULL,
-	    .lexer = lexer_new_with_string(str),
+	    .skip_malformed = 0,
+	    .keep_spans = 0,
+	    .span_shift = 0,
+	    .pack_numbers = 0,
+	    .lexer = lexer,
 	    .error = (error_t){.kind = ERROR_GENERAL, .ordinal = 0}};
 }
 
+parser_t
+parser_new_with_string(char *str)
+{
+	return parser_new(lexer_new_with_string(str));
+}
+
+parser_t
+parser_new_with_buffer(char *str, size_t len)
+{
+	return parser_new(lexer_new(file_new_with_buffer(str, len)));
+}
+
+/*
+ * 次の入力を構文解析できるように初期化し直す。字句解析器のバッファや
+ * トークンは解放せずに使い回すので、同じ構文解析器で多数の文書を構文
+ * 解析すれば、トークンのためのメモリ確保はほとんど起きない。
+ *
+ * 構文解析が成功していれば、以前のノードはそのまま使える。
+ */
+void
+parser_reset(parser_t *p, file_t file)
+{
+	/* 成功していれば文字列はノードが所有している */
+	lexer_release_tokens(&p->lexer, p->error.kind != SUCCESS);
+	p->lexer.file = file;
+	p->lexer.error = (error_t){.kind = ERROR_GENERAL, .ordinal = 0};
+	p->noderoot = NULL;
+	p->error = (error_t){.kind = ERROR_GENERAL, .ordinal = 0};
+}
+
+/*
+ * 構文解析器が持つバッファを解放する。ノードは解放しない。
+ */
+void
+parser_free(parser_t *p)
+{
+	lexer_release_tokens(&p->lexer, p->error.kind != SUCCESS);
+	lexer_free(&p->lexer);
+}
+
 #define case_token_tag_like_value \
 	case TOKEN_TAG_NULL: \
 	case TOKEN_TAG_BOOL: \
@@ -1050,6 +1795,156 @@ parser_set_general_error(parser_t *p, token_t *tok)
 	    .kind = ERROR_GENERAL, .ordinal = tok == NULL ? 0 : tok->ordinal};
 }
 
+/*
+ * これから読む入力について、ordinalとバッファの添字の対応を求める。
+ */
+void
+parser_begin_spans(parser_t *p)
+{
+	file_t *f = &p->lexer.file;
+
+	p->span_shift = f->ordinal + f->buf_len - f->str_index;
+}
+
+/*
+ * p->keep_spansなら、開き括弧からendまでをnodeの範囲として記録する。
+ */
+node_t *
+parser_set_span(parser_t *p, node_t *node, token_t *end)
+{
+	file_t *f = &p->lexer.file;
+
+	if (p->keep_spans && f->tag == FILE_TAG_STRING) {
+		node->src = f->str + (node->ordinal - 1 - p->span_shift);
+		node->src_len = end->ordinal - node->ordinal + 1;
+	}
+	return node;
+}
+
+/* 詰めている途中の数値の配列 */
+typedef struct parser_pack {
+	int active;
+	int is_int; /* すべてNODE_PACKED_INT64で表せる */
+	double *nums;
+	size_t *ordinals; /* 詰めるのをやめたときに要素のノードに使う */
+	size_t len;
+	size_t capacity;
+} parser_pack_t;
+
+void
+parser_pack_add(parser_pack_t *pack, token_t *t)
+{
+	double num = t->number;
+
+	if (pack->len == pack->capacity) {
+		pack->capacity = pack->capacity == 0 ? 16 : pack->capacity * 2;
+		pack->nums =
+		    xrealloc(pack->nums, sizeof(double) * pack->capacity);
+		pack->ordinals =
+		    xrealloc(pack->ordinals, sizeof(size_t) * pack->capacity);
+	}
+
+	pack->nums[pack->len] = num;
+	pack->ordinals[pack->len] = t->ordinal;
+	pack->len++;
+
+	if (!node_packable_int(num))
+		pack->is_int = 0;
+}
+
+void
+parser_pack_free(parser_pack_t *pack)
+{
+	free(pack->nums);
+	free(pack->ordinals);
+	*pack = (parser_pack_t){.active = 0};
+}
+
+/*
+ * 数値でない要素が現れたので、詰めた数値を要素のノードにする。
+ *
+ * return: 最後の要素。なければNULL。
+ */
+node_t *
+parser_pack_spill(parser_pack_t *pack, node_t *array)
+{
+	node_t *tail = NULL;
+
+	for (size_t i = 0; i < pack->len; i++) {
+		node_t *value =
+		    node_new_with_number(pack->ordinals[i], pack->nums[i]);
+		node_t *elem = node_new_aelem(pack->ordinals[i], i, value);
+		if (tail != NULL)
+			tail->next = elem;
+		else
+			array->head = elem;
+		tail = elem;
+	}
+
+	parser_pack_free(pack);
+	return tail;
+}
+
+/*
+ * 閉じ括弧まで詰められたので、配列のノードに移す。
+ */
+void
+parser_pack_finish(parser_pack_t *pack, node_t *array)
+{
+	if (!pack->active || pack->len == 0) {
+		parser_pack_free(pack);
+		return;
+	}
+
+	if (pack->is_int) {
+		/* 同じ大きさなのでその場で置き換える */
+		for (size_t i = 0; i < pack->len; i++) {
+			int64_t n = (int64_t)pack->nums[i];
+			memcpy(&pack->nums[i], &n, sizeof(n));
+		}
+	}
+
+	array->packing =
+	    pack->is_int ? NODE_PACKED_INT64 : NODE_PACKED_DOUBLE;
+	array->packed = xrealloc(pack->nums, sizeof(double) * pack->len);
+	array->packed_len = pack->len;
+	pack->nums = NULL;
+	parser_pack_free(pack);
+}
+
+/*
+ * 配列の要素を1つ読んでつなぐ。
+ *
+ * return: 成功なら0。エラーなら-1。
+ */
+int
+parser_parse_array_elem(parser_t *p, token_t *t, node_t *array,
+    node_t **tail, size_t *index, parser_pack_t *pack)
+{
+	if (pack->active) {
+		if (t->tag == TOKEN_TAG_NUMBER) {
+			parser_pack_add(pack, t);
+			(*index)++;
+			return 0;
+		}
+		*tail = parser_pack_spill(pack, array);
+	}
+
+	/* tは値の構文解析中に解放されうる */
+	size_t ordinal = t->ordinal;
+	lexer_unread(&p->lexer, t);
+	node_t *node_value = parser_parse_value(p);
+	if (node_value == NULL)
+		return -1;
+	node_t *node_elem = node_new_aelem(ordinal, (*index)++, node_value);
+	if (*tail != NULL)
+		(*tail)->next = node_elem;
+	else
+		array->head = node_elem;
+	*tail = node_elem;
+	return 0;
+}
+
 node_t *
 parser_parse_array(parser_t *p)
 {
@@ -1065,46 +1960,40 @@ parser_parse_array(parser_t *p)
 
 	node_t *tail = NULL;
 	size_t index = 0;
+	parser_pack_t pack = {.active = p->pack_numbers, .is_int = 1};
 	for (;;) {
 		t = lexer_read(&p->lexer);
 		if (t == NULL) {
 			logmsg("unexpected EOF.\n");
 			parser_set_general_error(p, t);
-			return NULL;
+			goto error;
 		}
 
 		switch (st) {
 		case STATE_AFTER_BEGIN_ARRAY: {
 			switch (t->tag) {
 			case TOKEN_TAG_END_ARRAY:
-				return array;
-			case_token_tag_like_value : {
-				lexer_unread(&p->lexer, t);
-				node_t *node_value = parser_parse_value(p);
-				if (node_value == NULL)
-					return NULL;
-				node_t *node_elem = node_new_aelem(
-				    t->ordinal, index++, node_value);
-				if (tail != NULL)
-					tail->next = node_elem;
-				else
-					array->head = node_elem;
-				tail = node_elem;
+				parser_pack_finish(&pack, array);
+				return parser_set_span(p, array, t);
+			case_token_tag_like_value :
+				if (parser_parse_array_elem(p, t, array, &tail,
+				        &index, &pack) == -1)
+					goto error;
 				st = STATE_AFTER_VALUE;
 				break;
-			}
 			default:
 				logmsg("unexpected token: %s\n",
 				    token_stringify_tag(t->tag));
 				parser_set_general_error(p, t);
-				return NULL;
+				goto error;
 			}
 			break;
 		}
 		case STATE_AFTER_VALUE: {
 			switch (t->tag) {
 			case TOKEN_TAG_END_ARRAY:
-				return array;
+				parser_pack_finish(&pack, array);
+				return parser_set_span(p, array, t);
 			case TOKEN_TAG_VALUE_SEP:
 				st = STATE_AFTER_VALUE_SEP;
 				break;
@@ -1112,37 +2001,33 @@ parser_parse_array(parser_t *p)
 				logmsg("unexpected token: %s\n",
 				    token_stringify_tag(t->tag));
 				parser_set_general_error(p, t);
-				return NULL;
+				goto error;
 			}
 			break;
 		}
 		case STATE_AFTER_VALUE_SEP: {
 			switch (t->tag) {
-			case_token_tag_like_value : {
-				lexer_unread(&p->lexer, t);
-				node_t *node_value = parser_parse_value(p);
-				if (node_value == NULL)
-					return NULL;
-				node_t *node_elem = node_new_aelem(
-				    t->ordinal, index++, node_value);
-				if (tail != NULL)
-					tail->next = node_elem;
-				else
-					array->head = node_elem;
-				tail = node_elem;
+			case_token_tag_like_value :
+				if (parser_parse_array_elem(p, t, array, &tail,
+				        &index, &pack) == -1)
+					goto error;
 				st = STATE_AFTER_VALUE;
 				break;
-			}
 			default:
 				logmsg("unexpected token: %s\n",
 				    token_stringify_tag(t->tag));
 				parser_set_general_error(p, t);
-				return NULL;
+				goto error;
 			}
 			break;
 		}
 		}
 	}
+
+error:
+	parser_pack_free(&pack);
+	node_free(array);
+	return NULL;
 }
 
 node_t *
@@ -1159,7 +2044,8 @@ parser_parse_object(parser_t *p)
 		STATE_AFTER_VALUE,
 		STATE_AFTER_VALUE_SEP
 	} st = STATE_AFTER_BEGIN_OBJECT;
-	string_t name;
+	/* 名前はノードに移すまで構文解析器が所有する */
+	string_t name = {.bytes = NULL, .len = 0, .capacity = 0};
 
 	node_t *tail = NULL;
 	for (;;) {
@@ -1167,23 +2053,24 @@ parser_parse_object(parser_t *p)
 		if (t == NULL) {
 			logmsg("unexpected EOF.\n");
 			parser_set_general_error(p, t);
-			return NULL;
+			goto error;
 		}
 
 		switch (st) {
 		case STATE_AFTER_BEGIN_OBJECT: {
 			switch (t->tag) {
 			case TOKEN_TAG_END_OBJECT:
-				return object;
+				return parser_set_span(p, object, t);
 			case TOKEN_TAG_STRING:
 				name = t->string;
+				t->string.bytes = NULL;
 				st = STATE_AFTER_NAME;
 				break;
 			default:
 				logmsg("unexpected token: %s\n",
 				    token_stringify_tag(t->tag));
 				parser_set_general_error(p, t);
-				return NULL;
+				goto error;
 			}
 			break;
 		}
@@ -1196,19 +2083,22 @@ parser_parse_object(parser_t *p)
 				logmsg("unexpected token: %s\n",
 				    token_stringify_tag(t->tag));
 				parser_set_general_error(p, t);
-				return NULL;
+				goto error;
 			}
 			break;
 		}
 		case STATE_AFTER_NAME_SEP: {
 			switch (t->tag) {
 			case_token_tag_like_value : {
+				/* tは値の構文解析中に解放されうる */
+				size_t ordinal = t->ordinal;
 				lexer_unread(&p->lexer, t);
 				node_t *node_value = parser_parse_value(p);
 				if (node_value == NULL)
-					return NULL;
+					goto error;
 				node_t *node_elem = node_new_oelem(
-				    t->ordinal, name, node_value);
+				    ordinal, name, node_value);
+				name.bytes = NULL;
 				if (tail != NULL)
 					tail->next = node_elem;
 				else
@@ -1221,14 +2111,14 @@ parser_parse_object(parser_t *p)
 				logmsg("unexpected token: %s\n",
 				    token_stringify_tag(t->tag));
 				parser_set_general_error(p, t);
-				return NULL;
+				goto error;
 			}
 			break;
 		}
 		case STATE_AFTER_VALUE: {
 			switch (t->tag) {
 			case TOKEN_TAG_END_OBJECT:
-				return object;
+				return parser_set_span(p, object, t);
 			case TOKEN_TAG_VALUE_SEP:
 				st = STATE_AFTER_VALUE_SEP;
 				break;
@@ -1236,7 +2126,7 @@ parser_parse_object(parser_t *p)
 				logmsg("unexpected token: %s\n",
 				    token_stringify_tag(t->tag));
 				parser_set_general_error(p, t);
-				return NULL;
+				goto error;
 			}
 			break;
 		}
@@ -1244,18 +2134,24 @@ parser_parse_object(parser_t *p)
 			switch (t->tag) {
 			case TOKEN_TAG_STRING:
 				name = t->string;
+				t->string.bytes = NULL;
 				st = STATE_AFTER_NAME;
 				break;
 			default:
 				logmsg("unexpected token: %s\n",
 				    token_stringify_tag(t->tag));
 				parser_set_general_error(p, t);
-				return NULL;
+				goto error;
 			}
 			break;
 		}
 		}
 	}
+
+error:
+	free(name.bytes);
+	node_free(object);
+	return NULL;
 }
 
 node_t *
@@ -1272,8 +2168,12 @@ parser_parse_value(parser_t *p)
 		return node_new_with_bool(t->ordinal, t->boolean);
 	case TOKEN_TAG_NUMBER:
 		return node_new_with_number(t->ordinal, t->number);
-	case TOKEN_TAG_STRING:
-		return node_new_with_string(t->ordinal, t->string);
+	case TOKEN_TAG_STRING: {
+		/* 文字列の所有権をノードに移す */
+		node_t *node = node_new_with_string(t->ordinal, t->string);
+		t->string.bytes = NULL;
+		return node;
+	}
 	case TOKEN_TAG_BEGIN_ARRAY: {
 		lexer_unread(&p->lexer, t);
 		return parser_parse_array(p);
@@ -1292,6 +2192,7 @@ parser_parse_value(parser_t *p)
 void
 parser_parse(parser_t *p)
 {
+	parser_begin_spans(p);
 	lexer_lex(&p->lexer);
 	if (p->lexer.error.kind != SUCCESS) {
 		p->error = p->lexer.error;
@@ -1299,9 +2200,74 @@ parser_parse(parser_t *p)
 	}
 
 	p->noderoot = parser_parse_value(p);
+	if (p->noderoot == NULL)
+		return;
 	if (p->lexer.tokencurr != NULL)
 		logmsg("unexpected token: %s\n",
 		    token_stringify_tag(p->lexer.tokencurr->tag));
 	else
 		p->error.kind = SUCCESS;
 }
+
+/*
+ * 誤りのある値を捨てて、次の行の先頭まで入力を読み飛ばす。
+ */
+void
+parser_skip_line(parser_t *p)
+{
+	int c;
+
+	lexer_release_tokens(&p->lexer, 1);
+	do
+		c = file_read(&p->lexer.file);
+	while (c != '\n' && c != EOF);
+}
+
+/*
+ * 空白で区切られたルートの値(NDJSONなど)を先頭から1つずつ構文解析す
+ * る。parser_parse()とは異なり、入力全体を一度に字句解析しない。字句
+ * 解析器はレコードの間で使い回す。
+ *
+ * p->skip_malformedが0以外なら、誤りのあるレコードはその行の終わりま
+ * で読み飛ばして次のレコードを返す。
+ *
+ * return: 値を読めば0で、p->noderootに設定される。入力の終わりなら1。
+ *         エラーなら-1で、p->errorにエラーが設定される。
+ */
+int
+parser_parse_next(parser_t *p)
+{
+	for (;;) {
+		/* 前のレコードの文字列はノードが所有している */
+		lexer_release_tokens(&p->lexer, 0);
+		p->noderoot = NULL;
+		p->error = (error_t){.kind = ERROR_GENERAL, .ordinal = 0};
+
+		parser_begin_spans(p);
+		int ret = lexer_lex_value(&p->lexer);
+		if (ret == 1) {
+			p->error = p->lexer.error;
+			return 1;
+		}
+
+		if (ret == 0) {
+			p->noderoot = parser_parse_value(p);
+			if (p->noderoot != NULL) {
+				BUG(p->lexer.tokencurr != NULL ||
+				    p->lexer.buf_len != 0);
+				p->error.kind = SUCCESS;
+				return 0;
+			}
+			if (p->error.ordinal == 0)
+				p->error.ordinal = p->lexer.error.ordinal;
+		} else {
+			p->error = p->lexer.error;
+		}
+
+		if (!p->skip_malformed) {
+			lexer_release_tokens(&p->lexer, 1);
+			return -1;
+		}
+		parser_skip_line(p);
+	}
+}
@@ -1,6 +1,8 @@
 #ifndef JSONMODOKI_H
 #define JSONMODOKI_H
 
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 
 /* string.c */
@@ -13,6 +15,9 @@ typedef struct string {
 	 * なる可能性がある。reallocにより確保し直される可能性があるた
 	 * め。
 	 * https://cpprefjp.github.io/reference/string/basic_string/c_str.html
+	 *
+	 * (string_t){0}は確保していない空の文字列で、bytesはNULL。最初
+	 * に追加するときに確保する。
 	 */
 	char *bytes;
 
@@ -46,12 +51,17 @@ __attribute__((format(printf, 3, 4))) void logmsg2(
 __attribute__((format(printf, 2, 3))) int strprintf(
     string_t *dst, const char *fmt, ...);
 
-/* 省略したガード節を書きたいわけだから、条件が真ならエラー */
+/*
+ * 省略したガード節を書きたいわけだから、条件が真ならエラー
+ *
+ * ほかのスレッドが動いていても安全に止まるよう、exit()ではなく
+ * abort()する。
+ */
 #define BUG(err) \
 	do { \
 		if (err) { \
 			logmsg("BUG\n"); \
-			exit(1); \
+			abort(); \
 		} \
 	} while (0)
 
@@ -60,6 +70,12 @@ __attribute__((format(printf, 2, 3))) int strprintf(
 string_t string_new(void);
 void string_add_char(string_t *s, int c);
 void string_add_string(string_t *s, const char *str);
+void string_reserve(string_t *s, size_t len);
+void string_append_n(string_t *s, const char *str, size_t len);
+int string_vappendf(string_t *s, const char *fmt, va_list ap);
+__attribute__((format(printf, 2, 3))) int string_appendf(
+    string_t *s, const char *fmt, ...);
+void string_clear(string_t *s);
 
 /* types */
 
@@ -102,6 +118,13 @@ enum node_tag {
 	NODE_TAG_ARRAY_ELEM
 };
 
+/* 詰めた数値の配列の要素の型 */
+enum node_packing {
+	NODE_PACKED_NONE,
+	NODE_PACKED_DOUBLE, /* double[] */
+	NODE_PACKED_INT64 /* int64_t[]。すべて絶対値が2^53以下の整数 */
+};
+
 typedef struct node_t {
 	size_t ordinal;
 
@@ -118,6 +141,22 @@ typedef struct node_t {
 	struct node_t *next;
 
 	struct node_t *head; /* for array and object */
+
+	/*
+	 * for array: parser_t.pack_numbersのとき、要素がすべて数値の配列は
+	 * 要素のノードを作らずに詰めて持つ。そのときheadはNULL。
+	 */
+	enum node_packing packing;
+	void *packed;
+	size_t packed_len;
+
+	/*
+	 * for array and object: 構文解析した入力のうち、この値の範囲。
+	 * parser_t.keep_spansのときだけ記録する。部分木を書き換えたら、
+	 * 祖先も含めてnode_clear_span()で消す。
+	 */
+	const char *src;
+	size_t src_len;
 } node_t;
 
 enum file_tag { FILE_TAG_FILE, FILE_TAG_STRING };
@@ -152,6 +191,8 @@ typedef struct error_ {
 
 typedef struct lexer {
 	string_t tokbuf;
+	string_t stack; /* for lexer_lex_value */
+	token_t *tokfree; /* 使い回すトークン */
 	token_t *tokenhead;
 	token_t *tokentail;
 
@@ -164,6 +205,16 @@ typedef struct lexer {
 	token_t *buf[1]; /* stack */
 	size_t buf_len; /* <= array_len(buf) */
 
+	/* for pipelining */
+	struct jm_ring *ring; /* NULLでなければトークンはここから読む */
+	token_t *tokprev;
+
+	/*
+	 * 0以外なら、文字列と数値を変換せずに入力のままtokbufに残す。トー
+	 * クンは値を持たない。
+	 */
+	int raw;
+
 	/* etc */
 	error_t error;
 } lexer_t;
@@ -171,6 +222,19 @@ typedef struct lexer {
 typedef struct parser {
 	node_t *noderoot;
 
+	/* parser_parse_next()で誤りのあるレコードを読み飛ばす */
+	int skip_malformed;
+
+	/*
+	 * 配列とオブジェクトのノードに入力の範囲を記録する。入力がバッファ
+	 * のときだけ使え、ノードを使う間はバッファを解放してはいけない。
+	 */
+	int keep_spans;
+	size_t span_shift; /* ordinalがnの文字はstr[n - 1 - span_shift] */
+
+	/* 要素がすべて数値の配列を詰めて持つ。node_t.packingを参照 */
+	int pack_numbers;
+
 	/* lexer */
 	lexer_t lexer;
 
@@ -178,18 +242,477 @@ typedef struct parser {
 	error_t error;
 } parser_t;
 
+enum jm_event_tag {
+	JM_EVENT_TAG_NULL,
+	JM_EVENT_TAG_BOOL,
+	JM_EVENT_TAG_NUMBER,
+	JM_EVENT_TAG_STRING,
+	JM_EVENT_TAG_NAME,
+	JM_EVENT_TAG_BEGIN_ARRAY,
+	JM_EVENT_TAG_END_ARRAY,
+	JM_EVENT_TAG_BEGIN_OBJECT,
+	JM_EVENT_TAG_END_OBJECT,
+	JM_EVENT_TAG_EOF
+};
+
+typedef struct jm_event {
+	size_t ordinal;
+	enum jm_event_tag tag;
+
+	/* ルートの値が0。配列やオブジェクトの終端は開始と同じ深さ。 */
+	size_t depth;
+
+	/* for bool */
+	int boolean;
+
+	/* for number */
+	double number;
+
+	/*
+	 * for string and name
+	 *
+	 * 次にjm_reader_next()などを呼び出すと参照が無効になる。
+	 */
+	string_t string;
+} jm_event_t;
+
+typedef struct jm_reader {
+	/* トークンリストは使わず、1トークンずつ字句解析する */
+	lexer_t lexer;
+
+	/* for reading */
+	token_t *buf[1]; /* stack */
+	size_t buf_len; /* <= array_len(buf) */
+
+	/* 現在のイベントが参照しているトークン */
+	token_t *tokencurr;
+
+	/* 入れ子になった配列やオブジェクトの状態のスタック */
+	string_t stack;
+	int root_done;
+
+	/* 現在のイベント */
+	jm_event_t event;
+
+	/* etc */
+	error_t error;
+} jm_reader_t;
+
+typedef struct jm_lazy_entry {
+	/* 入力における値の範囲 [begin, end) */
+	size_t begin;
+	size_t end;
+
+	/* 次の兄弟のエントリ。部分木を1回で飛ばせる。 */
+	size_t next;
+
+	/* 実体化したノード */
+	node_t *node;
+} jm_lazy_entry_t;
+
+typedef struct jm_lazy {
+	/* nul文字終端でなくてもよい */
+	char *str;
+	size_t str_len;
+
+	/* 値の索引(文書順) */
+	jm_lazy_entry_t *entries;
+	size_t entries_len;
+	size_t entries_capacity;
+
+	/* etc */
+	error_t error;
+} jm_lazy_t;
+
+/* コンパイルしたJSON Pointer */
+typedef struct jm_pointer {
+	/* エスケープを解除したセグメント */
+	string_t *segs;
+
+	/* 配列の添字として解釈できないセグメントはSIZE_MAX */
+	size_t *indices;
+
+	size_t len;
+} jm_pointer_t;
+
+enum jm_query_op {
+	JM_QUERY_OP_CHILD,
+	JM_QUERY_OP_WILDCARD,
+	JM_QUERY_OP_DESCENT,
+	JM_QUERY_OP_INDEX,
+	JM_QUERY_OP_SLICE,
+	JM_QUERY_OP_FILTER
+};
+
+enum jm_query_cmp {
+	JM_QUERY_CMP_EQ,
+	JM_QUERY_CMP_NE,
+	JM_QUERY_CMP_LT,
+	JM_QUERY_CMP_LE,
+	JM_QUERY_CMP_GT,
+	JM_QUERY_CMP_GE
+};
+
+typedef struct jm_query_insn {
+	enum jm_query_op op;
+
+	/* for child */
+	string_t name;
+
+	/* for index */
+	long index;
+
+	/* for slice */
+	long start;
+	long end;
+	long step;
+	int has_start;
+	int has_end;
+
+	/* for filter */
+	string_t *keys;
+	size_t keys_len;
+	enum jm_query_cmp cmp;
+	node_t *literal;
+} jm_query_insn_t;
+
+/* コンパイルしたJSONPath */
+typedef struct jm_query {
+	jm_query_insn_t *insns;
+	size_t len;
+} jm_query_t;
+
+/*
+ * 詰めた配列の要素は一時的なノードで渡すので、コールバックから戻ると
+ * 無効になる。0以外を返すと走査を中断する。
+ */
+typedef int (*jm_query_cb)(node_t *match, void *ctx);
+
+/* 遅延DOMの値へのハンドル */
+typedef struct jm_lazy_value {
+	jm_lazy_t *doc;
+	size_t index;
+} jm_lazy_value_t;
+
+/* 抽出器のトライの遷移 */
+typedef struct jm_extractor_edge {
+	string_t key;
+	size_t index; /* keyが配列の添字でなければSIZE_MAX */
+	size_t target;
+} jm_extractor_edge_t;
+
+typedef struct jm_extractor_state {
+	jm_extractor_edge_t *edges; /* keyの順 */
+	size_t edges_len;
+	size_t *accepts; /* ここで終わるパスの番号 */
+	size_t accepts_len;
+} jm_extractor_state_t;
+
+/* 複数のJSON Pointerをまとめたトライ。状態0が根。 */
+typedef struct jm_extractor {
+	jm_extractor_state_t *states;
+	size_t states_len;
+	size_t paths_len;
+} jm_extractor_t;
+
+/*
+ * valueはコールバックから戻ると解放されるので、残すなら写しを取る。
+ * 0以外を返すとそれ以降の値を渡さない。
+ */
+typedef int (*jm_extractor_cb)(size_t id, node_t *value, void *ctx);
+
+/* 0以外を返すとそれ以降のレコードを渡さない */
+typedef int (*jm_ndjson_cb)(node_t *record, void *ctx);
+
+enum jm_serialize_flag {
+	JM_SERIALIZE_COMPACT = 0,
+	JM_SERIALIZE_PRETTY = 1 << 0, /* 改行と2文字の字下げ */
+	JM_SERIALIZE_PASSTHROUGH = 1 << 1 /* 範囲が残る部分木は入力のまま */
+};
+
+/* jm_parse_batch()の文書ごとの結果 */
+typedef struct jm_batch_result {
+	node_t *noderoot; /* エラーならNULL */
+	error_t error;
+} jm_batch_result_t;
+
+enum jm_writer_sink {
+	JM_WRITER_SINK_STRING,
+	JM_WRITER_SINK_FILE,
+	JM_WRITER_SINK_FD
+};
+
+/* 内部のバッファがこれ以上になったら書き出す */
+#define JM_WRITER_FLUSH_THRESHOLD 4096
+
+typedef struct jm_writer {
+	/* 書き出し先 */
+	enum jm_writer_sink sink;
+	string_t *str; /* for string */
+	FILE *fp; /* for file */
+	int fd; /* for fd */
+
+	/* まだ書き出していない出力。文字列に書き出すときは使わない */
+	string_t buf;
+	size_t flush_threshold;
+	size_t flushed; /* 書き出し済みのバイト数 */
+
+	int flags; /* enum jm_serialize_flag */
+
+	/* 入れ子になった配列やオブジェクトの状態のスタック */
+	string_t stack;
+	int root_done;
+
+	/* etc */
+	error_t error;
+} jm_writer_t;
+
+/* jm_snapshot_open()でマップしたスナップショット */
+typedef struct jm_snapshot {
+	const char *map;
+	size_t len;
+	size_t root; /* ルートのレコードの位置 */
+} jm_snapshot_t;
+
+/* スナップショットの値へのハンドル */
+typedef struct jm_snapshot_value {
+	const jm_snapshot_t *snap;
+	size_t offset;
+} jm_snapshot_value_t;
+
+/* テープDOM。語の形はtape.cを参照 */
+typedef struct jm_tape {
+	uint64_t *words;
+	size_t len;
+	size_t capacity;
+
+	/* エスケープを解除した文字列 */
+	string_t strings;
+
+	/* etc */
+	error_t error;
+} jm_tape_t;
+
+/* テープの値へのハンドル */
+typedef struct jm_tape_value {
+	const jm_tape_t *tape;
+	size_t index;
+} jm_tape_value_t;
+
+/* 配列やオブジェクトの要素をたどる */
+typedef struct jm_tape_iter {
+	const jm_tape_t *tape;
+	size_t index; /* 次の要素 */
+	size_t end; /* 終端の語 */
+	int is_object;
+} jm_tape_iter_t;
+
 /* jsonmodoki.c */
 
+file_t file_new_with_buffer(char *str, size_t len);
+file_t file_new_with_string(char *str);
+file_t file_new_with_file(FILE *file);
+int file_read(file_t *f);
+void file_unread(file_t *f, int c);
+void token_free(token_t *tok);
+token_t *lexer_lex_token(lexer_t *l);
 void lexer_lex(lexer_t *t);
+int lexer_skip_container(lexer_t *l);
+int lexer_skip_value(lexer_t *l);
+void lexer_release_tokens(lexer_t *l, int free_strings);
+void lexer_free(lexer_t *l);
+int lexer_lex_value(lexer_t *l);
+token_t *lexer_read(lexer_t *l);
+lexer_t lexer_new(file_t file);
 lexer_t lexer_new_with_string(char *str);
+lexer_t lexer_new_with_file(FILE *file);
+node_t *node_new_null(size_t ordinal);
+node_t *node_new_array(size_t ordinal);
+node_t *node_new_object(size_t ordinal);
+node_t *node_new_aelem(size_t ordinal, size_t index, node_t *value);
+node_t *node_new_oelem(size_t ordinal, string_t name, node_t *value);
+node_t *node_new_with_bool(size_t ordinal, int boolean);
+node_t *node_new_with_number(size_t ordinal, double num);
+node_t *node_new_with_string(size_t ordinal, string_t str);
+void node_free(node_t *node);
+node_t *node_object_get(node_t *object, const char *name);
+int node_array_get(
+    node_t *array, size_t index, node_t **out, double *num);
+size_t node_array_len(node_t *array);
+void node_unpack(node_t *array);
+int node_packable_int(double num);
+int node_pack(node_t *array);
+double node_packed_get(node_t *array, size_t index);
+node_t node_packed_view(node_t *array, size_t index);
+const double *node_packed_doubles(node_t *array, size_t *len);
+const int64_t *node_packed_ints(node_t *array, size_t *len);
+int node_array_get_number(node_t *array, size_t index, double *num);
+void node_clear_span(node_t *node);
+void parser_begin_spans(parser_t *p);
+node_t *parser_parse_value(parser_t *p);
 void parser_parse(parser_t *p);
+int parser_parse_next(parser_t *p);
+parser_t parser_new(lexer_t lexer);
 parser_t parser_new_with_string(char *str);
+parser_t parser_new_with_buffer(char *str, size_t len);
+void parser_reset(parser_t *p, file_t file);
+void parser_free(parser_t *p);
+
+/* reader.c */
+
+jm_reader_t jm_reader_new(lexer_t lexer);
+jm_reader_t jm_reader_new_with_string(char *str);
+jm_reader_t jm_reader_new_with_file(FILE *file);
+int jm_reader_next(jm_reader_t *r, jm_event_t *ev);
+int jm_reader_skip(jm_reader_t *r);
+int jm_reader_next_document(jm_reader_t *r);
+int jm_reader_get_bool(jm_reader_t *r, int *boolean);
+int jm_reader_get_number(jm_reader_t *r, double *number);
+int jm_reader_get_string(jm_reader_t *r, const char **str, size_t *len);
+void jm_reader_free(jm_reader_t *r);
+node_t *jm_reader_build_value(jm_reader_t *r);
+void parser_parse_projected(parser_t *p, const char **paths, size_t n);
+
+/* lazy.c */
+
+jm_lazy_t jm_lazy_new_with_buffer(char *str, size_t len);
+jm_lazy_t jm_lazy_new_with_string(char *str);
+void jm_lazy_parse(jm_lazy_t *d);
+void jm_lazy_free(jm_lazy_t *d);
+jm_lazy_value_t jm_lazy_root(jm_lazy_t *d);
+enum node_tag jm_lazy_tag(jm_lazy_value_t v);
+int jm_lazy_array_get(
+    jm_lazy_value_t array, size_t index, jm_lazy_value_t *out);
+int jm_lazy_object_get(
+    jm_lazy_value_t object, const char *name, jm_lazy_value_t *out);
+node_t *jm_lazy_node(jm_lazy_value_t v);
+
+/* pointer.c */
+
+jm_pointer_t *jm_pointer_compile(const char *str);
+node_t *jm_pointer_eval(const jm_pointer_t *ptr, node_t *root);
+node_t *jm_pointer_eval_for_update(const jm_pointer_t *ptr, node_t *root);
+void jm_pointer_free(jm_pointer_t *ptr);
+
+/* query.c */
+
+jm_query_t *jm_query_compile(const char *str);
+size_t jm_query_run(
+    const jm_query_t *q, node_t *root, jm_query_cb cb, void *ctx);
+int jm_query_first(
+    const jm_query_t *q, node_t *root, node_t **out, double *num);
+void jm_query_free(jm_query_t *q);
+
+/* extract.c */
+
+jm_extractor_t *jm_extractor_new(void);
+long jm_extractor_add(jm_extractor_t *x, const char *path);
+int jm_extractor_run(const jm_extractor_t *x, jm_reader_t *r,
+    jm_extractor_cb cb, void *ctx);
+void jm_extractor_free(jm_extractor_t *x);
+
+/* parallel.c */
+
+int jm_parse_ndjson_parallel(char *buf, size_t len, size_t nthreads,
+    int ordered, jm_ndjson_cb cb, void *ctx, error_t *error);
+void parser_parse_parallel(parser_t *p, size_t nthreads);
+token_t *jm_ring_pop(struct jm_ring *ring);
+void parser_parse_pipelined(parser_t *p, size_t ring_size);
+void jm_parse_batch(char *const docs[], const size_t lens[], size_t n,
+    jm_batch_result_t results[]);
+void jm_parse_batch_shutdown(void);
+
+/* dtoa.c */
+
+/* jm_dtoa()の出力に必要な大きさ */
+#define JM_DTOA_BUFSIZE 32
+
+size_t jm_dtoa(double num, char *buf);
+
+/* serialize.c */
+
+void serialize_string(string_t *out, const char *bytes, size_t len);
+int serialize_number(string_t *out, double num);
+void serialize_newline(string_t *out, int flags, size_t depth);
+int jm_serialize(node_t *node, string_t *out, int flags);
+
+/* writer.c */
+
+jm_writer_t jm_writer_new_with_string(string_t *out, int flags);
+jm_writer_t jm_writer_new_with_file(FILE *fp, int flags);
+jm_writer_t jm_writer_new_with_fd(int fd, int flags);
+void jm_writer_free(jm_writer_t *w);
+int jm_writer_flush(jm_writer_t *w);
+int jm_writer_key(jm_writer_t *w, const char *name);
+int jm_writer_key_raw(jm_writer_t *w, const char *json, size_t len);
+int jm_writer_begin_array(jm_writer_t *w);
+int jm_writer_end_array(jm_writer_t *w);
+int jm_writer_begin_object(jm_writer_t *w);
+int jm_writer_end_object(jm_writer_t *w);
+int jm_writer_value_null(jm_writer_t *w);
+int jm_writer_value_bool(jm_writer_t *w, int boolean);
+int jm_writer_value_number(jm_writer_t *w, double num);
+int jm_writer_value_string(jm_writer_t *w, const char *str);
+int jm_writer_value_raw(jm_writer_t *w, const char *json, size_t len);
+int jm_writer_next_document(jm_writer_t *w);
+int jm_writer_finish(jm_writer_t *w);
+
+/* reformat.c */
+
+int jm_reformat(file_t in, jm_writer_t *out, error_t *error);
+
+/* cbor.c */
+
+void jm_cbor_encode(node_t *node, string_t *out);
+node_t *jm_cbor_decode(const char *buf, size_t len, error_t *error);
+
+/* snapshot.c */
+
+int jm_snapshot_write(node_t *root, const char *path);
+jm_snapshot_t *jm_snapshot_open(const char *path);
+int jm_snapshot_validate(const jm_snapshot_t *s);
+void jm_snapshot_close(jm_snapshot_t *s);
+jm_snapshot_value_t jm_snapshot_root(const jm_snapshot_t *s);
+enum node_tag jm_snapshot_tag(jm_snapshot_value_t v);
+int jm_snapshot_bool(jm_snapshot_value_t v);
+double jm_snapshot_number(jm_snapshot_value_t v);
+const char *jm_snapshot_string(jm_snapshot_value_t v, size_t *len);
+size_t jm_snapshot_len(jm_snapshot_value_t v);
+int jm_snapshot_array_get(
+    jm_snapshot_value_t array, size_t index, jm_snapshot_value_t *out);
+int jm_snapshot_object_at(jm_snapshot_value_t object, size_t index,
+    jm_snapshot_value_t *name, jm_snapshot_value_t *value);
+int jm_snapshot_object_get(
+    jm_snapshot_value_t object, const char *name, jm_snapshot_value_t *out);
+
+/* tape.c */
+
+jm_tape_t jm_tape_new(void);
+void jm_tape_free(jm_tape_t *t);
+jm_tape_t jm_tape_copy(const jm_tape_t *t);
+int jm_tape_parse(jm_tape_t *t, file_t in);
+jm_tape_value_t jm_tape_root(const jm_tape_t *t);
+enum node_tag jm_tape_tag(jm_tape_value_t v);
+int jm_tape_bool(jm_tape_value_t v);
+double jm_tape_number(jm_tape_value_t v);
+const char *jm_tape_string(jm_tape_value_t v, size_t *len);
+jm_tape_iter_t jm_tape_iter(jm_tape_value_t container);
+int jm_tape_iter_next(
+    jm_tape_iter_t *it, jm_tape_value_t *name, jm_tape_value_t *value);
+int jm_tape_array_get(
+    jm_tape_value_t array, size_t index, jm_tape_value_t *out);
+int jm_tape_object_get(
+    jm_tape_value_t object, const char *name, jm_tape_value_t *out);
 
 /* debug.c */
 
-char *token_stringify_tag(enum token_tag tag);
+const char *token_stringify_tag(enum token_tag tag);
+void token_dump_fp(FILE *fp, token_t *first, size_t max_tokens);
 char *token_dump_str(token_t *first);
 void token_dump(token_t *first);
+void node_dump_fp(
+    FILE *fp, node_t *root, size_t max_depth, size_t max_elems);
+char *node_dump_str(node_t *root);
 void node_dump(node_t *root);
 
 #endif /* JSONMODOKI_H */
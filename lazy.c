@@ -0,0 +1,400 @@
+#include "jsonmodoki.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * 遅延DOM
+ *
+ * jm_lazy_parse()は入力を一度走査して、値の境界だけを索引に記録する。
+ * 値は文書順に並び、配列やオブジェクトの直後にはその要素が続く。オブ
+ * ジェクトの要素は名前と値の2つのエントリからなる。node_tは
+ * jm_lazy_node()で初めて参照されたときに、その値の範囲だけを構文解析
+ * して作る。
+ *
+ * 走査では括弧の対応と区切りだけを検査する。スカラー値の中身は実体化
+ * するときに検査する。
+ */
+
+/* stackの要素 */
+enum lazy_frame {
+	FRAME_ARRAY_BEGIN,
+	FRAME_ARRAY_VALUE,
+	FRAME_ARRAY_VALUE_SEP,
+	FRAME_OBJECT_BEGIN,
+	FRAME_OBJECT_NAME,
+	FRAME_OBJECT_NAME_SEP,
+	FRAME_OBJECT_VALUE,
+	FRAME_OBJECT_VALUE_SEP
+};
+
+jm_lazy_t
+jm_lazy_new_with_buffer(char *str, size_t len)
+{
+	return (jm_lazy_t){.str = str,
+	    .str_len = len,
+	    .entries = NULL,
+	    .entries_len = 0,
+	    .entries_capacity = 0,
+	    .error = (error_t){.kind = ERROR_GENERAL, .ordinal = 0}};
+}
+
+jm_lazy_t
+jm_lazy_new_with_string(char *str)
+{
+	return jm_lazy_new_with_buffer(str, strlen(str));
+}
+
+/*
+ * jm_lazy_node()で作ったノードを解放する。
+ */
+void
+jm_lazy_free_nodes(jm_lazy_t *d)
+{
+	for (size_t i = 0; i < d->entries_len; i++) {
+		node_free(d->entries[i].node);
+		d->entries[i].node = NULL;
+	}
+}
+
+void
+jm_lazy_free(jm_lazy_t *d)
+{
+	jm_lazy_free_nodes(d);
+	free(d->entries);
+	d->entries = NULL;
+	d->entries_len = d->entries_capacity = 0;
+}
+
+size_t
+jm_lazy_add_entry(jm_lazy_t *d, size_t begin)
+{
+	if (d->entries_len == d->entries_capacity) {
+		d->entries_capacity =
+		    d->entries_capacity == 0 ? 16 : d->entries_capacity * 2;
+		d->entries = xrealloc(d->entries,
+		    sizeof(jm_lazy_entry_t) * d->entries_capacity);
+	}
+
+	d->entries[d->entries_len] = (jm_lazy_entry_t){.begin = begin,
+	    .end = begin,
+	    .next = d->entries_len + 1,
+	    .node = NULL};
+	return d->entries_len++;
+}
+
+/*
+ * スカラー値か名前のエントリを追加する。
+ */
+int
+jm_lazy_add_scalar(jm_lazy_t *d, lexer_t *l)
+{
+	size_t i = jm_lazy_add_entry(d, l->file.ordinal);
+
+	if (lexer_skip_value(l) == -1)
+		return -1;
+	d->entries[i].end = l->file.ordinal;
+	return 0;
+}
+
+#define lazy_top(stack) ((stack).bytes[(stack).len - 1])
+
+/*
+ * 値を読み終えたあとの状態へ遷移する。
+ */
+void
+jm_lazy_after_value(string_t *stack, int *root_done)
+{
+	if (stack->len == 0) {
+		*root_done = 1;
+		return;
+	}
+
+	switch (lazy_top(*stack)) {
+	case FRAME_ARRAY_BEGIN:
+	case FRAME_ARRAY_VALUE_SEP:
+		lazy_top(*stack) = FRAME_ARRAY_VALUE;
+		break;
+	case FRAME_OBJECT_NAME_SEP:
+		lazy_top(*stack) = FRAME_OBJECT_VALUE;
+		break;
+	default:
+		BUG(1);
+	}
+}
+
+/*
+ * return: 値を読めば1、閉じ括弧や区切りなら0、エラーなら-1。
+ */
+int
+jm_lazy_parse_punct(jm_lazy_t *d, lexer_t *l, string_t *stack, size_t *open,
+    int *root_done, int c)
+{
+	switch (lazy_top(*stack)) {
+	case FRAME_ARRAY_BEGIN:
+	case FRAME_ARRAY_VALUE:
+	case FRAME_OBJECT_BEGIN:
+	case FRAME_OBJECT_VALUE: {
+		int is_array = lazy_top(*stack) == FRAME_ARRAY_BEGIN ||
+		    lazy_top(*stack) == FRAME_ARRAY_VALUE;
+		if (c == (is_array ? ']' : '}')) {
+			size_t i = open[stack->len - 1];
+			d->entries[i].end = l->file.ordinal;
+			d->entries[i].next = d->entries_len;
+			/* 親の状態は開いたときに遷移済み */
+			if (--stack->len == 0)
+				*root_done = 1;
+			return 0;
+		}
+		if (lazy_top(*stack) == FRAME_ARRAY_BEGIN)
+			return 1;
+		if (lazy_top(*stack) == FRAME_OBJECT_BEGIN)
+			break;
+		if (c != ',')
+			return -1;
+		lazy_top(*stack) = is_array ? FRAME_ARRAY_VALUE_SEP
+		                            : FRAME_OBJECT_VALUE_SEP;
+		return 0;
+	}
+	case FRAME_OBJECT_NAME:
+		if (c != ':')
+			return -1;
+		lazy_top(*stack) = FRAME_OBJECT_NAME_SEP;
+		return 0;
+	case FRAME_OBJECT_VALUE_SEP:
+		break;
+	default:
+		return 1;
+	}
+
+	/* 名前 */
+	if (c != '"')
+		return -1;
+	file_unread(&l->file, c);
+	if (jm_lazy_add_scalar(d, l) == -1)
+		return -1;
+	lazy_top(*stack) = FRAME_OBJECT_NAME;
+	return 0;
+}
+
+/*
+ * 値の境界を索引に記録する。
+ */
+void
+jm_lazy_parse(jm_lazy_t *d)
+{
+	lexer_t l = lexer_new(file_new_with_buffer(d->str, d->str_len));
+	string_t stack = string_new();
+	size_t *open = NULL; /* 開いている配列やオブジェクトのエントリ */
+	int root_done = 0;
+	int c;
+
+	jm_lazy_free_nodes(d);
+	d->entries_len = 0;
+
+	for (;;) {
+		c = file_read(&l.file);
+		switch (c) {
+		case ' ':
+		case '\t':
+		case '\n':
+		case '\r':
+			continue;
+		}
+
+		if (root_done) {
+			if (c != EOF)
+				goto error;
+			d->error = (error_t){
+			    .kind = SUCCESS, .ordinal = l.file.ordinal};
+			goto finish;
+		}
+
+		if (stack.len > 0) {
+			int ret = jm_lazy_parse_punct(
+			    d, &l, &stack, open, &root_done, c);
+			if (ret == -1)
+				goto error;
+			if (ret == 0)
+				continue;
+		}
+
+		/* 値 */
+		switch (c) {
+		case '[':
+		case '{': {
+			size_t i = jm_lazy_add_entry(d, l.file.ordinal - 1);
+			if (stack.len > 0)
+				jm_lazy_after_value(&stack, &root_done);
+			string_add_char(&stack,
+			    c == '[' ? FRAME_ARRAY_BEGIN : FRAME_OBJECT_BEGIN);
+			open = xrealloc(open, sizeof(size_t) * stack.len);
+			open[stack.len - 1] = i;
+			break;
+		}
+		case '"':
+		case '-':
+		case '0':
+		case '1':
+		case '2':
+		case '3':
+		case '4':
+		case '5':
+		case '6':
+		case '7':
+		case '8':
+		case '9':
+		case 't':
+		case 'f':
+		case 'n':
+			file_unread(&l.file, c);
+			if (jm_lazy_add_scalar(d, &l) == -1)
+				goto error;
+			jm_lazy_after_value(&stack, &root_done);
+			break;
+		default:
+			goto error;
+		}
+	}
+
+error:
+	if (c == EOF)
+		logmsg("unexpected EOF.\n");
+	else
+		logmsg("unexpected character: %c\n", c);
+	d->error = (error_t){.kind = ERROR_GENERAL, .ordinal = l.file.ordinal};
+
+finish:
+	free(open);
+	free(stack.bytes);
+	lexer_free(&l);
+}
+
+jm_lazy_value_t
+jm_lazy_root(jm_lazy_t *d)
+{
+	BUG(d->error.kind != SUCCESS || d->entries_len == 0);
+	return (jm_lazy_value_t){.doc = d, .index = 0};
+}
+
+enum node_tag
+jm_lazy_tag(jm_lazy_value_t v)
+{
+	switch (v.doc->str[v.doc->entries[v.index].begin]) {
+	case '[':
+		return NODE_TAG_ARRAY;
+	case '{':
+		return NODE_TAG_OBJECT;
+	case '"':
+		return NODE_TAG_STRING;
+	case 't':
+	case 'f':
+		return NODE_TAG_BOOL;
+	case 'n':
+		return NODE_TAG_NULL;
+	default:
+		return NODE_TAG_NUMBER;
+	}
+}
+
+/*
+ * return: index番目の要素があれば0。なければ-1。
+ */
+int
+jm_lazy_array_get(jm_lazy_value_t array, size_t index, jm_lazy_value_t *out)
+{
+	jm_lazy_entry_t *entries = array.doc->entries;
+	size_t end = entries[array.index].next;
+
+	BUG(jm_lazy_tag(array) != NODE_TAG_ARRAY);
+
+	for (size_t i = array.index + 1; i < end; i = entries[i].next) {
+		if (index-- == 0) {
+			*out = (jm_lazy_value_t){.doc = array.doc, .index = i};
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * 名前のエントリがnameと等しければ1。
+ */
+int
+jm_lazy_name_equal(jm_lazy_t *d, size_t i, const char *name)
+{
+	const char *raw = d->str + d->entries[i].begin + 1;
+	size_t len = d->entries[i].end - d->entries[i].begin - 2;
+
+	if (memchr(raw, '\\', len) == NULL)
+		return strlen(name) == len && memcmp(raw, name, len) == 0;
+
+	/* エスケープを含むなら字句解析して比べる */
+	lexer_t l = lexer_new(
+	    file_new_with_buffer(d->str + d->entries[i].begin, len + 2));
+	token_t *tok = lexer_lex_token(&l);
+	int ret = tok != NULL && strcmp(tok->string.bytes, name) == 0;
+	if (tok != NULL)
+		token_free(tok);
+	lexer_free(&l);
+	return ret;
+}
+
+/*
+ * return: 名前がnameである最初の要素があれば0。なければ-1。
+ */
+int
+jm_lazy_object_get(
+    jm_lazy_value_t object, const char *name, jm_lazy_value_t *out)
+{
+	jm_lazy_entry_t *entries = object.doc->entries;
+	size_t end = entries[object.index].next;
+
+	BUG(jm_lazy_tag(object) != NODE_TAG_OBJECT);
+
+	for (size_t i = object.index + 1; i < end;
+	     i = entries[i + 1].next) {
+		if (jm_lazy_name_equal(object.doc, i, name)) {
+			*out = (jm_lazy_value_t){
+			    .doc = object.doc, .index = i + 1};
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * 値を実体化する。一度作ったノードは索引に保存して使い回す。索引を書
+ * き換えるので、同じ文書に対して複数のスレッドから同時に呼び出しては
+ * いけない。
+ *
+ * return: ノード。値に誤りがあればNULLで、doc->errorにエラーが設定さ
+ *         れる。
+ */
+node_t *
+jm_lazy_node(jm_lazy_value_t v)
+{
+	jm_lazy_entry_t *e = &v.doc->entries[v.index];
+
+	if (e->node != NULL)
+		return e->node;
+
+	parser_t p =
+	    parser_new_with_buffer(v.doc->str + e->begin, e->end - e->begin);
+	/* 元の入力での位置を報告するため */
+	p.lexer.file.ordinal = e->begin;
+	parser_parse(&p);
+	if (p.error.kind != SUCCESS) {
+		v.doc->error = p.error;
+		node_free(p.noderoot);
+		parser_free(&p);
+		return NULL;
+	}
+
+	e->node = p.noderoot;
+	parser_free(&p);
+	return e->node;
+}
@@ -0,0 +1,1123 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "jsonmodoki.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * 並列構文解析
+ */
+
+/*
+ * NDJSON
+ *
+ * 入力を改行の位置でNDJSON_CHUNKバイトほどのチャンクに区切り、ワーカー
+ * は共有の位置から順にチャンクを取ってparser_parse_next()で構文解析す
+ * る。レコードは改行をまたがないので、チャンクの境界で値が分かれるこ
+ * とはない。手の空いたワーカーが次のチャンクを取るので、レコードの大
+ * きさが偏っていても負荷は偏らない。
+ *
+ * 順序を保つときは、チャンクのレコードを窓のスロットに溜めて、主スレッ
+ * ドが入力の順に渡す。窓にはnthreads * NDJSON_WINDOW個のチャンクしか
+ * 入らず、ワーカーは窓からはみ出すチャンクを取らずに待つ。したがって
+ * 溜めるレコードの数は入力の大きさによらない。
+ */
+
+#define NDJSON_CHUNK (64 * 1024)
+#define NDJSON_WINDOW 4
+
+typedef struct ndjson_slot {
+	node_t **records;
+	size_t records_len;
+	error_t error;
+	int done;
+} ndjson_slot_t;
+
+typedef struct ndjson_shared {
+	char *buf;
+	size_t len;
+	int ordered;
+	jm_ndjson_cb cb;
+	void *ctx;
+	atomic_int stop;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t taken; /* 窓が空いた、または止めた */
+	pthread_cond_t filled; /* スロットが埋まった、またはワーカーが終えた */
+	size_t cursor; /* 次のチャンクの先頭 */
+	size_t next_seq; /* 次に取るチャンクの番号 */
+	size_t delivered; /* 主スレッドが渡し終えたチャンクの数 */
+	size_t running; /* 終えていないワーカーの数 */
+	ndjson_slot_t *window;
+	size_t window_len;
+
+	/*
+	 * 順序を保たないときのエラー。見つかったうちで入力の順で最初のも
+	 * のだが、止めたために前のチャンクのエラーが見つからないことがある
+	 */
+	error_t error;
+} ndjson_shared_t;
+
+/*
+ * return: beginから始まるチャンクの終わり。NDJSON_CHUNKバイトより後の
+ *         最初の改行の直後。
+ */
+size_t
+ndjson_chunk_end(const char *buf, size_t len, size_t begin)
+{
+	char *nl;
+
+	if (len - begin <= NDJSON_CHUNK)
+		return len;
+	nl = memchr(
+	    buf + begin + NDJSON_CHUNK, '\n', len - begin - NDJSON_CHUNK);
+	return nl == NULL ? len : (size_t)(nl - buf) + 1;
+}
+
+/*
+ * 次のチャンクを取る。順序を保つときは、窓に空きができるまで待つ。
+ *
+ * return: チャンクを取れば0。入力の終わりか、止めたなら-1。
+ */
+int
+ndjson_take(ndjson_shared_t *sh, size_t *begin, size_t *end, size_t *seq)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&sh->mutex);
+	while (sh->ordered && !atomic_load(&sh->stop) &&
+	    sh->cursor < sh->len &&
+	    sh->next_seq - sh->delivered >= sh->window_len)
+		pthread_cond_wait(&sh->taken, &sh->mutex);
+
+	if (!atomic_load(&sh->stop) && sh->cursor < sh->len) {
+		*begin = sh->cursor;
+		*end = ndjson_chunk_end(sh->buf, sh->len, *begin);
+		*seq = sh->next_seq++;
+		sh->cursor = *end;
+		ret = 0;
+	} else if (--sh->running == 0) {
+		pthread_cond_signal(&sh->filled);
+	}
+	pthread_mutex_unlock(&sh->mutex);
+	return ret;
+}
+
+/*
+ * [begin, end)のレコードを構文解析する。順序を保たないならその場でcb
+ * に渡し、保つならslotに溜める。
+ */
+void
+ndjson_parse_chunk(
+    ndjson_shared_t *sh, size_t begin, size_t end, ndjson_slot_t *slot)
+{
+	parser_t p = parser_new_with_buffer(sh->buf + begin, end - begin);
+	size_t capacity = 0;
+	int ret = 0;
+
+	/* 元の入力での位置を報告するため */
+	p.lexer.file.ordinal = begin;
+
+	while (!atomic_load_explicit(&sh->stop, memory_order_relaxed) &&
+	    (ret = parser_parse_next(&p)) == 0) {
+		if (!sh->ordered) {
+			if (atomic_load(&sh->stop))
+				node_free(p.noderoot);
+			else if (sh->cb(p.noderoot, sh->ctx) != 0)
+				atomic_store(&sh->stop, 1);
+			continue;
+		}
+		if (slot->records_len == capacity) {
+			capacity = capacity == 0 ? 64 : capacity * 2;
+			slot->records = xrealloc(
+			    slot->records, sizeof(node_t *) * capacity);
+		}
+		slot->records[slot->records_len++] = p.noderoot;
+	}
+
+	if (ret == -1)
+		slot->error = p.error;
+	parser_free(&p);
+}
+
+void *
+ndjson_worker(void *arg)
+{
+	ndjson_shared_t *sh = arg;
+	size_t begin, end, seq;
+
+	while (ndjson_take(sh, &begin, &end, &seq) == 0) {
+		ndjson_slot_t slot = {.records = NULL,
+		    .records_len = 0,
+		    .error = (error_t){.kind = SUCCESS, .ordinal = 0},
+		    .done = 1};
+
+		ndjson_parse_chunk(sh, begin, end, &slot);
+
+		pthread_mutex_lock(&sh->mutex);
+		if (sh->ordered) {
+			sh->window[seq % sh->window_len] = slot;
+			/* これより後ろは渡さないので、もう取らない */
+			if (slot.error.kind != SUCCESS)
+				sh->cursor = sh->len;
+			pthread_cond_signal(&sh->filled);
+		} else if (slot.error.kind != SUCCESS) {
+			if (sh->error.kind == SUCCESS ||
+			    slot.error.ordinal < sh->error.ordinal)
+				sh->error = slot.error;
+			/* 順序を保たないなら、ほかのワーカーも止める */
+			atomic_store(&sh->stop, 1);
+		}
+		pthread_mutex_unlock(&sh->mutex);
+	}
+
+	return NULL;
+}
+
+/*
+ * 窓から入力の順にチャンクを取り出し、そのレコードをcbに渡す。cbが0以
+ * 外を返すか、誤りのあるチャンクに着いたら止める。止めた後のレコード
+ * は解放する。
+ *
+ * return: 成功なら0。誤りのあるレコードがあれば-1で、errorがNULLでな
+ *         ければ設定する。
+ */
+int
+ndjson_deliver(ndjson_shared_t *sh, error_t *error)
+{
+	for (size_t seq = 0;; seq++) {
+		ndjson_slot_t *slot = &sh->window[seq % sh->window_len];
+		ndjson_slot_t chunk;
+
+		pthread_mutex_lock(&sh->mutex);
+		while (!slot->done && (seq < sh->next_seq || sh->running > 0))
+			pthread_cond_wait(&sh->filled, &sh->mutex);
+		chunk = *slot;
+		*slot = (ndjson_slot_t){.records = NULL, .done = 0};
+		sh->delivered++;
+		pthread_cond_broadcast(&sh->taken);
+		pthread_mutex_unlock(&sh->mutex);
+
+		if (!chunk.done)
+			return 0;
+
+		for (size_t i = 0; i < chunk.records_len; i++)
+			if (atomic_load(&sh->stop))
+				node_free(chunk.records[i]);
+			else if (sh->cb(chunk.records[i], sh->ctx) != 0)
+				atomic_store(&sh->stop, 1);
+		free(chunk.records);
+
+		if (chunk.error.kind != SUCCESS) {
+			if (error != NULL)
+				*error = chunk.error;
+			return -1;
+		}
+		if (atomic_load(&sh->stop))
+			return 0;
+	}
+}
+
+/*
+ * NDJSONのbufを複数のスレッドで構文解析し、レコードごとにcbを呼び出
+ * す。
+ *
+ * orderedが0以外なら、cbは呼び出し元のスレッドから入力の順に呼び出さ
+ * れる。0なら、cbはワーカーのスレッドから順不同かつ並行に呼び出される
+ * ので、cbはスレッド安全でなければならない。どちらでもcbが0以外を返
+ * すと、それ以降のレコードは渡さない(順不同のときは、すでに構文解析中
+ * のレコードがいくつか渡されることがある)。
+ *
+ * 渡したレコードのノードの所有権はcbに移る。渡さなかったレコードは解
+ * 放する。
+ *
+ * スレッドを1つも作れなければ、レコードを渡さずに-1を返す。エラーの
+ * 位置は0。
+ *
+ * return: 成功なら0。誤りのあるレコードがあれば-1で、errorがNULLでな
+ *         ければエラーが設定される。順序を保つときは入力の順で最初
+ *         のエラーで、そのレコードより前のレコードはすべてcbに渡さ
+ *         れる。順序を保たないときは、エラーを見つけたところで止め
+ *         るので、どれかのレコードのエラーで、入力の順で最初とは限ら
+ *         ない。
+ */
+int
+jm_parse_ndjson_parallel(char *buf, size_t len, size_t nthreads,
+    int ordered, jm_ndjson_cb cb, void *ctx, error_t *error)
+{
+	ndjson_shared_t sh = {.buf = buf,
+	    .len = len,
+	    .ordered = ordered,
+	    .cb = cb,
+	    .ctx = ctx,
+	    .cursor = 0,
+	    .next_seq = 0,
+	    .delivered = 0,
+	    .window = NULL,
+	    .window_len = 0,
+	    .error = (error_t){.kind = SUCCESS, .ordinal = 0}};
+	pthread_t *threads;
+	int ret = 0;
+
+	if (nthreads == 0)
+		nthreads = 1;
+	atomic_init(&sh.stop, 0);
+	pthread_mutex_init(&sh.mutex, NULL);
+	pthread_cond_init(&sh.taken, NULL);
+	pthread_cond_init(&sh.filled, NULL);
+	sh.running = nthreads;
+	if (ordered) {
+		sh.window_len = nthreads * NDJSON_WINDOW;
+		sh.window = xmalloc(sizeof(ndjson_slot_t) * sh.window_len);
+		for (size_t i = 0; i < sh.window_len; i++)
+			sh.window[i] =
+			    (ndjson_slot_t){.records = NULL, .done = 0};
+	}
+	threads = xmalloc(sizeof(pthread_t) * nthreads);
+
+	size_t created;
+	for (created = 0; created < nthreads; created++)
+		if (pthread_create(&threads[created], NULL, ndjson_worker,
+		        &sh) != 0)
+			break;
+	if (created < nthreads) {
+		/* 作れた分のスレッドで続ける */
+		logmsg("pthread_create failed.\n");
+		pthread_mutex_lock(&sh.mutex);
+		sh.running -= nthreads - created;
+		if (sh.running == 0)
+			pthread_cond_signal(&sh.filled);
+		pthread_mutex_unlock(&sh.mutex);
+		nthreads = created;
+	}
+	if (nthreads == 0) {
+		ret = -1;
+		if (error != NULL)
+			*error =
+			    (error_t){.kind = ERROR_GENERAL, .ordinal = 0};
+		goto done;
+	}
+
+	if (ordered) {
+		ret = ndjson_deliver(&sh, error);
+
+		/* 窓が空くのを待っているワーカーを終わらせる */
+		pthread_mutex_lock(&sh.mutex);
+		atomic_store(&sh.stop, 1);
+		pthread_cond_broadcast(&sh.taken);
+		pthread_mutex_unlock(&sh.mutex);
+	}
+
+	for (size_t i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	if (!ordered && sh.error.kind != SUCCESS) {
+		ret = -1;
+		if (error != NULL)
+			*error = sh.error;
+	}
+
+	/* 止めた後に構文解析したレコード */
+	for (size_t i = 0; i < sh.window_len; i++) {
+		for (size_t j = 0; j < sh.window[i].records_len; j++)
+			node_free(sh.window[i].records[j]);
+		free(sh.window[i].records);
+	}
+
+done:
+	pthread_cond_destroy(&sh.filled);
+	pthread_cond_destroy(&sh.taken);
+	pthread_mutex_destroy(&sh.mutex);
+	free(sh.window);
+	free(threads);
+	return ret;
+}
+
+/*
+ * 大きな1つの配列
+ *
+ * 1. 区間ごとに、文字列の外から始まる場合と中から始まる場合の両方につ
+ *    いて、終わりの状態と深さの変化を求める。区間はバックスラッシュの
+ *    直後から始めないので、エスケープの直後から始まることはない。
+ * 2. 前から順に各区間の本当の開始状態を決め、どちらかの結果を選ぶ。走
+ *    査し直す区間はない。
+ * 3. 区間ごとに深さ1の区切り(ルートの括弧とカンマ)を集める。
+ * 4. 区切りの間の要素を分担して構文解析し、ルートの配列につなぐ。
+ */
+
+enum scan_state { SCAN_OUTSIDE, SCAN_STRING, SCAN_ESCAPE };
+
+typedef struct scan_chunk {
+	char *str;
+	size_t begin;
+	size_t end;
+
+	enum scan_state start; /* 開始時の状態 */
+	enum scan_state state; /* 終了時の状態 */
+	long depth_start;
+	long depth; /* 区間内での深さの変化 */
+
+	/* 文字列の中から始まった場合のstateとdepth */
+	enum scan_state string_state;
+	long string_depth;
+
+	/* 深さ1の区切りの位置 */
+	size_t *seps;
+	size_t seps_len;
+} scan_chunk_t;
+
+/*
+ * args: collect: 区切りの位置を集めるなら1。c->depth_startが確定して
+ *                いること。
+ */
+void
+scan_chunk(scan_chunk_t *c, int collect)
+{
+	enum scan_state st = c->start;
+	long depth = collect ? c->depth_start : 0;
+
+	for (size_t i = c->begin; i < c->end; i++) {
+		char ch = c->str[i];
+
+		switch (st) {
+		case SCAN_ESCAPE:
+			st = SCAN_STRING;
+			continue;
+		case SCAN_STRING:
+			if (ch == '\\')
+				st = SCAN_ESCAPE;
+			else if (ch == '"')
+				st = SCAN_OUTSIDE;
+			continue;
+		case SCAN_OUTSIDE:
+			break;
+		}
+
+		switch (ch) {
+		case '"':
+			st = SCAN_STRING;
+			continue;
+		case '[':
+		case '{':
+			depth++;
+			if (!collect || depth != 1)
+				continue;
+			break;
+		case ']':
+		case '}':
+			depth--;
+			if (!collect || depth != 0)
+				continue;
+			break;
+		case ',':
+			if (!collect || depth != 1)
+				continue;
+			break;
+		default:
+			continue;
+		}
+
+		c->seps =
+		    xrealloc(c->seps, sizeof(size_t) * (c->seps_len + 1));
+		c->seps[c->seps_len++] = i;
+	}
+
+	c->state = st;
+	if (!collect)
+		c->depth = depth;
+}
+
+void *
+scan_worker(void *arg)
+{
+	scan_chunk_t *c = arg;
+
+	c->start = SCAN_STRING;
+	scan_chunk(c, 0);
+	c->string_state = c->state;
+	c->string_depth = c->depth;
+
+	c->start = SCAN_OUTSIDE;
+	scan_chunk(c, 0);
+	return NULL;
+}
+
+void *
+scan_collect_worker(void *arg)
+{
+	scan_chunk(arg, 1);
+	return NULL;
+}
+
+typedef struct elem_slice {
+	char *str;
+	const size_t *seps; /* 要素iは(seps[i], seps[i + 1])の間 */
+	size_t first;
+	size_t last;
+	int keep_spans;
+	int pack_numbers;
+
+	node_t *head;
+	node_t *tail;
+	error_t error;
+} elem_slice_t;
+
+void *
+elem_worker(void *arg)
+{
+	elem_slice_t *s = arg;
+	parser_t p = parser_new_with_buffer(NULL, 0);
+
+	p.keep_spans = s->keep_spans;
+	p.pack_numbers = s->pack_numbers;
+	for (size_t i = s->first; i < s->last; i++) {
+		size_t begin = s->seps[i] + 1;
+		size_t end = s->seps[i + 1];
+
+		parser_reset(
+		    &p, file_new_with_buffer(s->str + begin, end - begin));
+		p.lexer.file.ordinal = begin;
+		parser_parse(&p);
+		if (p.error.kind != SUCCESS && p.lexer.tokenhead == NULL &&
+		    p.lexer.error.kind == SUCCESS) {
+			/* 空の要素 */
+			logmsg("unexpected token: %s\n",
+			    token_stringify_tag(TOKEN_TAG_VALUE_SEP));
+			p.error.ordinal = end + 1;
+		} else if (p.error.kind != SUCCESS && p.error.ordinal == 0) {
+			/* 要素の後ろに余計なトークンがあった */
+			p.error.ordinal = p.lexer.tokencurr != NULL
+			    ? p.lexer.tokencurr->ordinal
+			    : begin + 1;
+		}
+		if (p.error.kind != SUCCESS) {
+			s->error = p.error;
+			break;
+		}
+
+		node_t *elem =
+		    node_new_aelem(p.noderoot->ordinal, i, p.noderoot);
+		if (s->tail != NULL)
+			s->tail->next = elem;
+		else
+			s->head = elem;
+		s->tail = elem;
+	}
+
+	parser_free(&p);
+	return NULL;
+}
+
+/*
+ * itemsの各要素を引数にしてfnをスレッドで実行し、すべて終わるまで待つ。
+ * スレッドを作れなかった要素は、呼び出し元のスレッドで実行する。
+ */
+void
+parallel_run(void *items, size_t size, size_t n, void *(*fn)(void *))
+{
+	pthread_t *threads;
+	size_t created;
+
+	if (n == 0)
+		return;
+
+	threads = xmalloc(sizeof(pthread_t) * n);
+	for (created = 0; created < n; created++)
+		if (pthread_create(&threads[created], NULL, fn,
+		        (char *)items + size * created) != 0)
+			break;
+	if (created < n)
+		logmsg("pthread_create failed.\n");
+	for (size_t i = created; i < n; i++)
+		fn((char *)items + size * i);
+	for (size_t i = 0; i < created; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+int
+parallel_is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/*
+ * return: 区切りの列が正しければ0。誤りがあれば-1で、*ordinalに位置が
+ *         設定される。
+ */
+int
+parallel_check_seps(
+    const char *str, size_t len, const size_t *seps, size_t n, size_t *ordinal)
+{
+	size_t i;
+
+	for (i = 0; i < len && parallel_is_space(str[i]); i++)
+		;
+	if (n == 0 || seps[0] != i) {
+		*ordinal = i + 1;
+		return -1;
+	}
+	if (n < 2 || str[seps[n - 1]] != ']') {
+		*ordinal = len;
+		return -1;
+	}
+	for (size_t j = 1; j + 1 < n; j++) {
+		if (str[seps[j]] != ',') {
+			*ordinal = seps[j] + 1;
+			return -1;
+		}
+	}
+	for (i = seps[n - 1] + 1; i < len; i++) {
+		if (!parallel_is_space(str[i])) {
+			*ordinal = i + 1;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * ルートが配列であるような大きな文書を、複数のスレッドで構文解析する。
+ * 結果はparser_parse()と同じくpのメンバーに設定される。
+ *
+ * 文字列か記憶域から読む構文解析器でなければ、またはルートが配列でな
+ * ければ、parser_parse()と同じように1つのスレッドで構文解析する。
+ */
+void
+parser_parse_parallel(parser_t *p, size_t nthreads)
+{
+	file_t *f = &p->lexer.file;
+	char *str = f->str;
+	size_t len = f->str_len;
+	size_t i;
+
+	for (i = 0; f->tag == FILE_TAG_STRING && i < len; i++)
+		if (!parallel_is_space(str[i]))
+			break;
+	if (nthreads <= 1 || f->tag != FILE_TAG_STRING || f->str_index != 0 ||
+	    f->buf_len != 0 || i == len || str[i] != '[') {
+		parser_parse(p);
+		return;
+	}
+
+	scan_chunk_t *chunks = xmalloc(sizeof(scan_chunk_t) * nthreads);
+	size_t begin = 0;
+	for (i = 0; i < nthreads; i++) {
+		size_t end =
+		    i + 1 == nthreads ? len : len / nthreads * (i + 1);
+
+		/* エスケープの直後から始まる区間を作らない */
+		if (end < begin)
+			end = begin;
+		while (end > 0 && end < len && str[end - 1] == '\\')
+			end++;
+		chunks[i] = (scan_chunk_t){.str = str,
+		    .begin = begin,
+		    .end = end,
+		    .seps = NULL,
+		    .seps_len = 0};
+		begin = end;
+	}
+	parallel_run(chunks, sizeof(scan_chunk_t), nthreads, scan_worker);
+
+	/* 開始状態を確定する */
+	long depth = 0;
+	for (i = 0; i < nthreads; i++) {
+		if (i > 0 && chunks[i - 1].state == SCAN_ESCAPE) {
+			/*
+			 * 区間は入力の終わりでなければバックスラッシュの直
+			 * 後で終わらないので、入力がバックスラッシュで終わっ
+			 * た。後ろの区間は空。
+			 */
+			chunks[i].start = SCAN_ESCAPE;
+			chunks[i].state = SCAN_ESCAPE;
+			chunks[i].depth = 0;
+		} else if (i > 0 && chunks[i - 1].state == SCAN_STRING) {
+			chunks[i].start = SCAN_STRING;
+			chunks[i].state = chunks[i].string_state;
+			chunks[i].depth = chunks[i].string_depth;
+		}
+		chunks[i].depth_start = depth;
+		depth += chunks[i].depth;
+	}
+
+	parallel_run(
+	    chunks, sizeof(scan_chunk_t), nthreads, scan_collect_worker);
+
+	size_t *seps = NULL;
+	size_t seps_len = 0;
+	for (i = 0; i < nthreads; i++)
+		seps_len += chunks[i].seps_len;
+	if (seps_len > 0)
+		seps = xmalloc(sizeof(size_t) * seps_len);
+	seps_len = 0;
+	for (i = 0; i < nthreads; i++) {
+		if (chunks[i].seps_len > 0)
+			memcpy(seps + seps_len, chunks[i].seps,
+			    sizeof(size_t) * chunks[i].seps_len);
+		seps_len += chunks[i].seps_len;
+		free(chunks[i].seps);
+	}
+
+	size_t ordinal;
+	int unterminated = chunks[nthreads - 1].state != SCAN_OUTSIDE;
+	free(chunks);
+	p->noderoot = NULL;
+	if (unterminated || depth != 0 ||
+	    parallel_check_seps(str, len, seps, seps_len, &ordinal) == -1) {
+		if (unterminated)
+			logmsg("unterminated string.\n");
+		else
+			logmsg("unexpected structure.\n");
+		p->error = (error_t){.kind = ERROR_GENERAL,
+		    .ordinal = unterminated || depth != 0 ? len : ordinal};
+		free(seps);
+		return;
+	}
+
+	node_t *root = node_new_array(seps[0] + 1);
+	size_t nelems = seps_len - 1;
+
+	/* [ ] */
+	if (nelems == 1) {
+		for (i = seps[0] + 1; i < seps[1]; i++)
+			if (!parallel_is_space(str[i]))
+				break;
+		if (i == seps[1])
+			nelems = 0;
+	}
+
+	size_t nslices = nthreads < nelems ? nthreads : nelems;
+	elem_slice_t *slices = NULL;
+	if (nslices > 0)
+		slices = xmalloc(sizeof(elem_slice_t) * nslices);
+	for (i = 0; i < nslices; i++)
+		slices[i] = (elem_slice_t){.str = str,
+		    .seps = seps,
+		    .first = nelems / nslices * i,
+		    .last = i + 1 == nslices ? nelems
+		                             : nelems / nslices * (i + 1),
+		    .keep_spans = p->keep_spans,
+		    .pack_numbers = p->pack_numbers,
+		    .head = NULL,
+		    .tail = NULL,
+		    .error = (error_t){.kind = SUCCESS, .ordinal = 0}};
+	parallel_run(slices, sizeof(elem_slice_t), nslices, elem_worker);
+
+	/* つなぐ */
+	node_t *tail = NULL;
+	p->error = (error_t){.kind = SUCCESS, .ordinal = 0};
+	for (i = 0; i < nslices; i++) {
+		if (slices[i].error.kind != SUCCESS &&
+		    p->error.kind == SUCCESS)
+			p->error = slices[i].error;
+		if (slices[i].head == NULL)
+			continue;
+		if (tail != NULL)
+			tail->next = slices[i].head;
+		else
+			root->head = slices[i].head;
+		tail = slices[i].tail;
+	}
+	if (p->error.kind != SUCCESS) {
+		node_free(root);
+	} else {
+		/* parser_parse()と同じ結果にする */
+		if (p->keep_spans) {
+			root->src = str + seps[0];
+			root->src_len = seps[seps_len - 1] - seps[0] + 1;
+		}
+		if (p->pack_numbers)
+			node_pack(root);
+		p->noderoot = root;
+	}
+
+	free(slices);
+	free(seps);
+}
+
+/*
+ * 字句解析と構文解析のパイプライン
+ *
+ * 字句解析器のスレッドがトークンをリングに書き込み、構文解析器のスレッ
+ * ドがそれを読む。書き手と読み手はそれぞれ1つなので、リングの位置は
+ * 原子的な読み書きだけで管理できる。
+ */
+
+typedef struct jm_ring {
+	token_t **slots;
+	size_t capacity; /* 2の冪 */
+
+	atomic_size_t head; /* 次に読む位置。読み手だけが書き換える。 */
+	atomic_size_t tail; /* 次に書く位置。書き手だけが書き換える。 */
+	atomic_int cancelled; /* 読み手がもう読まない */
+
+	int eof; /* 読み手が終端を読んだ */
+} jm_ring_t;
+
+jm_ring_t
+jm_ring_new(size_t capacity)
+{
+	size_t n = 2;
+	jm_ring_t ring;
+
+	while (n < capacity)
+		n *= 2;
+
+	ring.slots = xmalloc(sizeof(token_t *) * n);
+	ring.capacity = n;
+	atomic_init(&ring.head, 0);
+	atomic_init(&ring.tail, 0);
+	atomic_init(&ring.cancelled, 0);
+	ring.eof = 0;
+	return ring;
+}
+
+/*
+ * NULLは終端を表す。
+ *
+ * return: 書き込めば0。読み手が取り消していれば-1。
+ */
+int
+jm_ring_push(jm_ring_t *ring, token_t *tok)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	while (tail - atomic_load_explicit(&ring->head,
+	                  memory_order_acquire) ==
+	    ring->capacity) {
+		if (atomic_load_explicit(
+		        &ring->cancelled, memory_order_relaxed))
+			return -1;
+		sched_yield();
+	}
+
+	ring->slots[tail & (ring->capacity - 1)] = tok;
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return 0;
+}
+
+/*
+ * return: トークン。終端ならNULL。
+ */
+token_t *
+jm_ring_pop(jm_ring_t *ring)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	token_t *tok;
+
+	if (ring->eof)
+		return NULL;
+
+	while (head == atomic_load_explicit(&ring->tail, memory_order_acquire))
+		sched_yield();
+
+	tok = ring->slots[head & (ring->capacity - 1)];
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	if (tok == NULL)
+		ring->eof = 1;
+	return tok;
+}
+
+void *
+pipeline_lexer_worker(void *arg)
+{
+	lexer_t *l = arg;
+	token_t *tok;
+
+	while ((tok = lexer_lex_token(l)) != NULL) {
+		if (jm_ring_push(l->ring, tok) == -1) {
+			token_free(tok);
+			return NULL;
+		}
+	}
+	jm_ring_push(l->ring, NULL);
+	return NULL;
+}
+
+/*
+ * 字句解析を別のスレッドで行いながら構文解析する。トークン列全体を保
+ * 持しないので、メモリ使用量はring_size個のトークンで抑えられる。結果
+ * はparser_parse()と同じくpのメンバーに設定される。
+ */
+void
+parser_parse_pipelined(parser_t *p, size_t ring_size)
+{
+	jm_ring_t ring = jm_ring_new(ring_size);
+	pthread_t thread;
+	token_t *t;
+
+	parser_begin_spans(p);
+	p->lexer.ring = &ring;
+	if (pthread_create(&thread, NULL, pipeline_lexer_worker, &p->lexer) !=
+	    0) {
+		/* パイプラインにせずに構文解析する */
+		logmsg("pthread_create failed.\n");
+		p->lexer.ring = NULL;
+		free(ring.slots);
+		parser_parse(p);
+		return;
+	}
+
+	p->noderoot = parser_parse_value(p);
+	if (p->noderoot != NULL) {
+		if ((t = lexer_read(&p->lexer)) != NULL) {
+			logmsg("unexpected token: %s\n",
+			    token_stringify_tag(t->tag));
+			p->error = (error_t){
+			    .kind = ERROR_GENERAL, .ordinal = t->ordinal};
+		} else {
+			p->error.kind = SUCCESS;
+		}
+	}
+
+	atomic_store(&ring.cancelled, 1);
+	pthread_join(thread, NULL);
+
+	/* 終端まで読んだなら、字句解析のエラーを優先する */
+	if (ring.eof && p->lexer.error.kind != SUCCESS)
+		p->error = p->lexer.error;
+	if (p->error.kind != SUCCESS) {
+		node_free(p->noderoot);
+		p->noderoot = NULL;
+	}
+
+	/* 読まれなかったトークン */
+	while (!ring.eof &&
+	    atomic_load(&ring.head) != atomic_load(&ring.tail))
+		if ((t = jm_ring_pop(&ring)) != NULL)
+			token_free(t);
+
+	if (p->lexer.tokprev != NULL)
+		token_free(p->lexer.tokprev);
+	p->lexer.tokprev = NULL;
+	p->lexer.ring = NULL;
+	free(ring.slots);
+}
+
+/*
+ * 小さな文書の一括構文解析
+ *
+ * 文書は常駐するスレッドプールで構文解析する。各ワーカーには文書の区
+ * 間を割り当て、自分の区間を終えたワーカーはほかのワーカーの区間から
+ * 盗む。ワーカーは構文解析器をバッチをまたいで使い回す。
+ */
+
+#define BATCH_MAX_THREADS 64
+
+typedef struct batch_range {
+	atomic_size_t next;
+	size_t end;
+	char pad[64]; /* 偽共有を避ける */
+} batch_range_t;
+
+typedef struct batch_job {
+	char *const *docs;
+	const size_t *lens;
+	jm_batch_result_t *results;
+	batch_range_t *ranges;
+} batch_job_t;
+
+typedef struct batch_pool {
+	int started;
+	size_t nthreads;
+	pthread_t threads[BATCH_MAX_THREADS];
+
+	/* バッチを1つずつ処理する。プールの開始と終了もこれで守る。 */
+	pthread_mutex_t submit;
+	pthread_mutex_t mutex;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned long generation;
+	size_t running;
+	batch_job_t *job; /* NULLならワーカーは終了する */
+} batch_pool_t;
+
+batch_pool_t batch_pool = {.submit = PTHREAD_MUTEX_INITIALIZER,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER};
+
+typedef struct batch_worker {
+	size_t id;
+	parser_t parser;
+} batch_worker_t;
+
+/*
+ * return: 構文解析した文書があれば1。
+ */
+int
+batch_take(batch_worker_t *w, batch_job_t *job, batch_range_t *range)
+{
+	size_t i = atomic_fetch_add(&range->next, 1);
+
+	if (i >= range->end)
+		return 0;
+
+	parser_reset(&w->parser,
+	    file_new_with_buffer(job->docs[i], job->lens[i]));
+	parser_parse(&w->parser);
+	if (w->parser.error.kind != SUCCESS) {
+		/* 後ろに余分なトークンがあれば木ができている */
+		node_free(w->parser.noderoot);
+		w->parser.noderoot = NULL;
+	}
+	job->results[i] = (jm_batch_result_t){
+	    .noderoot = w->parser.noderoot, .error = w->parser.error};
+	return 1;
+}
+
+void *
+batch_worker(void *arg)
+{
+	batch_worker_t w = {.id = (size_t)arg,
+	    .parser = parser_new_with_buffer(NULL, 0)};
+	unsigned long generation = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&batch_pool.mutex);
+		while (batch_pool.generation == generation)
+			pthread_cond_wait(
+			    &batch_pool.start, &batch_pool.mutex);
+		generation = batch_pool.generation;
+		batch_job_t *job = batch_pool.job;
+		pthread_mutex_unlock(&batch_pool.mutex);
+		if (job == NULL)
+			break;
+
+		while (batch_take(&w, job, &job->ranges[w.id]))
+			;
+		for (size_t i = 1; i < batch_pool.nthreads; i++) {
+			batch_range_t *victim =
+			    &job->ranges[(w.id + i) % batch_pool.nthreads];
+			while (batch_take(&w, job, victim))
+				;
+		}
+
+		pthread_mutex_lock(&batch_pool.mutex);
+		if (--batch_pool.running == 0)
+			pthread_cond_signal(&batch_pool.done);
+		pthread_mutex_unlock(&batch_pool.mutex);
+	}
+
+	parser_free(&w.parser);
+	return NULL;
+}
+
+/*
+ * batch_pool.submitを持って呼ぶ。
+ */
+void
+batch_pool_init(void)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (ncpu < 1)
+		batch_pool.nthreads = 1;
+	else if (ncpu > BATCH_MAX_THREADS)
+		batch_pool.nthreads = BATCH_MAX_THREADS;
+	else
+		batch_pool.nthreads = (size_t)ncpu;
+	batch_pool.generation = 0;
+	batch_pool.running = 0;
+	batch_pool.job = NULL;
+
+	for (size_t i = 0; i < batch_pool.nthreads; i++) {
+		if (pthread_create(&batch_pool.threads[i], NULL, batch_worker,
+		        (void *)i) != 0) {
+			/* 作れた分のスレッドをプールにする */
+			logmsg("pthread_create failed.\n");
+			batch_pool.nthreads = i;
+			break;
+		}
+	}
+	batch_pool.started = 1;
+}
+
+/*
+ * n個の文書docs[i](長さlens[i])を構文解析し、結果をresults[i]に設定
+ * する。プールのスレッドは最初の呼び出しで作られ、
+ * jm_parse_batch_shutdown()を呼ぶまで残る。複数のスレッドから呼び出
+ * してもよいが、バッチは1つずつ処理される。スレッドを1つも作れなかっ
+ * たなら、呼び出し元のスレッドで構文解析する。
+ */
+void
+jm_parse_batch(char *const docs[], const size_t lens[], size_t n,
+    jm_batch_result_t results[])
+{
+	pthread_mutex_lock(&batch_pool.submit);
+	if (!batch_pool.started)
+		batch_pool_init();
+
+	size_t nthreads = batch_pool.nthreads;
+	if (nthreads == 0) {
+		batch_worker_t w = {
+		    .id = 0, .parser = parser_new_with_buffer(NULL, 0)};
+		batch_range_t range = {.end = n};
+		batch_job_t job = {.docs = docs,
+		    .lens = lens,
+		    .results = results,
+		    .ranges = &range};
+
+		atomic_init(&range.next, 0);
+		while (batch_take(&w, &job, &range))
+			;
+		parser_free(&w.parser);
+		pthread_mutex_unlock(&batch_pool.submit);
+		return;
+	}
+
+	batch_range_t *ranges = xmalloc(sizeof(batch_range_t) * nthreads);
+	batch_job_t job = {
+	    .docs = docs, .lens = lens, .results = results, .ranges = ranges};
+
+	for (size_t i = 0; i < nthreads; i++) {
+		atomic_init(&ranges[i].next, n / nthreads * i);
+		ranges[i].end = i + 1 == nthreads ? n : n / nthreads * (i + 1);
+	}
+
+	pthread_mutex_lock(&batch_pool.mutex);
+	batch_pool.job = &job;
+	batch_pool.running = nthreads;
+	batch_pool.generation++;
+	pthread_cond_broadcast(&batch_pool.start);
+	while (batch_pool.running > 0)
+		pthread_cond_wait(&batch_pool.done, &batch_pool.mutex);
+	pthread_mutex_unlock(&batch_pool.mutex);
+	pthread_mutex_unlock(&batch_pool.submit);
+
+	free(ranges);
+}
+
+/*
+ * jm_parse_batch()のスレッドプールを終了し、スレッドを待つ。処理中の
+ * バッチがあれば、それが終わってから終了する。このあとで
+ * jm_parse_batch()を呼ぶと、プールを作り直す。
+ */
+void
+jm_parse_batch_shutdown(void)
+{
+	pthread_mutex_lock(&batch_pool.submit);
+	if (!batch_pool.started) {
+		pthread_mutex_unlock(&batch_pool.submit);
+		return;
+	}
+
+	pthread_mutex_lock(&batch_pool.mutex);
+	batch_pool.job = NULL;
+	batch_pool.generation++;
+	pthread_cond_broadcast(&batch_pool.start);
+	pthread_mutex_unlock(&batch_pool.mutex);
+
+	for (size_t i = 0; i < batch_pool.nthreads; i++)
+		pthread_join(batch_pool.threads[i], NULL);
+	batch_pool.started = 0;
+	pthread_mutex_unlock(&batch_pool.submit);
+}
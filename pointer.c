@@ -0,0 +1,169 @@
+#include "jsonmodoki.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * JSON Pointer (RFC 6901)
+ *
+ * jm_pointer_compile()でセグメントへの分割とエスケープの解除、配列の
+ * 添字の変換を済ませておき、jm_pointer_eval()では比較だけを行う。
+ */
+
+void
+jm_pointer_free(jm_pointer_t *ptr)
+{
+	if (ptr == NULL)
+		return;
+
+	for (size_t i = 0; i < ptr->len; i++)
+		free(ptr->segs[i].bytes);
+	free(ptr->segs);
+	free(ptr->indices);
+	free(ptr);
+}
+
+/*
+ * return: 配列の添字。添字として解釈できなければSIZE_MAX。
+ */
+size_t
+jm_pointer_parse_index(string_t *seg)
+{
+	size_t index = 0;
+
+	/* "0"以外は先頭に0を置けない */
+	if (seg->len == 0 || (seg->len > 1 && seg->bytes[0] == '0'))
+		return SIZE_MAX;
+
+	for (size_t i = 0; i < seg->len; i++) {
+		int d = seg->bytes[i] - '0';
+		if (d < 0 || d > 9)
+			return SIZE_MAX;
+		if (index > (SIZE_MAX - 1 - d) / 10)
+			return SIZE_MAX;
+		index = index * 10 + d;
+	}
+
+	return index;
+}
+
+/*
+ * "/a/b/3"のようなJSON Pointerをコンパイルする。""は文書全体を指す。
+ *
+ * return: コンパイルしたポインタ。構文が誤っていればNULL。
+ */
+jm_pointer_t *
+jm_pointer_compile(const char *str)
+{
+	jm_pointer_t *ptr = xmalloc(sizeof(jm_pointer_t));
+	*ptr = (jm_pointer_t){.segs = NULL, .indices = NULL, .len = 0};
+
+	if (*str == '\0')
+		return ptr;
+	if (*str != '/')
+		goto error;
+
+	for (const char *s = str; *s == '/';) {
+		string_t seg = string_new();
+
+		for (s++; *s != '\0' && *s != '/'; s++) {
+			if (*s != '~') {
+				string_add_char(&seg, *s);
+				continue;
+			}
+			if (s[1] == '0') {
+				string_add_char(&seg, '~');
+			} else if (s[1] == '1') {
+				string_add_char(&seg, '/');
+			} else {
+				free(seg.bytes);
+				goto error;
+			}
+			s++;
+		}
+
+		ptr->segs =
+		    xrealloc(ptr->segs, sizeof(string_t) * (ptr->len + 1));
+		ptr->indices =
+		    xrealloc(ptr->indices, sizeof(size_t) * (ptr->len + 1));
+		ptr->segs[ptr->len] = seg;
+		ptr->indices[ptr->len] = jm_pointer_parse_index(&seg);
+		ptr->len++;
+	}
+
+	return ptr;
+
+error:
+	logmsg("invalid JSON pointer: %s\n", str);
+	jm_pointer_free(ptr);
+	return NULL;
+}
+
+node_t *
+pointer_eval(const jm_pointer_t *ptr, node_t *root, int for_update)
+{
+	node_t *cur = root;
+
+	for (size_t i = 0; i < ptr->len && cur != NULL; i++) {
+		const string_t *seg = &ptr->segs[i];
+		node_t *elem;
+
+		if (for_update)
+			node_clear_span(cur);
+
+		switch (cur->tag) {
+		case NODE_TAG_OBJECT:
+			for (elem = cur->head; elem != NULL; elem = elem->next)
+				if (elem->name.len == seg->len &&
+				    memcmp(elem->name.bytes, seg->bytes,
+				        seg->len) == 0)
+					break;
+			cur = elem == NULL ? NULL : elem->val;
+			break;
+		case NODE_TAG_ARRAY:
+			if (ptr->indices[i] == SIZE_MAX)
+				return NULL;
+			/* 書き換えるなら要素のノードが要る */
+			if (for_update)
+				node_unpack(cur);
+			/* 詰めた配列の要素を指すならNULL */
+			if (node_array_get(cur, ptr->indices[i], &cur,
+			        NULL) != 0)
+				return NULL;
+			break;
+		default:
+			return NULL;
+		}
+	}
+
+	if (for_update && cur != NULL)
+		node_clear_span(cur);
+	return cur;
+}
+
+/*
+ * 木は書き換えない。詰めた配列の要素にはノードがないので、配列を指し
+ * てnode_array_get_number()で読む。
+ *
+ * return: ptrが指す値。なければNULL。
+ */
+node_t *
+jm_pointer_eval(const jm_pointer_t *ptr, node_t *root)
+{
+	return pointer_eval(ptr, root, 0);
+}
+
+/*
+ * 書き換えるためにptrが指す値を得る。途中の配列やオブジェクトと値自身
+ * の入力の範囲を消すので、書き換えたあとでjm_serialize()しても古い入
+ * 力が写されることはない。途中の詰めた配列は展開する。
+ *
+ * return: ptrが指す値。なければNULL。
+ */
+node_t *
+jm_pointer_eval_for_update(const jm_pointer_t *ptr, node_t *root)
+{
+	return pointer_eval(ptr, root, 1);
+}
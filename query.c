@@ -0,0 +1,652 @@
+#include "jsonmodoki.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * JSONPathのサブセット
+ *
+ *   $          ルート
+ *   .name      子 (['name']、["name"]とも書ける)
+ *   .*, [*]    すべての子
+ *   ..         再帰下降 (..name、..*、..[0]など)
+ *   [n]        添字 (負なら末尾から)
+ *   [s:e:t]    スライス (tは正のみ)
+ *   [?(@.k op v)]
+ *              フィルタ。opは==, !=, <, <=, >, >=。vは数値、文字列、
+ *              true、false、null。@.k.lのように名前を続けてもよい。
+ *
+ * クエリは命令列にコンパイルし、node_tの木の上で実行する。一致した値
+ * は見つかった順にコールバックに渡すので、結果のリストは作らない。
+ */
+
+void
+jm_query_free(jm_query_t *q)
+{
+	if (q == NULL)
+		return;
+
+	for (size_t i = 0; i < q->len; i++) {
+		jm_query_insn_t *insn = &q->insns[i];
+		free(insn->name.bytes);
+		for (size_t j = 0; j < insn->keys_len; j++)
+			free(insn->keys[j].bytes);
+		free(insn->keys);
+		if (insn->literal != NULL) {
+			if (insn->literal->tag == NODE_TAG_STRING)
+				free(insn->literal->str.bytes);
+			free(insn->literal);
+		}
+	}
+	free(q->insns);
+	free(q);
+}
+
+/*
+ * compile
+ */
+
+typedef struct query_compiler {
+	const char *s;
+	jm_query_t *q;
+} query_compiler_t;
+
+void
+query_skip_space(query_compiler_t *c)
+{
+	while (*c->s == ' ')
+		c->s++;
+}
+
+jm_query_insn_t *
+query_add_insn(query_compiler_t *c, enum jm_query_op op)
+{
+	jm_query_t *q = c->q;
+
+	q->insns = xrealloc(q->insns, sizeof(jm_query_insn_t) * (q->len + 1));
+	q->insns[q->len] = (jm_query_insn_t){.op = op,
+	    .name = {.bytes = NULL},
+	    .keys = NULL,
+	    .keys_len = 0,
+	    .literal = NULL};
+	return &q->insns[q->len++];
+}
+
+int
+query_is_name_char(int c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+	    (c >= '0' && c <= '9') || c == '_' || c == '-' ||
+	    (unsigned char)c >= 0x80;
+}
+
+/*
+ * return: 成功なら0。名前がなければ-1。
+ */
+int
+query_compile_name(query_compiler_t *c, string_t *name)
+{
+	if (!query_is_name_char(*c->s))
+		return -1;
+
+	*name = string_new();
+	while (query_is_name_char(*c->s))
+		string_add_char(name, *c->s++);
+	return 0;
+}
+
+/*
+ * 'abc'か"abc"。エスケープは\\と\'、\"のみ。
+ */
+int
+query_compile_string(query_compiler_t *c, string_t *str)
+{
+	char quote = *c->s;
+
+	if (quote != '\'' && quote != '"')
+		return -1;
+
+	*str = string_new();
+	for (c->s++; *c->s != quote; c->s++) {
+		if (*c->s == '\0') {
+			free(str->bytes);
+			str->bytes = NULL;
+			return -1;
+		}
+		if (*c->s == '\\' && c->s[1] != '\0')
+			c->s++;
+		string_add_char(str, *c->s);
+	}
+	c->s++;
+	return 0;
+}
+
+int
+query_compile_long(query_compiler_t *c, long *n)
+{
+	char *rest;
+
+	if (*c->s != '-' && (*c->s < '0' || *c->s > '9'))
+		return -1;
+
+	errno = 0;
+	*n = strtol(c->s, &rest, 10);
+	if (errno != 0 || rest == c->s)
+		return -1;
+	c->s = rest;
+	return 0;
+}
+
+int
+query_compile_literal(query_compiler_t *c, node_t **literal)
+{
+	string_t str;
+	double d;
+	char *rest;
+
+	if (query_compile_string(c, &str) == 0) {
+		*literal = node_new_with_string(0, str);
+		return 0;
+	}
+	if (strncmp(c->s, "true", 4) == 0) {
+		c->s += 4;
+		*literal = node_new_with_bool(0, 1);
+		return 0;
+	}
+	if (strncmp(c->s, "false", 5) == 0) {
+		c->s += 5;
+		*literal = node_new_with_bool(0, 0);
+		return 0;
+	}
+	if (strncmp(c->s, "null", 4) == 0) {
+		c->s += 4;
+		*literal = node_new_null(0);
+		return 0;
+	}
+
+	errno = 0;
+	d = strtod(c->s, &rest);
+	if (errno != 0 || rest == c->s)
+		return -1;
+	c->s = rest;
+	*literal = node_new_with_number(0, d);
+	return 0;
+}
+
+/*
+ * ?(@.k op v)
+ */
+int
+query_compile_filter(query_compiler_t *c)
+{
+	static const struct {
+		const char *str;
+		enum jm_query_cmp cmp;
+	} ops[] = {
+	    /* 長いものから */
+	    {"==", JM_QUERY_CMP_EQ},
+	    {"!=", JM_QUERY_CMP_NE},
+	    {"<=", JM_QUERY_CMP_LE},
+	    {">=", JM_QUERY_CMP_GE},
+	    {"<", JM_QUERY_CMP_LT},
+	    {">", JM_QUERY_CMP_GT},
+	};
+	jm_query_insn_t *insn = query_add_insn(c, JM_QUERY_OP_FILTER);
+	size_t i;
+
+	if (strncmp(c->s, "?(", 2) != 0)
+		return -1;
+	c->s += 2;
+	query_skip_space(c);
+	if (*c->s++ != '@')
+		return -1;
+
+	while (*c->s == '.') {
+		string_t key;
+		c->s++;
+		if (query_compile_name(c, &key) == -1)
+			return -1;
+		insn->keys = xrealloc(
+		    insn->keys, sizeof(string_t) * (insn->keys_len + 1));
+		insn->keys[insn->keys_len++] = key;
+	}
+
+	query_skip_space(c);
+	for (i = 0; i < array_len(ops); i++)
+		if (strncmp(c->s, ops[i].str, strlen(ops[i].str)) == 0)
+			break;
+	if (i == array_len(ops))
+		return -1;
+	insn->cmp = ops[i].cmp;
+	c->s += strlen(ops[i].str);
+
+	query_skip_space(c);
+	if (query_compile_literal(c, &insn->literal) == -1)
+		return -1;
+	query_skip_space(c);
+	if (*c->s++ != ')')
+		return -1;
+	return 0;
+}
+
+/*
+ * [...]
+ */
+int
+query_compile_bracket(query_compiler_t *c)
+{
+	jm_query_insn_t *insn;
+	long n;
+
+	c->s++;
+	query_skip_space(c);
+
+	if (*c->s == '*') {
+		c->s++;
+		query_add_insn(c, JM_QUERY_OP_WILDCARD);
+	} else if (*c->s == '\'' || *c->s == '"') {
+		insn = query_add_insn(c, JM_QUERY_OP_CHILD);
+		if (query_compile_string(c, &insn->name) == -1)
+			return -1;
+	} else if (*c->s == '?') {
+		if (query_compile_filter(c) == -1)
+			return -1;
+	} else {
+		int has_n = query_compile_long(c, &n) == 0;
+
+		query_skip_space(c);
+		if (*c->s != ':') {
+			if (!has_n)
+				return -1;
+			insn = query_add_insn(c, JM_QUERY_OP_INDEX);
+			insn->index = n;
+		} else {
+			insn = query_add_insn(c, JM_QUERY_OP_SLICE);
+			insn->has_start = has_n;
+			insn->start = has_n ? n : 0;
+			insn->step = 1;
+			c->s++;
+			query_skip_space(c);
+			insn->has_end = query_compile_long(c, &insn->end) == 0;
+			query_skip_space(c);
+			if (*c->s == ':') {
+				c->s++;
+				query_skip_space(c);
+				if (query_compile_long(c, &insn->step) == -1 ||
+				    insn->step <= 0)
+					return -1;
+			}
+		}
+	}
+
+	query_skip_space(c);
+	if (*c->s++ != ']')
+		return -1;
+	return 0;
+}
+
+/*
+ * return: コンパイルしたクエリ。構文が誤っていればNULL。
+ */
+jm_query_t *
+jm_query_compile(const char *str)
+{
+	jm_query_t *q = xmalloc(sizeof(jm_query_t));
+	query_compiler_t c = {.s = str, .q = q};
+	jm_query_insn_t *insn;
+
+	*q = (jm_query_t){.insns = NULL, .len = 0};
+
+	if (*c.s++ != '$')
+		goto error;
+
+	while (*c.s != '\0') {
+		if (strncmp(c.s, "..", 2) == 0) {
+			c.s += 2;
+			query_add_insn(&c, JM_QUERY_OP_DESCENT);
+			if (*c.s == '[')
+				continue;
+		} else if (*c.s == '.') {
+			c.s++;
+		} else if (*c.s == '[') {
+			if (query_compile_bracket(&c) == -1)
+				goto error;
+			continue;
+		} else {
+			goto error;
+		}
+
+		/* .の後 */
+		if (*c.s == '*') {
+			c.s++;
+			query_add_insn(&c, JM_QUERY_OP_WILDCARD);
+			continue;
+		}
+		insn = query_add_insn(&c, JM_QUERY_OP_CHILD);
+		if (query_compile_name(&c, &insn->name) == -1)
+			goto error;
+	}
+
+	return q;
+
+error:
+	logmsg("invalid query: %s\n", str);
+	jm_query_free(q);
+	return NULL;
+}
+
+/*
+ * run
+ */
+
+typedef struct query_run {
+	const jm_query_t *q;
+	jm_query_cb cb;
+	void *ctx;
+	size_t count;
+	int view; /* cbに渡す値が詰めた配列の要素 */
+} query_run_t;
+
+/*
+ * 配列の要素のindexの上限 (最後の要素のindex + 1)。射影して読んだ配列
+ * は要素が飛び飛びなので、要素の数とは限らない。
+ */
+size_t
+query_array_end(node_t *array)
+{
+	size_t end = 0;
+
+	for (node_t *ae = array->head; ae != NULL; ae = ae->next)
+		end = ae->index + 1;
+	return end;
+}
+
+/*
+ * スライスの範囲を、長さがlenの配列での[*start, *end)にする。
+ */
+void
+query_slice_bounds(
+    const jm_query_insn_t *insn, long len, long *start, long *end)
+{
+	*start = insn->has_start ? insn->start : 0;
+	*end = insn->has_end ? insn->end : len;
+	if (*start < 0)
+		*start = *start + len < 0 ? 0 : *start + len;
+	if (*end < 0)
+		*end = *end + len < 0 ? 0 : *end + len;
+}
+
+int
+query_compare(enum jm_query_cmp cmp, node_t *val, node_t *literal)
+{
+	int order;
+
+	if (val->tag != literal->tag)
+		return cmp == JM_QUERY_CMP_NE;
+
+	switch (val->tag) {
+	case NODE_TAG_NUMBER:
+		order = val->num < literal->num ? -1 : val->num > literal->num;
+		break;
+	case NODE_TAG_STRING:
+		order = strcmp(val->str.bytes, literal->str.bytes);
+		break;
+	case NODE_TAG_BOOL:
+		if (val->boolean != literal->boolean)
+			return cmp == JM_QUERY_CMP_NE;
+		order = 0;
+		break;
+	case NODE_TAG_NULL:
+		order = 0;
+		break;
+	default:
+		return cmp == JM_QUERY_CMP_NE;
+	}
+
+	switch (cmp) {
+	case JM_QUERY_CMP_EQ:
+		return order == 0;
+	case JM_QUERY_CMP_NE:
+		return order != 0;
+	case JM_QUERY_CMP_LT:
+		return order < 0;
+	case JM_QUERY_CMP_LE:
+		return order <= 0;
+	case JM_QUERY_CMP_GT:
+		return order > 0;
+	case JM_QUERY_CMP_GE:
+		return order >= 0;
+	}
+
+	return 0;
+}
+
+int
+query_filter(const jm_query_insn_t *insn, node_t *node)
+{
+	for (size_t i = 0; i < insn->keys_len && node != NULL; i++) {
+		if (node->tag != NODE_TAG_OBJECT)
+			return 0;
+		node = node_object_get(node, insn->keys[i].bytes);
+	}
+
+	return node != NULL && query_compare(insn->cmp, node, insn->literal);
+}
+
+int query_exec(query_run_t *run, size_t pc, node_t *node);
+
+/*
+ * 詰めた配列でpcの命令を実行する。木は書き換えず、要素は
+ * node_packed_view()で作った一時的なノードで渡す。
+ *
+ * return: コールバックが中断を求めたら1。
+ */
+int
+query_exec_packed(query_run_t *run, size_t pc, node_t *array)
+{
+	const jm_query_insn_t *insn = &run->q->insns[pc];
+	long len = (long)array->packed_len, start = 0, end = len, step = 1;
+
+	switch (insn->op) {
+	case JM_QUERY_OP_CHILD:
+		return 0;
+	case JM_QUERY_OP_DESCENT:
+		if (query_exec(run, pc + 1, array))
+			return 1;
+		break;
+	case JM_QUERY_OP_WILDCARD:
+	case JM_QUERY_OP_FILTER:
+		break;
+	case JM_QUERY_OP_INDEX:
+		start = insn->index < 0 ? insn->index + len : insn->index;
+		if (start < 0 || start >= len)
+			return 0;
+		end = start + 1;
+		break;
+	case JM_QUERY_OP_SLICE:
+		query_slice_bounds(insn, len, &start, &end);
+		if (end > len)
+			end = len;
+		step = insn->step;
+		break;
+	}
+
+	size_t next = insn->op == JM_QUERY_OP_DESCENT ? pc : pc + 1;
+
+	/* 要素はスカラーなので、この中でcbに渡るのは要素だけである */
+	run->view = 1;
+	for (long i = start; i < end; i += step) {
+		node_t elem = node_packed_view(array, i);
+		if (insn->op == JM_QUERY_OP_FILTER &&
+		    !query_filter(insn, &elem))
+			continue;
+		if (query_exec(run, next, &elem)) {
+			run->view = 0;
+			return 1;
+		}
+	}
+	run->view = 0;
+	return 0;
+}
+
+/*
+ * return: コールバックが中断を求めたら1。
+ */
+int
+query_exec(query_run_t *run, size_t pc, node_t *node)
+{
+	const jm_query_insn_t *insn;
+
+	if (pc == run->q->len) {
+		run->count++;
+		return run->cb(node, run->ctx) != 0;
+	}
+
+	if (node->tag == NODE_TAG_ARRAY && node->packing != NODE_PACKED_NONE)
+		return query_exec_packed(run, pc, node);
+
+	insn = &run->q->insns[pc];
+	switch (insn->op) {
+	case JM_QUERY_OP_CHILD:
+		if (node->tag != NODE_TAG_OBJECT)
+			return 0;
+		for (node_t *oe = node->head; oe != NULL; oe = oe->next)
+			if (oe->name.len == insn->name.len &&
+			    memcmp(oe->name.bytes, insn->name.bytes,
+			        insn->name.len) == 0 &&
+			    query_exec(run, pc + 1, oe->val))
+				return 1;
+		return 0;
+	case JM_QUERY_OP_WILDCARD:
+		if (node->tag != NODE_TAG_OBJECT &&
+		    node->tag != NODE_TAG_ARRAY)
+			return 0;
+		for (node_t *e = node->head; e != NULL; e = e->next)
+			if (query_exec(run, pc + 1, e->val))
+				return 1;
+		return 0;
+	case JM_QUERY_OP_DESCENT:
+		if (query_exec(run, pc + 1, node))
+			return 1;
+		if (node->tag != NODE_TAG_OBJECT &&
+		    node->tag != NODE_TAG_ARRAY)
+			return 0;
+		for (node_t *e = node->head; e != NULL; e = e->next)
+			if (query_exec(run, pc, e->val))
+				return 1;
+		return 0;
+	case JM_QUERY_OP_INDEX: {
+		if (node->tag != NODE_TAG_ARRAY)
+			return 0;
+		long index = insn->index;
+		if (index < 0)
+			index += (long)query_array_end(node);
+		if (index < 0)
+			return 0;
+		for (node_t *ae = node->head; ae != NULL; ae = ae->next)
+			if (ae->index == (size_t)index)
+				return query_exec(run, pc + 1, ae->val);
+		return 0;
+	}
+	case JM_QUERY_OP_SLICE: {
+		if (node->tag != NODE_TAG_ARRAY)
+			return 0;
+		long start, end;
+		query_slice_bounds(
+		    insn, (long)query_array_end(node), &start, &end);
+		for (node_t *ae = node->head; ae != NULL; ae = ae->next) {
+			long i = (long)ae->index;
+			if (i >= end)
+				break;
+			if (i >= start && (i - start) % insn->step == 0 &&
+			    query_exec(run, pc + 1, ae->val))
+				return 1;
+		}
+		return 0;
+	}
+	case JM_QUERY_OP_FILTER:
+		if (node->tag != NODE_TAG_OBJECT &&
+		    node->tag != NODE_TAG_ARRAY)
+			return 0;
+		for (node_t *e = node->head; e != NULL; e = e->next)
+			if (query_filter(insn, e->val) &&
+			    query_exec(run, pc + 1, e->val))
+				return 1;
+		return 0;
+	}
+
+	return 0;
+}
+
+/*
+ * 一致した値を見つけた順にcbに渡す。cbが0以外を返したら中断する。木
+ * は書き換えないので、同じ木に複数のスレッドから同時に実行してよい。
+ *
+ * return: cbに渡した値の数
+ */
+size_t
+jm_query_run(const jm_query_t *q, node_t *root, jm_query_cb cb, void *ctx)
+{
+	query_run_t run = {
+	    .q = q, .cb = cb, .ctx = ctx, .count = 0, .view = 0};
+
+	query_exec(&run, 0, root);
+	return run.count;
+}
+
+/* jm_query_first()で最初に一致した値 */
+typedef struct query_first {
+	const query_run_t *run;
+	node_t *node;
+	double num;
+	int packed;
+} query_first_t;
+
+int
+query_first_cb(node_t *match, void *ctx)
+{
+	query_first_t *first = ctx;
+
+	/* 一時的なノードは返せないので数値を取っておく */
+	first->packed = first->run->view;
+	if (first->packed)
+		first->num = match->num;
+	else
+		first->node = match;
+	return 1;
+}
+
+/*
+ * 詰めた配列の要素にはノードがないので、数値を返す。
+ *
+ * args: num: NULLなら詰めた配列の要素の数値を設定しない
+ *
+ * return: 最初に一致した値がノードなら0で、*outに設定される。詰めた配
+ *         列の要素なら1で、*numに設定される。一致しなければ-1。
+ */
+int
+jm_query_first(
+    const jm_query_t *q, node_t *root, node_t **out, double *num)
+{
+	query_first_t first = {
+	    .run = NULL, .node = NULL, .num = 0, .packed = 0};
+	query_run_t run = {.q = q,
+	    .cb = query_first_cb,
+	    .ctx = &first,
+	    .count = 0,
+	    .view = 0};
+
+	first.run = &run;
+	query_exec(&run, 0, root);
+	if (run.count == 0)
+		return -1;
+	if (first.packed) {
+		if (num != NULL)
+			*num = first.num;
+		return 1;
+	}
+	*out = first.node;
+	return 0;
+}
@@ -0,0 +1,707 @@
+#include "jsonmodoki.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * プル型のリーダー。
+ *
+ * 構文解析器と違ってトークンリストを作らず、jm_reader_next()が呼ばれ
+ * るたびに必要な分だけ字句解析する。使い終わったトークンはすぐに解放
+ * するため、メモリ使用量は入れ子の深さにのみ比例する。
+ */
+
+/* stackの要素 */
+enum reader_frame {
+	FRAME_ARRAY_BEGIN,
+	FRAME_ARRAY_VALUE,
+	FRAME_OBJECT_BEGIN,
+	FRAME_OBJECT_NAME,
+	FRAME_OBJECT_VALUE
+};
+
+jm_reader_t
+jm_reader_new(lexer_t lexer)
+{
+	return (jm_reader_t){.lexer = lexer,
+	    .buf = {NULL},
+	    .buf_len = 0,
+	    .tokencurr = NULL,
+	    .stack = string_new(),
+	    .root_done = 0,
+	    .event = (jm_event_t){.tag = JM_EVENT_TAG_EOF},
+	    .error = (error_t){.kind = SUCCESS, .ordinal = 0}};
+}
+
+jm_reader_t
+jm_reader_new_with_string(char *str)
+{
+	return jm_reader_new(lexer_new_with_string(str));
+}
+
+jm_reader_t
+jm_reader_new_with_file(FILE *file)
+{
+	return jm_reader_new(lexer_new_with_file(file));
+}
+
+void
+jm_reader_free(jm_reader_t *r)
+{
+	if (r->tokencurr != NULL)
+		token_free(r->tokencurr);
+	for (size_t i = 0; i < r->buf_len; i++)
+		token_free(r->buf[i]);
+	free(r->stack.bytes);
+	lexer_free(&r->lexer);
+	r->tokencurr = NULL;
+	r->buf_len = 0;
+}
+
+/*
+ * return: トークン。EOFかエラーの場合はNULL。
+ */
+token_t *
+jm_reader_read(jm_reader_t *r)
+{
+	if (r->buf_len > 0) {
+		BUG(r->buf_len > array_len(r->buf));
+		return r->buf[--r->buf_len];
+	}
+
+	return lexer_lex_token(&r->lexer);
+}
+
+void
+jm_reader_unread(jm_reader_t *r, token_t *tok)
+{
+	BUG(r->buf_len >= array_len(r->buf));
+	r->buf[r->buf_len++] = tok;
+}
+
+void
+jm_reader_set_general_error(jm_reader_t *r, token_t *tok)
+{
+	if (tok == NULL && r->lexer.error.kind != SUCCESS) {
+		/* 字句解析のエラー */
+		r->error = r->lexer.error;
+		return;
+	}
+
+	r->error = (error_t){.kind = ERROR_GENERAL,
+	    .ordinal = tok == NULL ? r->lexer.file.ordinal : tok->ordinal};
+}
+
+#define reader_top(r) ((r)->stack.bytes[(r)->stack.len - 1])
+
+/*
+ * 値を読み終えたあとの状態へ遷移する。
+ */
+void
+jm_reader_after_value(jm_reader_t *r)
+{
+	if (r->stack.len == 0) {
+		r->root_done = 1;
+		return;
+	}
+
+	switch (reader_top(r)) {
+	case FRAME_ARRAY_BEGIN:
+	case FRAME_ARRAY_VALUE:
+		reader_top(r) = FRAME_ARRAY_VALUE;
+		break;
+	case FRAME_OBJECT_NAME:
+		reader_top(r) = FRAME_OBJECT_VALUE;
+		break;
+	default:
+		BUG(1);
+	}
+}
+
+int
+jm_reader_value(jm_reader_t *r, jm_event_t *ev)
+{
+	token_t *t = jm_reader_read(r);
+	if (t == NULL) {
+		logmsg("unexpected EOF.\n");
+		jm_reader_set_general_error(r, t);
+		return -1;
+	}
+
+	*ev = (jm_event_t){.ordinal = t->ordinal, .depth = r->stack.len};
+
+	switch (t->tag) {
+	case TOKEN_TAG_NULL:
+		ev->tag = JM_EVENT_TAG_NULL;
+		break;
+	case TOKEN_TAG_BOOL:
+		ev->tag = JM_EVENT_TAG_BOOL;
+		ev->boolean = t->boolean;
+		break;
+	case TOKEN_TAG_NUMBER:
+		ev->tag = JM_EVENT_TAG_NUMBER;
+		ev->number = t->number;
+		break;
+	case TOKEN_TAG_STRING:
+		ev->tag = JM_EVENT_TAG_STRING;
+		ev->string = t->string;
+		break;
+	case TOKEN_TAG_BEGIN_ARRAY:
+		ev->tag = JM_EVENT_TAG_BEGIN_ARRAY;
+		jm_reader_after_value(r);
+		string_add_char(&r->stack, FRAME_ARRAY_BEGIN);
+		token_free(t);
+		return 0;
+	case TOKEN_TAG_BEGIN_OBJECT:
+		ev->tag = JM_EVENT_TAG_BEGIN_OBJECT;
+		jm_reader_after_value(r);
+		string_add_char(&r->stack, FRAME_OBJECT_BEGIN);
+		token_free(t);
+		return 0;
+	default:
+		logmsg("unexpected token: %s\n", token_stringify_tag(t->tag));
+		jm_reader_set_general_error(r, t);
+		token_free(t);
+		return -1;
+	}
+
+	jm_reader_after_value(r);
+	r->tokencurr = t;
+	return 0;
+}
+
+int
+jm_reader_name(jm_reader_t *r, jm_event_t *ev)
+{
+	token_t *t = jm_reader_read(r);
+	if (t == NULL || t->tag != TOKEN_TAG_STRING) {
+		logmsg("unexpected token: %s\n",
+		    t == NULL ? "(EOF)" : token_stringify_tag(t->tag));
+		jm_reader_set_general_error(r, t);
+		if (t != NULL)
+			token_free(t);
+		return -1;
+	}
+
+	token_t *sep = jm_reader_read(r);
+	if (sep == NULL || sep->tag != TOKEN_TAG_NAME_SEP) {
+		logmsg("unexpected token: %s\n",
+		    sep == NULL ? "(EOF)" : token_stringify_tag(sep->tag));
+		jm_reader_set_general_error(r, sep);
+		if (sep != NULL)
+			token_free(sep);
+		token_free(t);
+		return -1;
+	}
+	token_free(sep);
+
+	*ev = (jm_event_t){.ordinal = t->ordinal,
+	    .tag = JM_EVENT_TAG_NAME,
+	    .depth = r->stack.len,
+	    .string = t->string};
+	reader_top(r) = FRAME_OBJECT_NAME;
+	r->tokencurr = t;
+	return 0;
+}
+
+int
+jm_reader_end(jm_reader_t *r, token_t *t, jm_event_t *ev)
+{
+	r->stack.len--;
+	*ev = (jm_event_t){.ordinal = t->ordinal,
+	    .tag = t->tag == TOKEN_TAG_END_ARRAY ? JM_EVENT_TAG_END_ARRAY
+	                                         : JM_EVENT_TAG_END_OBJECT,
+	    .depth = r->stack.len};
+	if (r->stack.len == 0)
+		r->root_done = 1;
+	token_free(t);
+	return 0;
+}
+
+int
+jm_reader_next_internal(jm_reader_t *r, jm_event_t *ev)
+{
+	token_t *t;
+
+	if (r->stack.len == 0) {
+		if (!r->root_done)
+			return jm_reader_value(r, ev);
+
+		t = jm_reader_read(r);
+		if (t != NULL) {
+			logmsg("unexpected token: %s\n",
+			    token_stringify_tag(t->tag));
+			jm_reader_set_general_error(r, t);
+			token_free(t);
+			return -1;
+		}
+		if (r->lexer.error.kind != SUCCESS) {
+			jm_reader_set_general_error(r, t);
+			return -1;
+		}
+		*ev = (jm_event_t){.ordinal = r->lexer.file.ordinal,
+		    .tag = JM_EVENT_TAG_EOF,
+		    .depth = 0};
+		return 0;
+	}
+
+	t = jm_reader_read(r);
+	if (t == NULL) {
+		logmsg("unexpected EOF.\n");
+		jm_reader_set_general_error(r, t);
+		return -1;
+	}
+
+	switch (reader_top(r)) {
+	case FRAME_ARRAY_BEGIN:
+		if (t->tag == TOKEN_TAG_END_ARRAY)
+			return jm_reader_end(r, t, ev);
+		jm_reader_unread(r, t);
+		return jm_reader_value(r, ev);
+	case FRAME_ARRAY_VALUE:
+		if (t->tag == TOKEN_TAG_END_ARRAY)
+			return jm_reader_end(r, t, ev);
+		if (t->tag == TOKEN_TAG_VALUE_SEP) {
+			token_free(t);
+			return jm_reader_value(r, ev);
+		}
+		break;
+	case FRAME_OBJECT_BEGIN:
+		if (t->tag == TOKEN_TAG_END_OBJECT)
+			return jm_reader_end(r, t, ev);
+		jm_reader_unread(r, t);
+		return jm_reader_name(r, ev);
+	case FRAME_OBJECT_NAME:
+		jm_reader_unread(r, t);
+		return jm_reader_value(r, ev);
+	case FRAME_OBJECT_VALUE:
+		if (t->tag == TOKEN_TAG_END_OBJECT)
+			return jm_reader_end(r, t, ev);
+		if (t->tag == TOKEN_TAG_VALUE_SEP) {
+			token_free(t);
+			return jm_reader_name(r, ev);
+		}
+		break;
+	default:
+		BUG(1);
+	}
+
+	logmsg("unexpected token: %s\n", token_stringify_tag(t->tag));
+	jm_reader_set_general_error(r, t);
+	token_free(t);
+	return -1;
+}
+
+/*
+ * 次のイベントを読む。
+ *
+ * return: 成功なら0。エラーなら-1で、r->errorにエラーが設定される。
+ *         入力の終わりはJM_EVENT_TAG_EOFのイベントで表す。
+ */
+int
+jm_reader_next(jm_reader_t *r, jm_event_t *ev)
+{
+	if (r->error.kind != SUCCESS)
+		return -1;
+
+	if (r->tokencurr != NULL) {
+		token_free(r->tokencurr);
+		r->tokencurr = NULL;
+	}
+
+	if (jm_reader_next_internal(r, &r->event) == -1) {
+		r->event = (jm_event_t){.tag = JM_EVENT_TAG_EOF};
+		return -1;
+	}
+
+	if (ev != NULL)
+		*ev = r->event;
+	return 0;
+}
+
+/*
+ * ルートの値を読み終えたあとで、続けて次のルートの値を読めるようにす
+ * る。空白で区切られた複数の文書(NDJSONなど)を読むときに使う。
+ *
+ * return: 次の文書があれば0。入力の終わりなら1。エラーなら-1。
+ */
+int
+jm_reader_next_document(jm_reader_t *r)
+{
+	if (r->error.kind != SUCCESS)
+		return -1;
+	BUG(r->stack.len != 0 || !r->root_done);
+
+	if (r->tokencurr != NULL) {
+		token_free(r->tokencurr);
+		r->tokencurr = NULL;
+	}
+
+	token_t *t = jm_reader_read(r);
+	if (t == NULL) {
+		if (r->lexer.error.kind == SUCCESS)
+			return 1;
+		jm_reader_set_general_error(r, t);
+		return -1;
+	}
+
+	jm_reader_unread(r, t);
+	r->root_done = 0;
+	return 0;
+}
+
+/*
+ * 現在のイベントが配列かオブジェクトの開始なら、対応する終端までを読
+ * み飛ばす。名前なら、その値を読み飛ばす。それ以外なら何もしない。
+ *
+ * 読み飛ばす部分は字句解析せずに括弧の深さと文字列の境界だけを追う
+ * ので、その部分の構文の誤りは検出されない。
+ */
+int
+jm_reader_skip(jm_reader_t *r)
+{
+	if (r->error.kind != SUCCESS)
+		return -1;
+
+	switch (r->event.tag) {
+	case JM_EVENT_TAG_NAME:
+		BUG(r->buf_len != 0);
+		if (lexer_skip_value(&r->lexer) == -1) {
+			jm_reader_set_general_error(r, NULL);
+			return -1;
+		}
+		jm_reader_after_value(r);
+		return 0;
+	case JM_EVENT_TAG_BEGIN_ARRAY:
+	case JM_EVENT_TAG_BEGIN_OBJECT:
+		BUG(r->buf_len != 0);
+		if (lexer_skip_container(&r->lexer) == -1) {
+			jm_reader_set_general_error(r, NULL);
+			return -1;
+		}
+		r->stack.len--;
+		if (r->stack.len == 0)
+			r->root_done = 1;
+		r->event = (jm_event_t){.ordinal = r->lexer.file.ordinal,
+		    .tag = r->event.tag == JM_EVENT_TAG_BEGIN_ARRAY
+		        ? JM_EVENT_TAG_END_ARRAY
+		        : JM_EVENT_TAG_END_OBJECT,
+		    .depth = r->stack.len};
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+int
+jm_reader_get_bool(jm_reader_t *r, int *boolean)
+{
+	if (r->event.tag != JM_EVENT_TAG_BOOL)
+		return -1;
+
+	*boolean = r->event.boolean;
+	return 0;
+}
+
+int
+jm_reader_get_number(jm_reader_t *r, double *number)
+{
+	if (r->event.tag != JM_EVENT_TAG_NUMBER)
+		return -1;
+
+	*number = r->event.number;
+	return 0;
+}
+
+/*
+ * 文字列か名前を取得する。
+ *
+ * *strは次にjm_reader_next()などを呼び出すと無効になる。
+ */
+int
+jm_reader_get_string(jm_reader_t *r, const char **str, size_t *len)
+{
+	if (r->event.tag != JM_EVENT_TAG_STRING &&
+	    r->event.tag != JM_EVENT_TAG_NAME)
+		return -1;
+
+	*str = r->event.string.bytes;
+	if (len != NULL)
+		*len = r->event.string.len;
+	return 0;
+}
+
+/*
+ * 現在のイベントから始まる値の木を構築する。配列やオブジェクトなら、
+ * 対応する終端まで読み進める。
+ *
+ * return: 値のノード。エラーならNULL。
+ */
+node_t *
+jm_reader_build_value(jm_reader_t *r)
+{
+	jm_event_t ev = r->event;
+	string_t str;
+
+	switch (ev.tag) {
+	case JM_EVENT_TAG_NULL:
+		return node_new_null(ev.ordinal);
+	case JM_EVENT_TAG_BOOL:
+		return node_new_with_bool(ev.ordinal, ev.boolean);
+	case JM_EVENT_TAG_NUMBER:
+		return node_new_with_number(ev.ordinal, ev.number);
+	case JM_EVENT_TAG_STRING:
+		/* イベントの文字列はリーダーのものなので複製する */
+		str = string_new();
+		string_append_n(&str, ev.string.bytes, ev.string.len);
+		return node_new_with_string(ev.ordinal, str);
+	case JM_EVENT_TAG_BEGIN_ARRAY: {
+		node_t *array = node_new_array(ev.ordinal);
+		node_t *tail = NULL;
+		size_t index = 0;
+
+		for (;;) {
+			if (jm_reader_next(r, &ev) == -1) {
+				node_free(array);
+				return NULL;
+			}
+			if (ev.tag == JM_EVENT_TAG_END_ARRAY)
+				return array;
+
+			node_t *node_value = jm_reader_build_value(r);
+			if (node_value == NULL) {
+				node_free(array);
+				return NULL;
+			}
+			node_t *node_elem =
+			    node_new_aelem(ev.ordinal, index++, node_value);
+			if (tail != NULL)
+				tail->next = node_elem;
+			else
+				array->head = node_elem;
+			tail = node_elem;
+		}
+	}
+	case JM_EVENT_TAG_BEGIN_OBJECT: {
+		node_t *object = node_new_object(ev.ordinal);
+		node_t *tail = NULL;
+
+		for (;;) {
+			if (jm_reader_next(r, &ev) == -1) {
+				node_free(object);
+				return NULL;
+			}
+			if (ev.tag == JM_EVENT_TAG_END_OBJECT)
+				return object;
+
+			BUG(ev.tag != JM_EVENT_TAG_NAME);
+			string_t name = string_new();
+			string_append_n(&name, ev.string.bytes, ev.string.len);
+
+			node_t *node_value = jm_reader_next(r, &ev) == -1
+			    ? NULL
+			    : jm_reader_build_value(r);
+			if (node_value == NULL) {
+				free(name.bytes);
+				node_free(object);
+				return NULL;
+			}
+			node_t *node_elem =
+			    node_new_oelem(ev.ordinal, name, node_value);
+			if (tail != NULL)
+				tail->next = node_elem;
+			else
+				object->head = node_elem;
+			tail = node_elem;
+		}
+	}
+	default:
+		logmsg("unexpected event.\n");
+		jm_reader_set_general_error(r, NULL);
+		return NULL;
+	}
+}
+
+/*
+ * projection
+ *
+ * 指定されたパスの上にある値だけを構築し、それ以外は読み飛ばす。
+ */
+
+/*
+ * args: active: depth個のセグメントが一致しているパスの番号
+ * return: 値のノード。パス上に値がなかった場合とエラーの場合はNULL。
+ *         両者はr->error.kindで区別する。
+ */
+node_t *
+projection_build(jm_reader_t *r, jm_pointer_t **paths,
+    const size_t *active, size_t nactive, size_t depth)
+{
+	jm_event_t ev = r->event;
+
+	for (size_t i = 0; i < nactive; i++)
+		if (paths[active[i]]->len == depth)
+			return jm_reader_build_value(r);
+
+	switch (ev.tag) {
+	case JM_EVENT_TAG_BEGIN_ARRAY: {
+		node_t *array = node_new_array(ev.ordinal);
+		node_t *tail = NULL;
+		size_t *sub = xmalloc(sizeof(size_t) * (nactive + 1));
+
+		for (size_t index = 0;; index++) {
+			if (jm_reader_next(r, &ev) == -1)
+				goto array_error;
+			if (ev.tag == JM_EVENT_TAG_END_ARRAY)
+				break;
+
+			size_t nsub = 0;
+			for (size_t i = 0; i < nactive; i++)
+				if (paths[active[i]]->indices[depth] == index)
+					sub[nsub++] = active[i];
+			if (nsub == 0) {
+				if (jm_reader_skip(r) == -1)
+					goto array_error;
+				continue;
+			}
+
+			node_t *node_value =
+			    projection_build(r, paths, sub, nsub, depth + 1);
+			if (node_value == NULL) {
+				if (r->error.kind != SUCCESS)
+					goto array_error;
+				continue;
+			}
+			node_t *node_elem =
+			    node_new_aelem(ev.ordinal, index, node_value);
+			if (tail != NULL)
+				tail->next = node_elem;
+			else
+				array->head = node_elem;
+			tail = node_elem;
+		}
+
+		free(sub);
+		return array;
+	array_error:
+		free(sub);
+		node_free(array);
+		return NULL;
+	}
+	case JM_EVENT_TAG_BEGIN_OBJECT: {
+		node_t *object = node_new_object(ev.ordinal);
+		node_t *tail = NULL;
+		size_t *sub = xmalloc(sizeof(size_t) * (nactive + 1));
+
+		for (;;) {
+			if (jm_reader_next(r, &ev) == -1)
+				goto object_error;
+			if (ev.tag == JM_EVENT_TAG_END_OBJECT)
+				break;
+
+			size_t nsub = 0;
+			for (size_t i = 0; i < nactive; i++) {
+				string_t *seg = &paths[active[i]]->segs[depth];
+				if (seg->len == ev.string.len &&
+				    memcmp(seg->bytes, ev.string.bytes,
+				        seg->len) == 0)
+					sub[nsub++] = active[i];
+			}
+			if (nsub == 0) {
+				if (jm_reader_skip(r) == -1)
+					goto object_error;
+				continue;
+			}
+
+			string_t name = string_new();
+			string_append_n(&name, ev.string.bytes, ev.string.len);
+			if (jm_reader_next(r, &ev) == -1) {
+				free(name.bytes);
+				goto object_error;
+			}
+			node_t *node_value =
+			    projection_build(r, paths, sub, nsub, depth + 1);
+			if (node_value == NULL) {
+				free(name.bytes);
+				if (r->error.kind != SUCCESS)
+					goto object_error;
+				continue;
+			}
+			node_t *node_elem =
+			    node_new_oelem(ev.ordinal, name, node_value);
+			if (tail != NULL)
+				tail->next = node_elem;
+			else
+				object->head = node_elem;
+			tail = node_elem;
+		}
+
+		free(sub);
+		return object;
+	object_error:
+		free(sub);
+		node_free(object);
+		return NULL;
+	}
+	default:
+		/* パスはまだ続くがスカラー値だった */
+		return NULL;
+	}
+}
+
+/*
+ * pathsのいずれかの上にある値だけを含む木を構築する。パスはJSON
+ * Pointer (RFC 6901) で指定する。パスの途中にある配列やオブジェクト
+ * は、パス上の要素だけを持つ。配列の要素の添字は元の添字のまま。
+ *
+ * それ以外の値は字句解析せずに読み飛ばすので、その部分の構文の誤り
+ * は検出されない。
+ */
+void
+parser_parse_projected(parser_t *p, const char **paths, size_t n)
+{
+	jm_reader_t r = jm_reader_new(lexer_new(p->lexer.file));
+	jm_pointer_t **compiled = xmalloc(sizeof(jm_pointer_t *) * (n + 1));
+	size_t *active = xmalloc(sizeof(size_t) * (n + 1));
+	jm_event_t ev;
+	node_t *root = NULL;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if ((compiled[i] = jm_pointer_compile(paths[i])) == NULL) {
+			logmsg("invalid path: %s\n", paths[i]);
+			p->error =
+			    (error_t){.kind = ERROR_GENERAL, .ordinal = 0};
+			n = i;
+			goto finish;
+		}
+		active[i] = i;
+	}
+
+	if (jm_reader_next(&r, &ev) == -1) {
+		p->error = r.error;
+		goto finish;
+	}
+	root = projection_build(&r, compiled, active, n, 0);
+	if (r.error.kind != SUCCESS) {
+		p->error = r.error;
+		goto finish;
+	}
+	if (jm_reader_next(&r, &ev) == -1) {
+		p->error = r.error;
+		node_free(root);
+		goto finish;
+	}
+
+	p->noderoot = root;
+	p->error.kind = SUCCESS;
+
+finish:
+	for (i = 0; i < n; i++)
+		jm_pointer_free(compiled[i]);
+	free(compiled);
+	free(active);
+	p->lexer.file = r.lexer.file;
+	jm_reader_free(&r);
+}
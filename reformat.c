@@ -0,0 +1,97 @@
+#include "jsonmodoki.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * 整形し直し
+ *
+ * リーダーのイベントをそのままライターに渡す。字句解析器をrawモード
+ * にして、文字列と数値はエスケープの解除もstrtod()も行わずに入力のま
+ * ま写す。木は作らず、使うメモリは入れ子の深さに比例する分だけ。
+ */
+
+/*
+ * inのJSONをoutに書き直す。圧縮するか字下げするかはoutのflagsで決め
+ * る。空白で区切られた複数の文書は、改行で区切って書く。
+ *
+ * error: 入力の誤り
+ *
+ * return: 成功なら0。入力に誤りがあれば-1で、*errorにエラーが設定さ
+ *         れる。書き込みに失敗したら-1で、out->errorにエラーが設定さ
+ *         れる。
+ */
+int
+jm_reformat(file_t in, jm_writer_t *out, error_t *error)
+{
+	jm_reader_t r = jm_reader_new(lexer_new(in));
+	const string_t *raw = &r.lexer.tokbuf;
+	jm_event_t ev;
+	int ret = -1;
+
+	r.lexer.raw = 1;
+
+	for (;;) {
+		int written;
+
+		if (jm_reader_next(&r, &ev) == -1) {
+			*error = r.error;
+			goto finish;
+		}
+
+		switch (ev.tag) {
+		case JM_EVENT_TAG_NULL:
+			written = jm_writer_value_null(out);
+			break;
+		case JM_EVENT_TAG_BOOL:
+			written = jm_writer_value_bool(out, ev.boolean);
+			break;
+		case JM_EVENT_TAG_NUMBER:
+		case JM_EVENT_TAG_STRING:
+			written =
+			    jm_writer_value_raw(out, raw->bytes, raw->len);
+			break;
+		case JM_EVENT_TAG_NAME:
+			written = jm_writer_key_raw(out, raw->bytes, raw->len);
+			break;
+		case JM_EVENT_TAG_BEGIN_ARRAY:
+			written = jm_writer_begin_array(out);
+			break;
+		case JM_EVENT_TAG_END_ARRAY:
+			written = jm_writer_end_array(out);
+			break;
+		case JM_EVENT_TAG_BEGIN_OBJECT:
+			written = jm_writer_begin_object(out);
+			break;
+		case JM_EVENT_TAG_END_OBJECT:
+			written = jm_writer_end_object(out);
+			break;
+		default:
+			BUG(1);
+		}
+		if (written == -1)
+			goto input_ok;
+
+		if (!r.root_done || r.stack.len != 0)
+			continue;
+
+		switch (jm_reader_next_document(&r)) {
+		case -1:
+			*error = r.error;
+			goto finish;
+		case 1:
+			ret = jm_writer_finish(out);
+			goto input_ok;
+		}
+		if (jm_writer_next_document(out) == -1)
+			goto input_ok;
+	}
+
+input_ok:
+	/* 入力には誤りがなかった */
+	*error = (error_t){.kind = SUCCESS, .ordinal = r.lexer.file.ordinal};
+
+finish:
+	jm_reader_free(&r);
+	return ret;
+}
@@ -0,0 +1,258 @@
+#include "jsonmodoki.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * 直列化
+ *
+ * 木を再帰せずに、開いている配列やオブジェクトのスタックを使ってたど
+ * る。
+ */
+
+/*
+ * エスケープが必要なバイトなら、バックスラッシュに続く文字。'u'なら
+ * \u00XXの形にする。不要なら0。
+ */
+static const char escape_table[256] = {
+    ['\0'] = 'u',
+    [0x01] = 'u',
+    [0x02] = 'u',
+    [0x03] = 'u',
+    [0x04] = 'u',
+    [0x05] = 'u',
+    [0x06] = 'u',
+    [0x07] = 'u',
+    ['\b'] = 'b',
+    ['\t'] = 't',
+    ['\n'] = 'n',
+    [0x0b] = 'u',
+    ['\f'] = 'f',
+    ['\r'] = 'r',
+    [0x0e] = 'u',
+    [0x0f] = 'u',
+    [0x10] = 'u',
+    [0x11] = 'u',
+    [0x12] = 'u',
+    [0x13] = 'u',
+    [0x14] = 'u',
+    [0x15] = 'u',
+    [0x16] = 'u',
+    [0x17] = 'u',
+    [0x18] = 'u',
+    [0x19] = 'u',
+    [0x1a] = 'u',
+    [0x1b] = 'u',
+    [0x1c] = 'u',
+    [0x1d] = 'u',
+    [0x1e] = 'u',
+    [0x1f] = 'u',
+    ['"'] = '"',
+    ['\\'] = '\\',
+};
+
+/*
+ * 文字列を引用符で囲み、エスケープして書き込む。エスケープが不要な部
+ * 分はまとめて書き込む。
+ */
+void
+serialize_string(string_t *out, const char *bytes, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t run = 0;
+
+	string_add_char(out, '"');
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = bytes[i];
+		char e = escape_table[c];
+
+		if (e == 0)
+			continue;
+
+		string_append_n(out, bytes + run, i - run);
+		run = i + 1;
+		if (e == 'u') {
+			char u[] = {
+			    '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+			string_append_n(out, u, sizeof(u));
+		} else {
+			char s[] = {'\\', e};
+			string_append_n(out, s, sizeof(s));
+		}
+	}
+	string_append_n(out, bytes + run, len - run);
+	string_add_char(out, '"');
+}
+
+/*
+ * return: 成功なら0。JSONで表せない数値なら-1。
+ */
+int
+serialize_number(string_t *out, double num)
+{
+	char buf[JM_DTOA_BUFSIZE];
+
+	if (!isfinite(num)) {
+		logmsg("cannot serialize non-finite number.\n");
+		return -1;
+	}
+
+	string_append_n(out, buf, jm_dtoa(num, buf));
+	return 0;
+}
+
+void
+serialize_newline(string_t *out, int flags, size_t depth)
+{
+	if (!(flags & JM_SERIALIZE_PRETTY))
+		return;
+
+	string_add_char(out, '\n');
+	for (size_t i = 0; i < depth; i++)
+		string_append_n(out, "  ", 2);
+}
+
+typedef struct serialize_frame {
+	node_t *container;
+	node_t *next; /* 次に書き込む要素 */
+} serialize_frame_t;
+
+/*
+ * 詰めた数値の配列を書く。
+ *
+ * depth: 配列の深さ
+ */
+int
+serialize_packed(string_t *out, node_t *array, int flags, size_t depth)
+{
+	string_add_char(out, '[');
+	for (size_t i = 0; i < array->packed_len; i++) {
+		if (i > 0)
+			string_add_char(out, ',');
+		serialize_newline(out, flags, depth + 1);
+		if (serialize_number(out, node_packed_get(array, i)) == -1)
+			return -1;
+	}
+	serialize_newline(out, flags, depth);
+	string_add_char(out, ']');
+	return 0;
+}
+
+/*
+ * nodeをJSONとしてoutの末尾に書き込む。
+ *
+ * flags: JM_SERIALIZE_PRETTYなら改行と字下げを入れる。
+ *        JM_SERIALIZE_PASSTHROUGHなら、入力の範囲が残っている配列と
+ *        オブジェクトは走査せずに入力をそのまま写す。写した部分には
+ *        JM_SERIALIZE_PRETTYは効かない。
+ *
+ * return: 成功なら0。JSONで表せない数値(無限大やNaN)を含んでいれば-1
+ *         で、outには途中まで書き込まれている。
+ */
+int
+jm_serialize(node_t *node, string_t *out, int flags)
+{
+	serialize_frame_t *stack = NULL;
+	size_t stack_len = 0, stack_capacity = 0;
+	node_t *value = node;
+	int is_array;
+	int ret = 0;
+
+	for (;;) {
+		if (value != NULL) {
+			switch (value->tag) {
+			case NODE_TAG_NULL:
+				string_append_n(out, "null", 4);
+				break;
+			case NODE_TAG_BOOL:
+				if (value->boolean)
+					string_append_n(out, "true", 4);
+				else
+					string_append_n(out, "false", 5);
+				break;
+			case NODE_TAG_NUMBER:
+				if (serialize_number(out, value->num) == -1) {
+					ret = -1;
+					goto finish;
+				}
+				break;
+			case NODE_TAG_STRING:
+				serialize_string(
+				    out, value->str.bytes, value->str.len);
+				break;
+			case NODE_TAG_ARRAY:
+			case NODE_TAG_OBJECT:
+				if ((flags & JM_SERIALIZE_PASSTHROUGH) &&
+				    value->src != NULL) {
+					/* 書き換えられていないので写す */
+					string_append_n(
+					    out, value->src, value->src_len);
+					break;
+				}
+				if (value->packing != NODE_PACKED_NONE) {
+					if (serialize_packed(out, value, flags,
+					        stack_len) == -1) {
+						ret = -1;
+						goto finish;
+					}
+					break;
+				}
+				is_array = value->tag == NODE_TAG_ARRAY;
+				string_add_char(out, is_array ? '[' : '{');
+				if (value->head == NULL) {
+					/* 空なので閉じる */
+					string_add_char(out, "}]"[is_array]);
+					break;
+				}
+				if (stack_len == stack_capacity) {
+					stack_capacity = stack_capacity == 0
+					    ? 16
+					    : stack_capacity * 2;
+					stack = xrealloc(stack,
+					    sizeof(serialize_frame_t) *
+					        stack_capacity);
+				}
+				stack[stack_len++] = (serialize_frame_t){
+				    .container = value, .next = value->head};
+				break;
+			default:
+				BUG(1);
+			}
+			value = NULL;
+		}
+
+		if (stack_len == 0)
+			break;
+
+		serialize_frame_t *f = &stack[stack_len - 1];
+		node_t *elem = f->next;
+
+		if (elem == NULL) {
+			stack_len--;
+			serialize_newline(out, flags, stack_len);
+			string_add_char(out,
+			    f->container->tag == NODE_TAG_ARRAY ? ']' : '}');
+			continue;
+		}
+
+		if (elem != f->container->head)
+			string_add_char(out, ',');
+		serialize_newline(out, flags, stack_len);
+		if (elem->tag == NODE_TAG_OBJECT_ELEM) {
+			serialize_string(
+			    out, elem->name.bytes, elem->name.len);
+			if (flags & JM_SERIALIZE_PRETTY)
+				string_append_n(out, ": ", 2);
+			else
+				string_add_char(out, ':');
+		}
+		f->next = elem->next;
+		value = elem->val;
+	}
+
+finish:
+	free(stack);
+	return ret;
+}
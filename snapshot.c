@@ -0,0 +1,598 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "jsonmodoki.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * スナップショット
+ *
+ * 構文解析した木を、ポインタを含まない形でファイルに書き出す。ファイル
+ * をmmapすればそのまま読み出し専用で使えるので、大きな文書を起動のた
+ * びに構文解析しなくてよい。読み出し専用の共有マッピングなので、複数
+ * のプロセスが同じファイルを開けばページキャッシュを共有する。
+ *
+ * ファイルは64ビットの語の列で、先頭にヘッダーがある。
+ *
+ *   magic, byte order, ファイルの長さ, ルートの位置
+ *
+ * 続いて値のレコードが8バイト境界に並ぶ。位置はすべてファイルの先頭か
+ * らのバイト数で、どこにマップしても使える。レコードの最初の語は下位8
+ * ビットがenum node_tag、残りが長さ。
+ *
+ *   null, bool, number: tag, 値
+ *   string:             tag | バイト数 << 8, バイト列, nul文字, 詰め物
+ *   array:              tag | 要素数 << 8, 要素の位置...
+ *   object:             tag | 要素数 << 8, (名前の位置, 値の位置)...
+ *
+ * 名前は文字列のレコード。子のレコードは親より前に書く。語はホストの
+ * バイト順で書き、バイト順の違うホストで作ったファイルは開かない。
+ */
+
+/* レコードの形やタグの値を変えたら版を上げる */
+#define SNAPSHOT_MAGIC "JMSNAP01"
+#define SNAPSHOT_BYTE_ORDER UINT64_C(0x0102030405060708)
+#define SNAPSHOT_HEADER_WORDS 4
+#define SNAPSHOT_WORD sizeof(uint64_t)
+
+typedef struct snapshot_writer {
+	FILE *fp;
+	size_t pos; /* 書いたバイト数 */
+} snapshot_writer_t;
+
+/* 書いている配列やオブジェクト */
+typedef struct snapshot_frame {
+	node_t *node;
+	node_t *next; /* 次に書く要素 */
+	uint64_t *offsets; /* 書いた子の位置 */
+	size_t offsets_len;
+	size_t offsets_capacity;
+} snapshot_frame_t;
+
+/*
+ * 書き込みのエラーは最後にまとめてferror()で調べる。
+ */
+void
+snapshot_put(snapshot_writer_t *w, const void *p, size_t len)
+{
+	if (len == 0)
+		return; /* 空の配列ではpがNULL */
+	fwrite(p, 1, len, w->fp);
+	w->pos += len;
+}
+
+void
+snapshot_put_word(snapshot_writer_t *w, uint64_t word)
+{
+	snapshot_put(w, &word, SNAPSHOT_WORD);
+}
+
+/*
+ * return: レコードの位置
+ */
+size_t
+snapshot_put_string(snapshot_writer_t *w, const string_t *s)
+{
+	static const char zeros[SNAPSHOT_WORD];
+	size_t offset = w->pos;
+
+	snapshot_put_word(w, NODE_TAG_STRING | (uint64_t)s->len << 8);
+	snapshot_put(w, s->bytes, s->len);
+	snapshot_put(w, zeros, SNAPSHOT_WORD - s->len % SNAPSHOT_WORD);
+	return offset;
+}
+
+/*
+ * return: レコードの位置
+ */
+size_t
+snapshot_put_scalar(snapshot_writer_t *w, node_t *node)
+{
+	size_t offset = w->pos;
+	uint64_t word;
+
+	switch (node->tag) {
+	case NODE_TAG_NULL:
+		word = 0;
+		break;
+	case NODE_TAG_BOOL:
+		word = node->boolean != 0;
+		break;
+	case NODE_TAG_NUMBER:
+		memcpy(&word, &node->num, sizeof(word));
+		break;
+	case NODE_TAG_STRING:
+		return snapshot_put_string(w, &node->str);
+	default:
+		BUG(1);
+	}
+
+	snapshot_put_word(w, node->tag);
+	snapshot_put_word(w, word);
+	return offset;
+}
+
+void
+snapshot_frame_add(snapshot_frame_t *f, uint64_t offset)
+{
+	if (f->offsets_len == f->offsets_capacity) {
+		f->offsets_capacity =
+		    f->offsets_capacity == 0 ? 8 : f->offsets_capacity * 2;
+		f->offsets = xrealloc(
+		    f->offsets, sizeof(uint64_t) * f->offsets_capacity);
+	}
+	f->offsets[f->offsets_len++] = offset;
+}
+
+/*
+ * 詰めた数値の配列を、要素のレコードに続けて書く。
+ *
+ * return: 配列のレコードの位置
+ */
+size_t
+snapshot_put_packed(snapshot_writer_t *w, node_t *array)
+{
+	size_t first = w->pos, offset;
+
+	for (size_t i = 0; i < array->packed_len; i++) {
+		double num = node_packed_get(array, i);
+		uint64_t word;
+		memcpy(&word, &num, sizeof(word));
+		snapshot_put_word(w, NODE_TAG_NUMBER);
+		snapshot_put_word(w, word);
+	}
+
+	offset = w->pos;
+	snapshot_put_word(
+	    w, NODE_TAG_ARRAY | (uint64_t)array->packed_len << 8);
+	for (size_t i = 0; i < array->packed_len; i++)
+		snapshot_put_word(w, first + SNAPSHOT_WORD * 2 * i);
+	return offset;
+}
+
+/*
+ * 次の要素の値を返す。オブジェクトの要素なら先に名前を書く。
+ *
+ * return: 要素がなければNULL
+ */
+node_t *
+snapshot_frame_next(snapshot_writer_t *w, snapshot_frame_t *f)
+{
+	node_t *elem = f->next;
+
+	if (elem == NULL)
+		return NULL;
+
+	f->next = elem->next;
+	if (elem->tag == NODE_TAG_OBJECT_ELEM)
+		snapshot_frame_add(f, snapshot_put_string(w, &elem->name));
+	return elem->val;
+}
+
+/*
+ * 木をレコードにして書く。子を書き終えてから親を書く。
+ *
+ * return: ルートのレコードの位置
+ */
+size_t
+snapshot_put_tree(snapshot_writer_t *w, node_t *root)
+{
+	snapshot_frame_t *stack = NULL;
+	size_t stack_len = 0, stack_capacity = 0;
+	node_t *value = root;
+	size_t offset;
+
+	for (;;) {
+		if (value != NULL && value->tag != NODE_TAG_ARRAY &&
+		    value->tag != NODE_TAG_OBJECT) {
+			offset = snapshot_put_scalar(w, value);
+		} else if (value != NULL &&
+		    value->packing != NODE_PACKED_NONE) {
+			offset = snapshot_put_packed(w, value);
+		} else if (value != NULL) {
+			if (stack_len == stack_capacity) {
+				stack_capacity = stack_capacity == 0
+				    ? 16
+				    : stack_capacity * 2;
+				stack = xrealloc(stack,
+				    sizeof(snapshot_frame_t) * stack_capacity);
+			}
+			stack[stack_len++] = (snapshot_frame_t){.node = value,
+			    .next = value->head,
+			    .offsets = NULL,
+			    .offsets_len = 0,
+			    .offsets_capacity = 0};
+			value = NULL;
+			continue;
+		} else {
+			snapshot_frame_t *f = &stack[stack_len - 1];
+			value = snapshot_frame_next(w, f);
+			if (value != NULL)
+				continue;
+
+			/* 要素をすべて書いた */
+			size_t len = f->node->tag == NODE_TAG_OBJECT
+			    ? f->offsets_len / 2
+			    : f->offsets_len;
+			offset = w->pos;
+			snapshot_put_word(
+			    w, f->node->tag | (uint64_t)len << 8);
+			snapshot_put(w, f->offsets,
+			    sizeof(uint64_t) * f->offsets_len);
+			free(f->offsets);
+			stack_len--;
+		}
+
+		if (stack_len == 0)
+			break;
+		snapshot_frame_add(&stack[stack_len - 1], offset);
+		value = NULL;
+	}
+
+	free(stack);
+	return offset;
+}
+
+/*
+ * rootを書き出す。いったん一時ファイルに書いてから置き換えるので、同じ
+ * ファイルをすでに開いているプロセスは古い内容を使い続けられる。一時
+ * ファイルは同じディレクトリに重ならない名前で作るので、同時に書いて
+ * も壊れない。
+ *
+ * return: 成功なら0。エラーなら-1。
+ */
+int
+jm_snapshot_write(node_t *root, const char *path)
+{
+	string_t tmp = string_new();
+	snapshot_writer_t w = {.fp = NULL, .pos = 0};
+	size_t root_offset;
+	int fd, ret = -1;
+
+	string_appendf(&tmp, "%s.XXXXXX", path);
+	fd = mkstemp(tmp.bytes);
+	if (fd == -1) {
+		logmsg("%s: %s\n", tmp.bytes, strerror(errno));
+		goto finish;
+	}
+	/* mkstemp()は所有者しか読めないファイルを作る */
+	if (fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) == -1 ||
+	    (w.fp = fdopen(fd, "wb")) == NULL) {
+		logmsg("%s: %s\n", tmp.bytes, strerror(errno));
+		close(fd);
+		remove(tmp.bytes);
+		goto finish;
+	}
+
+	/* ヘッダーはあとで書く */
+	for (size_t i = 0; i < SNAPSHOT_HEADER_WORDS; i++)
+		snapshot_put_word(&w, 0);
+	root_offset = snapshot_put_tree(&w, root);
+
+	if (fseek(w.fp, 0, SEEK_SET) != 0) {
+		logmsg("%s: %s\n", tmp.bytes, strerror(errno));
+		fclose(w.fp);
+		remove(tmp.bytes);
+		goto finish;
+	}
+	snapshot_put(&w, SNAPSHOT_MAGIC, SNAPSHOT_WORD);
+	snapshot_put_word(&w, SNAPSHOT_BYTE_ORDER);
+	snapshot_put_word(&w, w.pos - SNAPSHOT_WORD * 2);
+	snapshot_put_word(&w, root_offset);
+	if (ferror(w.fp) || fclose(w.fp) != 0) {
+		logmsg("%s: write failed\n", tmp.bytes);
+		remove(tmp.bytes);
+		goto finish;
+	}
+
+	if (rename(tmp.bytes, path) == -1) {
+		logmsg("%s: %s\n", path, strerror(errno));
+		remove(tmp.bytes);
+		goto finish;
+	}
+	ret = 0;
+
+finish:
+	free(tmp.bytes);
+	return ret;
+}
+
+/*
+ * return: offsetがレコードの先頭なら1
+ */
+int
+snapshot_is_start(const unsigned char *starts, uint64_t offset)
+{
+	uint64_t word = offset / SNAPSHOT_WORD;
+
+	return offset % SNAPSHOT_WORD == 0 &&
+	    (starts[word / CHAR_BIT] >> word % CHAR_BIT & 1);
+}
+
+/*
+ * レコードを先頭から順にたどって、形と位置を検査する。子は親より前に
+ * 書くので、要素の位置はそれまでに見たレコードの先頭でなければならな
+ * い。ファイルの長さに比例する時間と、長さの1/64のメモリを使う。
+ *
+ * 開くときにはヘッダーしか検査しない。壊れたファイルの値を参照すると、
+ * 範囲外は読まないがBUG()で止まる。信頼できないファイルは、値を参照
+ * する前にこれで検査する。
+ *
+ * return: 正しければ0。壊れていれば-1。
+ */
+int
+jm_snapshot_validate(const jm_snapshot_t *s)
+{
+	const char *map = s->map;
+	size_t len = s->len, root = s->root;
+	size_t starts_len = len / SNAPSHOT_WORD / CHAR_BIT + 1;
+	unsigned char *starts = xmalloc(starts_len); /* レコードの先頭 */
+	size_t offset = SNAPSHOT_WORD * SNAPSHOT_HEADER_WORDS;
+	int ret = -1;
+
+	memset(starts, 0, starts_len);
+	while (offset < len) {
+		/* 最初の語に続く語の数 */
+		size_t rest = (len - offset) / SNAPSHOT_WORD - 1, words;
+		uint64_t word, n;
+		enum node_tag tag;
+
+		memcpy(&word, map + offset, sizeof(word));
+		tag = word & 0xff;
+		n = word >> 8;
+
+		switch (tag) {
+		case NODE_TAG_NULL:
+		case NODE_TAG_BOOL:
+		case NODE_TAG_NUMBER:
+			if (n != 0 || rest < 1)
+				goto finish;
+			words = 1;
+			break;
+		case NODE_TAG_STRING:
+			if (n / SNAPSHOT_WORD >= rest ||
+			    map[offset + SNAPSHOT_WORD + n] != '\0')
+				goto finish;
+			words = n / SNAPSHOT_WORD + 1;
+			break;
+		case NODE_TAG_ARRAY:
+		case NODE_TAG_OBJECT:
+			if (n > rest / (tag == NODE_TAG_OBJECT ? 2 : 1))
+				goto finish;
+			words = tag == NODE_TAG_OBJECT ? n * 2 : n;
+			for (size_t i = 0; i < words; i++) {
+				uint64_t child, child_word;
+				memcpy(&child,
+				    map + offset + SNAPSHOT_WORD * (i + 1),
+				    sizeof(child));
+				if (child >= offset ||
+				    !snapshot_is_start(starts, child))
+					goto finish;
+				/* 名前は文字列 */
+				memcpy(&child_word, map + child,
+				    sizeof(child_word));
+				if (tag == NODE_TAG_OBJECT && i % 2 == 0 &&
+				    (child_word & 0xff) != NODE_TAG_STRING)
+					goto finish;
+			}
+			break;
+		default:
+			goto finish;
+		}
+
+		starts[offset / SNAPSHOT_WORD / CHAR_BIT] |=
+		    1 << offset / SNAPSHOT_WORD % CHAR_BIT;
+		offset += SNAPSHOT_WORD * (words + 1);
+	}
+
+	if (snapshot_is_start(starts, root))
+		ret = 0;
+
+finish:
+	free(starts);
+	return ret;
+}
+
+/*
+ * スナップショットをマップする。ヘッダーだけを検査するので、ファイル
+ * の長さによらず軽い。レコードの検査はjm_snapshot_validate()で行う。
+ *
+ * return: スナップショット。エラーならNULL。
+ */
+jm_snapshot_t *
+jm_snapshot_open(const char *path)
+{
+	const size_t header_len = SNAPSHOT_WORD * SNAPSHOT_HEADER_WORDS;
+	uint64_t header[SNAPSHOT_HEADER_WORDS];
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		logmsg("%s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &st) == -1) {
+		logmsg("%s: %s\n", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	if ((size_t)st.st_size < header_len) {
+		logmsg("%s: not a snapshot\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		logmsg("%s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	memcpy(header, map, header_len);
+	if (memcmp(&header[0], SNAPSHOT_MAGIC, SNAPSHOT_WORD) != 0 ||
+	    header[1] != SNAPSHOT_BYTE_ORDER ||
+	    header[2] != (uint64_t)st.st_size ||
+	    header[3] < header_len || header[3] >= header[2] ||
+	    header[2] % SNAPSHOT_WORD != 0 ||
+	    header[3] % SNAPSHOT_WORD != 0) {
+		logmsg("%s: not a snapshot\n", path);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	jm_snapshot_t *s = xmalloc(sizeof(jm_snapshot_t));
+	*s = (jm_snapshot_t){
+	    .map = map, .len = st.st_size, .root = header[3]};
+	return s;
+}
+
+void
+jm_snapshot_close(jm_snapshot_t *s)
+{
+	munmap((void *)s->map, s->len);
+	free(s);
+}
+
+/*
+ * 壊れたファイルでは位置が範囲外になりうるので、読む前に止める
+ */
+uint64_t
+snapshot_word(const jm_snapshot_t *s, size_t offset)
+{
+	uint64_t word;
+
+	BUG(offset % SNAPSHOT_WORD != 0 || offset >= s->len);
+	memcpy(&word, s->map + offset, sizeof(word));
+	return word;
+}
+
+jm_snapshot_value_t
+jm_snapshot_root(const jm_snapshot_t *s)
+{
+	return (jm_snapshot_value_t){.snap = s, .offset = s->root};
+}
+
+enum node_tag
+jm_snapshot_tag(jm_snapshot_value_t v)
+{
+	return snapshot_word(v.snap, v.offset) & 0xff;
+}
+
+int
+jm_snapshot_bool(jm_snapshot_value_t v)
+{
+	BUG(jm_snapshot_tag(v) != NODE_TAG_BOOL);
+	return snapshot_word(v.snap, v.offset + SNAPSHOT_WORD) != 0;
+}
+
+double
+jm_snapshot_number(jm_snapshot_value_t v)
+{
+	uint64_t word;
+	double num;
+
+	BUG(jm_snapshot_tag(v) != NODE_TAG_NUMBER);
+	word = snapshot_word(v.snap, v.offset + SNAPSHOT_WORD);
+	memcpy(&num, &word, sizeof(num));
+	return num;
+}
+
+/*
+ * return: nul文字終端した文字列。途中にnul文字を含むことがあるので、長
+ *         さは*lenで返す。マップを閉じるまで有効。
+ */
+const char *
+jm_snapshot_string(jm_snapshot_value_t v, size_t *len)
+{
+	uint64_t word = snapshot_word(v.snap, v.offset);
+
+	BUG((word & 0xff) != NODE_TAG_STRING);
+	*len = word >> 8;
+	BUG(*len >= v.snap->len - v.offset - SNAPSHOT_WORD);
+	return v.snap->map + v.offset + SNAPSHOT_WORD;
+}
+
+/*
+ * return: 配列かオブジェクトの要素数
+ */
+size_t
+jm_snapshot_len(jm_snapshot_value_t v)
+{
+	uint64_t word = snapshot_word(v.snap, v.offset);
+
+	BUG((word & 0xff) != NODE_TAG_ARRAY &&
+	    (word & 0xff) != NODE_TAG_OBJECT);
+	return word >> 8;
+}
+
+/*
+ * return: index番目の要素があれば0。なければ-1。
+ */
+int
+jm_snapshot_array_get(
+    jm_snapshot_value_t array, size_t index, jm_snapshot_value_t *out)
+{
+	BUG(jm_snapshot_tag(array) != NODE_TAG_ARRAY);
+
+	if (index >= jm_snapshot_len(array))
+		return -1;
+	*out = (jm_snapshot_value_t){.snap = array.snap,
+	    .offset = snapshot_word(
+	        array.snap, array.offset + SNAPSHOT_WORD * (index + 1))};
+	return 0;
+}
+
+/*
+ * index番目の要素の名前と値を返す。
+ *
+ * return: index番目の要素があれば0。なければ-1。
+ */
+int
+jm_snapshot_object_at(jm_snapshot_value_t object, size_t index,
+    jm_snapshot_value_t *name, jm_snapshot_value_t *value)
+{
+	size_t pair = object.offset + SNAPSHOT_WORD * (index * 2 + 1);
+
+	BUG(jm_snapshot_tag(object) != NODE_TAG_OBJECT);
+
+	if (index >= jm_snapshot_len(object))
+		return -1;
+	*name = (jm_snapshot_value_t){.snap = object.snap,
+	    .offset = snapshot_word(object.snap, pair)};
+	*value = (jm_snapshot_value_t){.snap = object.snap,
+	    .offset = snapshot_word(object.snap, pair + SNAPSHOT_WORD)};
+	return 0;
+}
+
+/*
+ * return: 名前がnameである最初の要素があれば0。なければ-1。
+ */
+int
+jm_snapshot_object_get(
+    jm_snapshot_value_t object, const char *name, jm_snapshot_value_t *out)
+{
+	size_t name_len = strlen(name);
+	jm_snapshot_value_t n;
+
+	for (size_t i = 0; jm_snapshot_object_at(object, i, &n, out) == 0;
+	     i++) {
+		size_t len;
+		const char *s = jm_snapshot_string(n, &len);
+		if (len == name_len && memcmp(s, name, len) == 0)
+			return 0;
+	}
+
+	return -1;
+}
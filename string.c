@@ -1,5 +1,7 @@
 #include "jsonmodoki.h"
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 string_t
@@ -15,11 +17,7 @@ string_new(void)
 void
 string_add_char(string_t *s, int c)
 {
-	if (s->len + 1 >= s->capacity) {
-		s->capacity *= 2;
-		s->bytes = xrealloc(s->bytes, s->capacity);
-	}
-
+	string_reserve(s, 1);
 	s->bytes[s->len++] = c;
 	s->bytes[s->len] = '\0';
 }
@@ -27,8 +25,84 @@ string_add_char(string_t *s, int c)
 void
 string_add_string(string_t *s, const char *str)
 {
-	size_t len = strlen(str);
+	string_append_n(s, str, strlen(str));
+}
+
+/*
+ * 確保し直さずに、さらにlenバイトを追加できるようにする。
+ */
+void
+string_reserve(string_t *s, size_t len)
+{
+	if (s->len + len < s->capacity)
+		return;
+
+	if (s->capacity == 0)
+		s->capacity = 16;
+	while (s->len + len >= s->capacity)
+		s->capacity *= 2;
+	s->bytes = xrealloc(s->bytes, s->capacity);
+}
+
+/*
+ * strのlenバイトをまとめて追加する。strはnul文字を含んでいてもよい。
+ */
+void
+string_append_n(string_t *s, const char *str, size_t len)
+{
+	string_reserve(s, len);
+	if (len > 0)
+		memcpy(s->bytes + s->len, str, len);
+	s->len += len;
+	s->bytes[s->len] = '\0';
+}
 
-	for (size_t i = 0; i < len; i++)
-		string_add_char(s, str[i]);
+/*
+ * 書式化した文字列を、一時的なバッファを介さずに末尾の空きへ直接書き
+ * 込む。入りきらなければ、確保し直してもう一度だけ書き込む。
+ *
+ * return: 追加した長さ
+ */
+int
+string_vappendf(string_t *s, const char *fmt, va_list ap)
+{
+	va_list retry;
+	int len;
+
+	string_reserve(s, 0); /* 確保していなければ確保する */
+	va_copy(retry, ap);
+	len = vsnprintf(s->bytes + s->len, s->capacity - s->len, fmt, ap);
+	if (len < 0) {
+		logmsg("vsnprintf failed.\n");
+		abort();
+	}
+
+	if ((size_t)len >= s->capacity - s->len) {
+		string_reserve(s, len);
+		vsnprintf(s->bytes + s->len, s->capacity - s->len, fmt, retry);
+	}
+	va_end(retry);
+
+	s->len += len;
+	return len;
+}
+
+int
+string_appendf(string_t *s, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = string_vappendf(s, fmt, ap);
+	va_end(ap);
+	return len;
+}
+
+void
+string_clear(string_t *s)
+{
+	s->len = 0;
+	if (s->bytes != NULL)
+		s->bytes[0] = '\0';
 }
@@ -0,0 +1,349 @@
+#include "jsonmodoki.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * テープDOM
+ *
+ * 値を文書順に64ビットの語の列(テープ)に並べる。語の上位8ビットが種
+ * 類で、下位56ビットが種類ごとの値。
+ *
+ *   null, true, false:  0
+ *   number:             0。次の語がdoubleのビット列
+ *   string:             文字列バッファでの位置
+ *   配列やオブジェクト: 対応する終端の次の語の添字
+ *   その終端:           開始の語の添字
+ *
+ * オブジェクトの要素は、名前のstringの語と値が続く。開始の語が終端の位
+ * 置を持つので、値を読み飛ばすのはO(1)。文字列バッファには、エスケー
+ * プを解除した文字列を長さ(size_t)、バイト列、nul文字の順に置く。
+ *
+ * 木と違ってノードごとの確保がなく、テープと文字列バッファの2つだけ
+ * なので、先頭から順に読めて複製や解放も安い。
+ */
+
+enum tape_tag {
+	TAPE_NULL = 'n',
+	TAPE_TRUE = 't',
+	TAPE_FALSE = 'f',
+	TAPE_NUMBER = 'd',
+	TAPE_STRING = '"',
+	TAPE_BEGIN_ARRAY = '[',
+	TAPE_END_ARRAY = ']',
+	TAPE_BEGIN_OBJECT = '{',
+	TAPE_END_OBJECT = '}'
+};
+
+#define TAPE_PAYLOAD_MASK ((UINT64_C(1) << 56) - 1)
+#define tape_word(tag, payload) ((uint64_t)(tag) << 56 | (payload))
+#define tape_tag_of(word) ((enum tape_tag)((word) >> 56))
+#define tape_payload_of(word) ((word) & TAPE_PAYLOAD_MASK)
+
+jm_tape_t
+jm_tape_new(void)
+{
+	return (jm_tape_t){.words = NULL,
+	    .len = 0,
+	    .capacity = 0,
+	    .strings = (string_t){.bytes = NULL, .len = 0, .capacity = 0},
+	    .error = (error_t){.kind = ERROR_GENERAL, .ordinal = 0}};
+}
+
+void
+jm_tape_free(jm_tape_t *t)
+{
+	free(t->words);
+	free(t->strings.bytes);
+	t->words = NULL;
+	t->len = t->capacity = 0;
+	t->strings = (string_t){.bytes = NULL, .len = 0, .capacity = 0};
+}
+
+/*
+ * テープは位置を使わないので、そのまま複写すればよい。
+ */
+jm_tape_t
+jm_tape_copy(const jm_tape_t *t)
+{
+	jm_tape_t copy = jm_tape_new();
+
+	copy.words = xmalloc(sizeof(uint64_t) * (t->len + 1));
+	memcpy(copy.words, t->words, sizeof(uint64_t) * t->len);
+	copy.len = t->len;
+	copy.capacity = t->len + 1;
+	string_append_n(&copy.strings, t->strings.bytes, t->strings.len);
+	copy.error = t->error;
+	return copy;
+}
+
+/*
+ * return: 追加した語の添字
+ */
+size_t
+tape_add(jm_tape_t *t, uint64_t word)
+{
+	if (t->len == t->capacity) {
+		t->capacity = t->capacity == 0 ? 64 : t->capacity * 2;
+		t->words = xrealloc(t->words, sizeof(uint64_t) * t->capacity);
+	}
+
+	t->words[t->len] = word;
+	return t->len++;
+}
+
+/*
+ * return: 文字列バッファでの位置
+ */
+size_t
+tape_add_string(jm_tape_t *t, const string_t *s)
+{
+	size_t offset = t->strings.len;
+
+	string_append_n(&t->strings, (const char *)&s->len, sizeof(size_t));
+	string_append_n(&t->strings, s->bytes, s->len);
+	string_add_char(&t->strings, '\0');
+	return offset;
+}
+
+/*
+ * inの文書を1つ読んでテープにする。テープと文字列バッファは使い回す。
+ * 値の後ろに別の値があればエラー。
+ *
+ * return: 成功なら0。エラーなら-1で、t->errorにエラーが設定される。
+ */
+int
+jm_tape_parse(jm_tape_t *t, file_t in)
+{
+	jm_reader_t r = jm_reader_new(lexer_new(in));
+	size_t *open = NULL; /* 開いている配列やオブジェクトの添字 */
+	size_t open_len = 0, open_capacity = 0;
+	jm_event_t ev;
+	int ret = -1;
+
+	t->len = 0;
+	string_clear(&t->strings);
+
+	for (;;) {
+		uint64_t bits;
+		size_t begin;
+
+		if (jm_reader_next(&r, &ev) == -1) {
+			t->error = r.error;
+			goto finish;
+		}
+
+		switch (ev.tag) {
+		case JM_EVENT_TAG_NULL:
+			tape_add(t, tape_word(TAPE_NULL, 0));
+			break;
+		case JM_EVENT_TAG_BOOL:
+			tape_add(t,
+			    tape_word(ev.boolean ? TAPE_TRUE : TAPE_FALSE, 0));
+			break;
+		case JM_EVENT_TAG_NUMBER:
+			memcpy(&bits, &ev.number, sizeof(bits));
+			tape_add(t, tape_word(TAPE_NUMBER, 0));
+			tape_add(t, bits);
+			break;
+		case JM_EVENT_TAG_STRING:
+		case JM_EVENT_TAG_NAME:
+			tape_add(t,
+			    tape_word(TAPE_STRING,
+			        tape_add_string(t, &ev.string)));
+			break;
+		case JM_EVENT_TAG_BEGIN_ARRAY:
+		case JM_EVENT_TAG_BEGIN_OBJECT:
+			if (open_len == open_capacity) {
+				open_capacity = open_capacity == 0
+				    ? 16
+				    : open_capacity * 2;
+				open = xrealloc(
+				    open, sizeof(size_t) * open_capacity);
+			}
+			open[open_len++] = tape_add(t,
+			    tape_word(ev.tag == JM_EVENT_TAG_BEGIN_ARRAY
+			            ? TAPE_BEGIN_ARRAY
+			            : TAPE_BEGIN_OBJECT,
+			        0));
+			break;
+		case JM_EVENT_TAG_END_ARRAY:
+		case JM_EVENT_TAG_END_OBJECT:
+			begin = open[--open_len];
+			tape_add(t,
+			    tape_word(ev.tag == JM_EVENT_TAG_END_ARRAY
+			            ? TAPE_END_ARRAY
+			            : TAPE_END_OBJECT,
+			        begin));
+			t->words[begin] |= t->len;
+			break;
+		case JM_EVENT_TAG_EOF:
+			t->error = (error_t){
+			    .kind = SUCCESS, .ordinal = ev.ordinal};
+			ret = 0;
+			goto finish;
+		}
+	}
+
+finish:
+	free(open);
+	jm_reader_free(&r);
+	return ret;
+}
+
+jm_tape_value_t
+jm_tape_root(const jm_tape_t *t)
+{
+	BUG(t->error.kind != SUCCESS || t->len == 0);
+	return (jm_tape_value_t){.tape = t, .index = 0};
+}
+
+/*
+ * return: 値の次の語の添字
+ */
+size_t
+tape_skip(const jm_tape_t *t, size_t index)
+{
+	uint64_t word = t->words[index];
+
+	switch (tape_tag_of(word)) {
+	case TAPE_NUMBER:
+		return index + 2;
+	case TAPE_BEGIN_ARRAY:
+	case TAPE_BEGIN_OBJECT:
+		return tape_payload_of(word);
+	default:
+		return index + 1;
+	}
+}
+
+enum node_tag
+jm_tape_tag(jm_tape_value_t v)
+{
+	switch (tape_tag_of(v.tape->words[v.index])) {
+	case TAPE_NULL:
+		return NODE_TAG_NULL;
+	case TAPE_TRUE:
+	case TAPE_FALSE:
+		return NODE_TAG_BOOL;
+	case TAPE_NUMBER:
+		return NODE_TAG_NUMBER;
+	case TAPE_STRING:
+		return NODE_TAG_STRING;
+	case TAPE_BEGIN_ARRAY:
+		return NODE_TAG_ARRAY;
+	case TAPE_BEGIN_OBJECT:
+		return NODE_TAG_OBJECT;
+	default:
+		BUG(1);
+	}
+}
+
+int
+jm_tape_bool(jm_tape_value_t v)
+{
+	BUG(jm_tape_tag(v) != NODE_TAG_BOOL);
+	return tape_tag_of(v.tape->words[v.index]) == TAPE_TRUE;
+}
+
+double
+jm_tape_number(jm_tape_value_t v)
+{
+	double num;
+
+	BUG(jm_tape_tag(v) != NODE_TAG_NUMBER);
+	memcpy(&num, &v.tape->words[v.index + 1], sizeof(num));
+	return num;
+}
+
+/*
+ * return: nul文字終端した文字列。途中にnul文字を含むことがあるので、長
+ *         さは*lenで返す。次にテープを書き換えるまで有効。
+ */
+const char *
+jm_tape_string(jm_tape_value_t v, size_t *len)
+{
+	const char *p;
+
+	BUG(jm_tape_tag(v) != NODE_TAG_STRING);
+	p = v.tape->strings.bytes + tape_payload_of(v.tape->words[v.index]);
+	memcpy(len, p, sizeof(size_t));
+	return p + sizeof(size_t);
+}
+
+jm_tape_iter_t
+jm_tape_iter(jm_tape_value_t container)
+{
+	enum node_tag tag = jm_tape_tag(container);
+
+	BUG(tag != NODE_TAG_ARRAY && tag != NODE_TAG_OBJECT);
+	return (jm_tape_iter_t){.tape = container.tape,
+	    .index = container.index + 1,
+	    .end = tape_skip(container.tape, container.index) - 1,
+	    .is_object = tag == NODE_TAG_OBJECT};
+}
+
+/*
+ * 次の要素を返す。オブジェクトなら*nameに名前を返す。配列ならnameは
+ * 使わないのでNULLでよい。
+ *
+ * return: 要素があれば0。なければ-1。
+ */
+int
+jm_tape_iter_next(
+    jm_tape_iter_t *it, jm_tape_value_t *name, jm_tape_value_t *value)
+{
+	if (it->index == it->end)
+		return -1;
+
+	if (it->is_object) {
+		*name = (jm_tape_value_t){
+		    .tape = it->tape, .index = it->index};
+		it->index++;
+	}
+	*value = (jm_tape_value_t){.tape = it->tape, .index = it->index};
+	it->index = tape_skip(it->tape, it->index);
+	return 0;
+}
+
+/*
+ * return: index番目の要素があれば0。なければ-1。
+ */
+int
+jm_tape_array_get(jm_tape_value_t array, size_t index, jm_tape_value_t *out)
+{
+	jm_tape_iter_t it;
+
+	BUG(jm_tape_tag(array) != NODE_TAG_ARRAY);
+
+	it = jm_tape_iter(array);
+	while (jm_tape_iter_next(&it, NULL, out) == 0)
+		if (index-- == 0)
+			return 0;
+	return -1;
+}
+
+/*
+ * return: 名前がnameである最初の要素があれば0。なければ-1。
+ */
+int
+jm_tape_object_get(
+    jm_tape_value_t object, const char *name, jm_tape_value_t *out)
+{
+	size_t name_len = strlen(name);
+	jm_tape_value_t n;
+	jm_tape_iter_t it;
+
+	BUG(jm_tape_tag(object) != NODE_TAG_OBJECT);
+
+	it = jm_tape_iter(object);
+	while (jm_tape_iter_next(&it, &n, out) == 0) {
+		size_t len;
+		const char *s = jm_tape_string(n, &len);
+		if (len == name_len && memcmp(s, name, len) == 0)
+			return 0;
+	}
+	return -1;
+}
@@ -1,7 +1,14 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "jsonmodoki.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 /*
  * 目的は2つ
@@ -802,6 +809,2542 @@ test_parse_object(void)
 	}
 }
 
+static node_t *
+array_elem(node_t *array, size_t index)
+{
+	node_t *node = NULL;
+
+	test_expected(node_array_get(array, index, &node, NULL) != 1);
+	return node;
+}
+
+static void
+test_parse_next(void)
+{
+	char *text = "{\"a\": 1}\n"
+	             "[true, \"x\"]\n"
+	             "  2 \"s\"\n"
+	             "{\"a\": [1}\n"
+	             "{\"a\" 3}\n"
+	             "nul\n"
+	             "\"open\n"
+	             "{\"b\": {}}\n";
+
+	/* stop at the first malformed record */
+	{
+		parser_t parser = parser_new_with_string(text);
+		node_t *node;
+
+		test_expected(parser_parse_next(&parser) == 0);
+		node = node_object_get(parser.noderoot, "a");
+		test_expected(node != NULL && node->num == 1);
+
+		test_expected(parser_parse_next(&parser) == 0);
+		test_expected(parser.noderoot->tag == NODE_TAG_ARRAY);
+		node = array_elem(parser.noderoot, 1);
+		test_expected(strcmp(node->str.bytes, "x") == 0);
+
+		test_expected(parser_parse_next(&parser) == 0);
+		test_expected(parser.noderoot->num == 2);
+		test_expected(parser_parse_next(&parser) == 0);
+		test_expected(strcmp(parser.noderoot->str.bytes, "s") == 0);
+
+		test_expected(parser_parse_next(&parser) == -1);
+		test_expected(parser.error.kind == ERROR_GENERAL);
+		test_expected(parser.error.ordinal == 38);
+	}
+
+	/* skip malformed records */
+	{
+		parser_t parser = parser_new_with_string(text);
+		size_t n = 0;
+		int ret;
+
+		parser.skip_malformed = 1;
+		while ((ret = parser_parse_next(&parser)) == 0)
+			n++;
+		test_expected(ret == 1);
+		test_expected(parser.error.kind == SUCCESS);
+		test_expected(n == 5);
+		test_expected(parser.noderoot == NULL);
+	}
+
+	/* empty input */
+	{
+		parser_t parser = parser_new_with_string(" \n");
+		test_expected(parser_parse_next(&parser) == 1);
+	}
+}
+
+static void
+test_parser_reset(void)
+{
+	char *docs[] = {"[1, 2, {\"a\": \"x\"}]", "{\"b\": [true]}", "[1,",
+	    "\"s\"", "[1, 2, {\"a\": \"y\"}]"};
+	parser_t parser = parser_new_with_buffer(NULL, 0);
+	node_t *roots[array_len(docs)];
+	token_t *first = NULL;
+
+	for (size_t i = 0; i < array_len(docs); i++) {
+		parser_reset(&parser, file_new_with_string(docs[i]));
+		parser_parse(&parser);
+		roots[i] =
+		    parser.error.kind == SUCCESS ? parser.noderoot : NULL;
+
+		/* tokens are recycled */
+		if (i == 0)
+			first = parser.lexer.tokenhead;
+		else
+			test_expected(parser.lexer.tokenhead == first);
+	}
+
+	node_t *node = array_elem(roots[0], 2);
+	test_expected(strcmp(node_object_get(node, "a")->str.bytes, "x") == 0);
+	node = node_object_get(roots[1], "b");
+	test_expected(array_elem(node, 0)->boolean);
+	test_expected(roots[2] == NULL);
+	test_expected(strcmp(roots[3]->str.bytes, "s") == 0);
+	node = array_elem(roots[4], 2);
+	test_expected(strcmp(node_object_get(node, "a")->str.bytes, "y") == 0);
+
+	parser_free(&parser);
+}
+
+static void
+test_reader(void)
+{
+	/* events */
+	{
+		char *text =
+		    "{\"a\": [1, true, null], \"b\": \"x\", \"c\": {}}";
+		jm_reader_t reader = jm_reader_new_with_string(text);
+		enum jm_event_tag expected[] = {JM_EVENT_TAG_BEGIN_OBJECT,
+		    JM_EVENT_TAG_NAME, JM_EVENT_TAG_BEGIN_ARRAY,
+		    JM_EVENT_TAG_NUMBER, JM_EVENT_TAG_BOOL, JM_EVENT_TAG_NULL,
+		    JM_EVENT_TAG_END_ARRAY, JM_EVENT_TAG_NAME,
+		    JM_EVENT_TAG_STRING, JM_EVENT_TAG_NAME,
+		    JM_EVENT_TAG_BEGIN_OBJECT, JM_EVENT_TAG_END_OBJECT,
+		    JM_EVENT_TAG_END_OBJECT, JM_EVENT_TAG_EOF};
+		size_t depth[] = {0, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 0, 0};
+		jm_event_t ev;
+
+		for (size_t i = 0; i < array_len(expected); i++) {
+			test_expected(jm_reader_next(&reader, &ev) == 0);
+			test_expected(ev.tag == expected[i]);
+			test_expected(ev.depth == depth[i]);
+		}
+		jm_reader_free(&reader);
+	}
+
+	/* typed getters */
+	{
+		char *text = "{\"n\": 2.5, \"s\": \"hi\"}";
+		jm_reader_t reader = jm_reader_new_with_string(text);
+		const char *str;
+		double num;
+		int boolean;
+
+		test_expected(jm_reader_next(&reader, NULL) == 0);
+		test_expected(jm_reader_next(&reader, NULL) == 0);
+		test_expected(jm_reader_get_string(&reader, &str, NULL) == 0);
+		test_expected(strcmp(str, "n") == 0);
+		test_expected(jm_reader_next(&reader, NULL) == 0);
+		test_expected(jm_reader_get_number(&reader, &num) == 0);
+		test_expected(num == 2.5);
+		test_expected(jm_reader_get_bool(&reader, &boolean) == -1);
+		test_expected(jm_reader_next(&reader, NULL) == 0);
+		test_expected(jm_reader_next(&reader, NULL) == 0);
+		test_expected(jm_reader_get_string(&reader, &str, NULL) == 0);
+		test_expected(strcmp(str, "hi") == 0);
+		jm_reader_free(&reader);
+	}
+
+	/* skip */
+	{
+		char *text = "{\"a\": {\"x\": [1, [2]]}, \"b\": 3}";
+		jm_reader_t reader = jm_reader_new_with_string(text);
+		jm_event_t ev;
+		double num;
+
+		test_expected(jm_reader_next(&reader, &ev) == 0);
+		test_expected(jm_reader_next(&reader, &ev) == 0);
+		test_expected(ev.tag == JM_EVENT_TAG_NAME);
+		test_expected(jm_reader_skip(&reader) == 0);
+		test_expected(jm_reader_next(&reader, &ev) == 0);
+		test_expected(ev.tag == JM_EVENT_TAG_NAME);
+		test_expected(strcmp(ev.string.bytes, "b") == 0);
+		test_expected(jm_reader_next(&reader, &ev) == 0);
+		test_expected(jm_reader_get_number(&reader, &num) == 0);
+		test_expected(num == 3);
+		test_expected(jm_reader_next(&reader, &ev) == 0);
+		test_expected(ev.tag == JM_EVENT_TAG_END_OBJECT);
+		test_expected(jm_reader_next(&reader, &ev) == 0);
+		test_expected(ev.tag == JM_EVENT_TAG_EOF);
+		jm_reader_free(&reader);
+	}
+
+	/* skip (strings containing brackets, quotes and escapes) */
+	{
+		char *text =
+		    "{\"skip\": {\"a\": \"]]}}\\\"[[{{ and a long tail\", "
+		    "\"b\": [\"\\\\\", {\"c\": \"\\\\\\\"}\"}]}, "
+		    "\"scalar\": \"long string to skip over\", "
+		    "\"num\": -1.5e3, \"keep\": true}";
+		jm_reader_t reader = jm_reader_new_with_string(text);
+		jm_event_t ev;
+
+		test_expected(jm_reader_next(&reader, &ev) == 0);
+		test_expected(jm_reader_next(&reader, &ev) == 0);
+		test_expected(strcmp(ev.string.bytes, "skip") == 0);
+		test_expected(jm_reader_next(&reader, &ev) == 0);
+		test_expected(ev.tag == JM_EVENT_TAG_BEGIN_OBJECT);
+		test_expected(jm_reader_skip(&reader) == 0);
+		test_expected(reader.event.tag == JM_EVENT_TAG_END_OBJECT);
+		test_expected(jm_reader_next(&reader, &ev) == 0);
+		test_expected(strcmp(ev.string.bytes, "scalar") == 0);
+		test_expected(jm_reader_skip(&reader) == 0);
+		test_expected(jm_reader_next(&reader, &ev) == 0);
+		test_expected(strcmp(ev.string.bytes, "num") == 0);
+		test_expected(jm_reader_skip(&reader) == 0);
+		test_expected(jm_reader_next(&reader, &ev) == 0);
+		test_expected(strcmp(ev.string.bytes, "keep") == 0);
+		test_expected(jm_reader_next(&reader, &ev) == 0);
+		test_expected(ev.tag == JM_EVENT_TAG_BOOL);
+		test_expected(jm_reader_next(&reader, &ev) == 0);
+		test_expected(ev.tag == JM_EVENT_TAG_END_OBJECT);
+		test_expected(jm_reader_next(&reader, &ev) == 0);
+		test_expected(ev.tag == JM_EVENT_TAG_EOF);
+		jm_reader_free(&reader);
+	}
+
+	/* skip (unterminated) */
+	{
+		char *text = "[[1, 2]";
+		jm_reader_t reader = jm_reader_new_with_string(text);
+
+		test_expected(jm_reader_next(&reader, NULL) == 0);
+		test_expected(jm_reader_skip(&reader) == -1);
+		jm_reader_free(&reader);
+	}
+
+	/* error */
+	{
+		char *text = "[1 2]";
+		jm_reader_t reader = jm_reader_new_with_string(text);
+
+		test_expected(jm_reader_next(&reader, NULL) == 0);
+		test_expected(jm_reader_next(&reader, NULL) == 0);
+		test_expected(jm_reader_next(&reader, NULL) == -1);
+		test_expected(reader.error.kind == ERROR_GENERAL);
+		jm_reader_free(&reader);
+	}
+}
+
+static void
+test_parse_projected(void)
+{
+	/* members and elements on the paths */
+	{
+		char *text =
+		    "{\"meta\": {\"id\": 7, \"tags\": [\"a\", \"b\"]}, "
+		    "\"data\": [{\"x\": 1}, {\"x\": 2, \"y\": [3]}], "
+		    "\"a/b\": null, \"skipped\": {\"deep\": [[[]]]}}";
+		const char *paths[] = {"/meta/id", "/data/1/y", "/a~1b"};
+		parser_t parser = parser_new_with_string(text);
+		parser_parse_projected(&parser, paths, array_len(paths));
+		debug_node_dump(parser.noderoot, text);
+		node_t *node = parser.noderoot;
+
+		test_expected(parser.error.kind == SUCCESS);
+		test_expected(node != NULL);
+		test_expected(node->tag == NODE_TAG_OBJECT);
+
+		/* JSON["meta"] has only "id" */
+		node = parser.noderoot->head;
+		test_expected(strcmp(node->name.bytes, "meta") == 0);
+		test_expected(node->val->head != NULL);
+		test_expected(strcmp(node->val->head->name.bytes, "id") == 0);
+		test_expected(node->val->head->val->num == 7);
+		test_expected(node->val->head->next == NULL);
+
+		/* JSON["data"] has only [1], which has only "y" */
+		node = parser.noderoot->head->next;
+		test_expected(strcmp(node->name.bytes, "data") == 0);
+		node = node->val->head;
+		test_expected(node != NULL);
+		test_expected(node->index == 1);
+		test_expected(node->next == NULL);
+		test_expected(strcmp(node->val->head->name.bytes, "y") == 0);
+		test_expected(node->val->head->val->tag == NODE_TAG_ARRAY);
+		test_expected(node->val->head->next == NULL);
+
+		/* JSON["a/b"] */
+		node = parser.noderoot->head->next->next;
+		test_expected(strcmp(node->name.bytes, "a/b") == 0);
+		test_expected(node->val->tag == NODE_TAG_NULL);
+		test_expected(node->next == NULL);
+	}
+
+	/* the whole document */
+	{
+		char *text = "[1, {\"a\": 2}]";
+		const char *paths[] = {""};
+		parser_t parser = parser_new_with_string(text);
+		parser_parse_projected(&parser, paths, array_len(paths));
+		debug_node_dump(parser.noderoot, text);
+
+		test_expected(parser.error.kind == SUCCESS);
+		test_expected(parser.noderoot->head->val->num == 1);
+		test_expected(
+		    parser.noderoot->head->next->val->head->val->num == 2);
+	}
+
+	/* trailing garbage */
+	{
+		char *text = "{\"a\": 1} 2";
+		const char *paths[] = {"/a"};
+		parser_t parser = parser_new_with_string(text);
+		parser_parse_projected(&parser, paths, array_len(paths));
+		test_expected(parser.error.kind != SUCCESS);
+	}
+
+	/* errors inside projected containers free the partial tree */
+	{
+		char *texts[] = {"{\"b\": [1, 2", "{\"b\": 1, \"c\": }",
+		    "[{\"b\": 1}, [2] 3]"};
+		const char *paths[] = {"/b", "/0/b", "/1/0"};
+
+		for (size_t i = 0; i < array_len(texts); i++) {
+			parser_t parser = parser_new_with_string(texts[i]);
+			parser_parse_projected(
+			    &parser, paths, array_len(paths));
+			test_expected(parser.error.kind != SUCCESS);
+			test_expected(parser.noderoot == NULL);
+			parser_free(&parser);
+		}
+	}
+
+	/* a skipped value must not be empty or start with garbage */
+	{
+		char *texts[] = {"{\"a\":,\"b\":1}", "{\"a\": xyz, \"b\": 1}",
+		    "{\"a\": }"};
+		const char *paths[] = {"/b"};
+
+		for (size_t i = 0; i < array_len(texts); i++) {
+			parser_t parser = parser_new_with_string(texts[i]);
+			jm_reader_t reader =
+			    jm_reader_new_with_string(texts[i]);
+
+			parser_parse_projected(
+			    &parser, paths, array_len(paths));
+			test_expected(parser.error.kind != SUCCESS);
+			test_expected(jm_reader_next(&reader, NULL) == 0);
+			test_expected(jm_reader_next(&reader, NULL) == 0);
+			test_expected(jm_reader_skip(&reader) == -1);
+			jm_reader_free(&reader);
+			parser_free(&parser);
+		}
+	}
+}
+
+static void
+test_node_get(void)
+{
+	{
+		char *text = "{\"a\": [10, 20, 30], \"b\": {\"c\": null}}";
+		parser_t parser = parser_new_with_string(text);
+		parser_parse(&parser);
+		node_t *root = parser.noderoot;
+
+		test_expected(parser.error.kind == SUCCESS);
+		node_t *array = node_object_get(root, "a"), *node = NULL;
+
+		test_expected(node_array_get(array, 2, &node, NULL) == 0);
+		test_expected(node->num == 30);
+		test_expected(node_array_get(array, 3, &node, NULL) == -1);
+		test_expected(node_object_get(node_object_get(root, "b"), "c")
+		                  ->tag == NODE_TAG_NULL);
+		test_expected(node_object_get(root, "x") == NULL);
+		node_free(root);
+		parser_free(&parser);
+	}
+
+	/* freeing deep trees does not recurse */
+	{
+		node_t *root = node_new_array(0);
+
+		for (size_t i = 1; i < 100000; i++) {
+			node_t *inner = node_new_array(0);
+			inner->head = node_new_aelem(0, 0, root);
+			root = inner;
+		}
+		node_free(root);
+	}
+}
+
+static void
+test_pointer(void)
+{
+	{
+		char *text = "{\"a\": {\"b\": [0, 1, 2, {\"c\": true}]}, "
+		             "\"m~n\": 1, \"x/y\": 2, \"\": 3, \"01\": 4}";
+		parser_t parser = parser_new_with_string(text);
+		parser_parse(&parser);
+		node_t *root = parser.noderoot;
+		struct {
+			const char *ptr;
+			node_t *expected;
+		} cases[] = {
+		    {"", root},
+		    {"/a/b/3/c", array_elem(node_object_get(
+		                     node_object_get(root, "a"), "b"), 3)
+		                     ->head->val},
+		    {"/a/b/2", array_elem(node_object_get(
+		                   node_object_get(root, "a"), "b"), 2)},
+		    {"/m~0n", node_object_get(root, "m~n")},
+		    {"/x~1y", node_object_get(root, "x/y")},
+		    {"/", node_object_get(root, "")},
+		    {"/01", node_object_get(root, "01")},
+		    {"/a/b/4", NULL},
+		    {"/a/b/01", NULL},
+		    {"/a/b/-", NULL},
+		    {"/a/z", NULL},
+		    {"/a/b/0/x", NULL},
+		};
+
+		test_expected(parser.error.kind == SUCCESS);
+		for (size_t i = 0; i < array_len(cases); i++) {
+			jm_pointer_t *ptr = jm_pointer_compile(cases[i].ptr);
+			test_expected(ptr != NULL);
+			test_expected(
+			    jm_pointer_eval(ptr, root) == cases[i].expected);
+			jm_pointer_free(ptr);
+		}
+	}
+
+	/* syntax errors */
+	{
+		test_expected(jm_pointer_compile("a") == NULL);
+		test_expected(jm_pointer_compile("/a~2") == NULL);
+		test_expected(jm_pointer_compile("/a~") == NULL);
+	}
+}
+
+typedef struct query_result {
+	double nums[16];
+	size_t len;
+} query_result_t;
+
+static int
+query_collect(node_t *match, void *ctx)
+{
+	query_result_t *res = ctx;
+
+	test_expected(match->tag == NODE_TAG_NUMBER);
+	test_expected(res->len < array_len(res->nums));
+	res->nums[res->len++] = match->num;
+	return 0;
+}
+
+static void
+test_query(void)
+{
+	char *text = "{\"store\": {\"book\": ["
+	             "{\"cat\": \"ref\", \"price\": 8.95, \"n\": 1},"
+	             "{\"cat\": \"fic\", \"price\": 12.99, \"n\": 2},"
+	             "{\"cat\": \"fic\", \"price\": 8.99, \"n\": 3},"
+	             "{\"cat\": \"fic\", \"price\": 22.99, \"n\": 4}],"
+	             "\"bicycle\": {\"price\": 19.95}}, \"odd key\": 5}";
+	parser_t parser = parser_new_with_string(text);
+	parser_parse(&parser);
+	test_expected(parser.error.kind == SUCCESS);
+
+	struct {
+		const char *query;
+		double expected[8];
+		size_t len;
+	} cases[] = {
+	    {"$.store.book[0].n", {1}, 1},
+	    {"$['store']['book'][1]['n']", {2}, 1},
+	    {"$[\"odd key\"]", {5}, 1},
+	    {"$.store.book[-1].n", {4}, 1},
+	    {"$.store.book[*].n", {1, 2, 3, 4}, 4},
+	    {"$.store.book[1:3].n", {2, 3}, 2},
+	    {"$.store.book[:2].n", {1, 2}, 2},
+	    {"$.store.book[::2].n", {1, 3}, 2},
+	    {"$.store.book[-2:].n", {3, 4}, 2},
+	    {"$..price", {8.95, 12.99, 8.99, 22.99, 19.95}, 5},
+	    {"$.store.*.price", {19.95}, 1},
+	    {"$..book[?(@.cat == 'fic')].n", {2, 3, 4}, 3},
+	    {"$..book[?(@.price < 10)].n", {1, 3}, 2},
+	    {"$..book[?(@.cat != \"fic\")].n", {1}, 1},
+	    {"$..[?(@.price >= 19.95)].price", {19.95, 22.99}, 2},
+	    {"$.store.book[9].n", {0}, 0},
+	    {"$.none", {0}, 0},
+	};
+
+	for (size_t i = 0; i < array_len(cases); i++) {
+		jm_query_t *q = jm_query_compile(cases[i].query);
+		query_result_t res = {.len = 0};
+
+		test_expected(q != NULL);
+		test_expected(jm_query_run(q, parser.noderoot, query_collect,
+		                  &res) == cases[i].len);
+		test_expected(res.len == cases[i].len);
+		for (size_t j = 0; j < res.len; j++)
+			test_expected(res.nums[j] == cases[i].expected[j]);
+		jm_query_free(q);
+	}
+
+	/* first match */
+	{
+		jm_query_t *q = jm_query_compile("$..n");
+		node_t *node = NULL;
+		test_expected(
+		    jm_query_first(q, parser.noderoot, &node, NULL) == 0);
+		test_expected(node->num == 1);
+		jm_query_free(q);
+	}
+
+	/* sparse arrays match the element index, as pointers do */
+	{
+		char *sparse = "{\"a\": [10, 11, 12, 13]}";
+		const char *paths[] = {"/a/1", "/a/3"};
+		parser_t p = parser_new_with_string(sparse);
+		parser_parse_projected(&p, paths, array_len(paths));
+		test_expected(p.error.kind == SUCCESS);
+
+		struct {
+			const char *query;
+			double expected[2];
+			size_t len;
+		} sp[] = {
+		    {"$.a[1]", {11}, 1},
+		    {"$.a[3]", {13}, 1},
+		    {"$.a[0]", {0}, 0},
+		    {"$.a[-1]", {13}, 1},
+		    {"$.a[-3]", {11}, 1},
+		    {"$.a[2:]", {13}, 1},
+		    {"$.a[*]", {11, 13}, 2},
+		};
+		for (size_t i = 0; i < array_len(sp); i++) {
+			jm_query_t *q = jm_query_compile(sp[i].query);
+			query_result_t res = {.len = 0};
+
+			test_expected(jm_query_run(q, p.noderoot,
+			                  query_collect, &res) == sp[i].len);
+			double *expected = sp[i].expected;
+			for (size_t j = 0; j < res.len; j++)
+				test_expected(res.nums[j] == expected[j]);
+			jm_query_free(q);
+		}
+
+		jm_pointer_t *ptr = jm_pointer_compile("/a/3");
+		node_t *node = jm_pointer_eval(ptr, p.noderoot);
+		test_expected(node != NULL && node->num == 13);
+		jm_pointer_free(ptr);
+		parser_free(&p);
+	}
+
+	/* syntax errors */
+	{
+		const char *invalid[] = {"store", "$.", "$[", "$[1",
+		    "$[?(@.a)]", "$[::0]", "$['a]", "$.a b"};
+		for (size_t i = 0; i < array_len(invalid); i++)
+			test_expected(jm_query_compile(invalid[i]) == NULL);
+	}
+}
+
+static void
+test_lazy(void)
+{
+	/* access */
+	{
+		char *text =
+		    "{\"skip\": [1, [2, {\"x\": \"]\"}]], \"a\\u0062\": 1,\n"
+		    "  \"list\": [true, \"s\", {\"k\": -2.5}], \"e\": {}}";
+		jm_lazy_t doc = jm_lazy_new_with_string(text);
+		jm_lazy_value_t root, v, w;
+		node_t *node;
+
+		jm_lazy_parse(&doc);
+		test_expected(doc.error.kind == SUCCESS);
+
+		root = jm_lazy_root(&doc);
+		test_expected(jm_lazy_tag(root) == NODE_TAG_OBJECT);
+
+		test_expected(jm_lazy_object_get(root, "ab", &v) == 0);
+		test_expected(jm_lazy_tag(v) == NODE_TAG_NUMBER);
+		node = jm_lazy_node(v);
+		test_expected(node != NULL && node->num == 1);
+
+		test_expected(jm_lazy_object_get(root, "list", &v) == 0);
+		test_expected(jm_lazy_tag(v) == NODE_TAG_ARRAY);
+		test_expected(jm_lazy_array_get(v, 3, &w) == -1);
+		test_expected(jm_lazy_array_get(v, 2, &w) == 0);
+		test_expected(jm_lazy_object_get(w, "k", &w) == 0);
+		node = jm_lazy_node(w);
+		test_expected(node != NULL && node->num == -2.5);
+		test_expected(jm_lazy_node(w) == node);
+
+		test_expected(jm_lazy_array_get(v, 1, &w) == 0);
+		node = jm_lazy_node(w);
+		test_expected(
+		    node != NULL && strcmp(node->str.bytes, "s") == 0);
+
+		test_expected(jm_lazy_object_get(root, "e", &v) == 0);
+		test_expected(jm_lazy_tag(v) == NODE_TAG_OBJECT);
+		test_expected(jm_lazy_object_get(v, "k", &w) == -1);
+		test_expected(jm_lazy_object_get(root, "none", &v) == -1);
+
+		/* the whole document */
+		node = jm_lazy_node(root);
+		test_expected(node != NULL && node->tag == NODE_TAG_OBJECT);
+		jm_lazy_free(&doc);
+	}
+
+	/* structural errors */
+	{
+		char *texts[] = {"[1, 2", "[1 2]", "{\"a\" 1}", "{\"a\": 1,}",
+		    "[1]]", "", "{1: 2}", "{\"a\":,\"b\":1}", "[xyz]"};
+
+		for (size_t i = 0; i < array_len(texts); i++) {
+			jm_lazy_t doc = jm_lazy_new_with_string(texts[i]);
+			jm_lazy_parse(&doc);
+			test_expected(doc.error.kind != SUCCESS);
+			jm_lazy_free(&doc);
+		}
+	}
+
+	/* errors in scalars are detected when materialized */
+	{
+		char *text = "[nul]";
+		jm_lazy_t doc = jm_lazy_new_with_string(text);
+		jm_lazy_value_t v;
+
+		jm_lazy_parse(&doc);
+		test_expected(doc.error.kind == SUCCESS);
+		test_expected(
+		    jm_lazy_array_get(jm_lazy_root(&doc), 0, &v) == 0);
+		test_expected(jm_lazy_node(v) == NULL);
+		test_expected(doc.error.kind == ERROR_GENERAL);
+		test_expected(doc.error.ordinal == 5);
+		jm_lazy_free(&doc);
+	}
+}
+
+typedef struct extract_result {
+	size_t ids[16];
+	double nums[16];
+	size_t len;
+	size_t limit;
+} extract_result_t;
+
+static int
+extract_collect(size_t id, node_t *value, void *ctx)
+{
+	extract_result_t *res = ctx;
+
+	test_expected(res->len < array_len(res->ids));
+	res->ids[res->len] = id;
+	res->nums[res->len] =
+	    value->tag == NODE_TAG_NUMBER ? value->num : -1;
+	res->len++;
+	return res->len == res->limit;
+}
+
+static void
+test_extract(void)
+{
+	jm_extractor_t *x = jm_extractor_new();
+
+	test_expected(jm_extractor_add(x, "/a") == 0);
+	test_expected(jm_extractor_add(x, "/b/1") == 1);
+	test_expected(jm_extractor_add(x, "/a/c") == 2);
+	test_expected(jm_extractor_add(x, "/b/1") == 3);
+	test_expected(jm_extractor_add(x, "a") == -1);
+
+	/* NDJSON */
+	{
+		char *text =
+		    "{\"a\": 1, \"b\": [7, 8, 9], \"z\": {\"a\": 0}}\n"
+		    "{\"z\": [1, {}], \"a\": {\"c\": 2}}\n"
+		    "{\"b\": {\"1\": 5}}\n";
+		jm_reader_t r = jm_reader_new_with_string(text);
+		extract_result_t res = {.len = 0, .limit = 0};
+		size_t docs = 0;
+
+		do {
+			test_expected(jm_extractor_run(
+			                  x, &r, extract_collect, &res) == 0);
+			docs++;
+		} while (jm_reader_next_document(&r) == 0);
+		test_expected(r.error.kind == SUCCESS);
+		test_expected(docs == 3);
+
+		size_t ids[] = {0, 1, 3, 0, 2, 1, 3};
+		double nums[] = {1, 8, 8, -1, 2, 5, 5};
+		test_expected(res.len == array_len(ids));
+		for (size_t i = 0; i < res.len; i++) {
+			test_expected(res.ids[i] == ids[i]);
+			test_expected(res.nums[i] == nums[i]);
+		}
+		jm_reader_free(&r);
+	}
+
+	/* stop */
+	{
+		jm_reader_t r = jm_reader_new_with_string(
+		    "{\"a\": 1, \"b\": [7, 8], \"c\": 3}");
+		extract_result_t res = {.len = 0, .limit = 1};
+
+		test_expected(
+		    jm_extractor_run(x, &r, extract_collect, &res) == 0);
+		test_expected(res.len == 1);
+		test_expected(jm_reader_next_document(&r) == 1);
+		jm_reader_free(&r);
+	}
+
+	/* syntax error */
+	{
+		jm_reader_t r = jm_reader_new_with_string("{\"a\": [1,}");
+		extract_result_t res = {.len = 0, .limit = 0};
+
+		test_expected(
+		    jm_extractor_run(x, &r, extract_collect, &res) == -1);
+		test_expected(r.error.kind == ERROR_GENERAL);
+		jm_reader_free(&r);
+	}
+
+	jm_extractor_free(x);
+}
+
+typedef struct ndjson_result {
+	pthread_mutex_t mutex;
+	double nums[64];
+	size_t len;
+	size_t limit;
+} ndjson_result_t;
+
+static int
+ndjson_collect(node_t *record, void *ctx)
+{
+	ndjson_result_t *res = ctx;
+	node_t *n = node_object_get(record, "n");
+	int ret;
+
+	test_expected(n != NULL);
+	pthread_mutex_lock(&res->mutex);
+	test_expected(res->len < array_len(res->nums));
+	res->nums[res->len++] = n->num;
+	ret = res->len == res->limit;
+	pthread_mutex_unlock(&res->mutex);
+	node_free(record);
+	return ret;
+}
+
+static int
+ndjson_count(node_t *record, void *ctx)
+{
+	ndjson_result_t *res = ctx;
+
+	pthread_mutex_lock(&res->mutex);
+	res->len++;
+	pthread_mutex_unlock(&res->mutex);
+	node_free(record);
+	return 0;
+}
+
+typedef struct ndjson_sequence {
+	size_t next;
+	size_t limit;
+} ndjson_sequence_t;
+
+static int
+ndjson_check_order(node_t *record, void *ctx)
+{
+	ndjson_sequence_t *seq = ctx;
+	node_t *n = node_object_get(record, "n");
+
+	test_expected(n != NULL && n->num == seq->next);
+	seq->next++;
+	node_free(record);
+	return seq->next == seq->limit;
+}
+
+static void
+test_ndjson_parallel(void)
+{
+	string_t text = string_new();
+
+	for (size_t i = 0; i < 50; i++)
+		strprintf(&text, "{\"n\": %zu, \"pad\": [\"%*s\"]}\n", i,
+		    (int)(i % 7), "");
+
+	/* ordered */
+	for (size_t nthreads = 1; nthreads <= 8; nthreads++) {
+		ndjson_result_t res = {.len = 0, .limit = 0};
+		pthread_mutex_init(&res.mutex, NULL);
+
+		test_expected(jm_parse_ndjson_parallel(text.bytes, text.len,
+		                  nthreads, 1, ndjson_collect, &res,
+		                  NULL) == 0);
+		test_expected(res.len == 50);
+		for (size_t i = 0; i < res.len; i++)
+			test_expected(res.nums[i] == i);
+		pthread_mutex_destroy(&res.mutex);
+	}
+
+	/* unordered */
+	{
+		ndjson_result_t res = {.len = 0, .limit = 0};
+		double sum = 0;
+		pthread_mutex_init(&res.mutex, NULL);
+
+		test_expected(jm_parse_ndjson_parallel(text.bytes, text.len, 4,
+		                  0, ndjson_collect, &res, NULL) == 0);
+		test_expected(res.len == 50);
+		for (size_t i = 0; i < res.len; i++)
+			sum += res.nums[i];
+		test_expected(sum == 49 * 50 / 2);
+		pthread_mutex_destroy(&res.mutex);
+	}
+
+	/* stop */
+	{
+		ndjson_result_t res = {.len = 0, .limit = 3};
+		pthread_mutex_init(&res.mutex, NULL);
+
+		test_expected(jm_parse_ndjson_parallel(text.bytes, text.len, 4,
+		                  1, ndjson_collect, &res, NULL) == 0);
+		test_expected(res.len == 3);
+		pthread_mutex_destroy(&res.mutex);
+	}
+
+	/* error */
+	{
+		char *bad = "{\"n\": 0}\n{\"n\": 1}\n{\"n\" 2}\n{\"n\": 3}\n";
+		ndjson_result_t res = {.len = 0, .limit = 0};
+		error_t error = {.kind = SUCCESS, .ordinal = 0};
+		pthread_mutex_init(&res.mutex, NULL);
+
+		test_expected(jm_parse_ndjson_parallel(bad, strlen(bad), 3, 1,
+		                  ndjson_collect, &res, &error) == -1);
+		test_expected(error.kind == ERROR_GENERAL);
+		test_expected(res.len == 2);
+		pthread_mutex_destroy(&res.mutex);
+	}
+
+	/* many chunks go through the bounded window in order */
+	{
+		string_t big = string_new();
+		size_t n = 100000;
+
+		for (size_t i = 0; i < n; i++)
+			strprintf(&big, "{\"n\": %zu, \"pad\": \"%*s\"}\n", i,
+			    (int)(i % 13 == 0 ? 200 : 1), "");
+
+		for (size_t nthreads = 1; nthreads <= 4; nthreads += 3) {
+			ndjson_sequence_t seq = {.next = 0, .limit = 0};
+			test_expected(
+			    jm_parse_ndjson_parallel(big.bytes, big.len,
+			        nthreads, 1, ndjson_check_order, &seq,
+			        NULL) == 0);
+			test_expected(seq.next == n);
+		}
+
+		/* stopping frees the records parsed ahead */
+		ndjson_sequence_t seq = {.next = 0, .limit = 1000};
+		test_expected(jm_parse_ndjson_parallel(big.bytes, big.len, 4,
+		                  1, ndjson_check_order, &seq, NULL) == 0);
+		test_expected(seq.next == 1000);
+
+		/* unordered sees every record once */
+		ndjson_result_t res = {.len = 0, .limit = 0};
+		pthread_mutex_init(&res.mutex, NULL);
+		test_expected(jm_parse_ndjson_parallel(big.bytes, big.len, 4,
+		                  0, ndjson_count, &res, NULL) == 0);
+		test_expected(res.len == n);
+		pthread_mutex_destroy(&res.mutex);
+
+		free(big.bytes);
+	}
+
+	free(text.bytes);
+}
+
+static void
+test_parse_parallel(void)
+{
+	string_t text = string_new();
+
+	string_add_string(&text, " [");
+	for (size_t i = 0; i < 40; i++)
+		strprintf(&text,
+		    "%s{\"n\": %zu, \"s\": \"],[{\\\"\\\\\", "
+		    "\"a\": [%zu, [], {\"x\": null}]}\n",
+		    i == 0 ? "" : ", ", i, i * 2);
+	string_add_string(&text, "] ");
+
+	parser_t serial = parser_new_with_buffer(text.bytes, text.len);
+	parser_parse(&serial);
+	test_expected(serial.error.kind == SUCCESS);
+	char *expected = node_dump_str(serial.noderoot);
+
+	for (size_t nthreads = 1; nthreads <= 9; nthreads++) {
+		parser_t parser = parser_new_with_buffer(text.bytes, text.len);
+		parser_parse_parallel(&parser, nthreads);
+		test_expected(parser.error.kind == SUCCESS);
+		char *actual = node_dump_str(parser.noderoot);
+		test_expected(strcmp(actual, expected) == 0);
+		free(actual);
+	}
+	free(expected);
+	free(text.bytes);
+
+	/* small inputs and fallbacks */
+	{
+		struct {
+			char *text;
+			size_t len;
+		} cases[] = {{"[]", 0}, {" [ ] ", 0}, {"[1]", 1},
+		    {"[1, \"\\\"\", 3]", 3}, {"{\"a\": [1, 2]}", 1}, {"7", 0}};
+
+		for (size_t i = 0; i < array_len(cases); i++) {
+			parser_t parser =
+			    parser_new_with_string(cases[i].text);
+			size_t len = 0;
+
+			parser_parse_parallel(&parser, 4);
+			test_expected(parser.error.kind == SUCCESS);
+			for (node_t *e = parser.noderoot->head; e != NULL;
+			     e = e->next)
+				len++;
+			test_expected(len == cases[i].len);
+		}
+	}
+
+	/* the elements are parsed with the same options */
+	{
+		char *str = " [[1, 2], {\"a\": [3.5]}, \"x\"] ";
+		parser_t parser = parser_new_with_string(str);
+		parser.keep_spans = 1;
+		parser.pack_numbers = 1;
+
+		parser_parse_parallel(&parser, 3);
+		test_expected(parser.error.kind == SUCCESS);
+		node_t *root = parser.noderoot;
+		test_expected(root->src == str + 1 && root->src_len == 27);
+
+		node_t *e = root->head;
+		test_expected(e->val->packing == NODE_PACKED_INT64);
+		test_expected(e->val->src == str + 2 && e->val->src_len == 6);
+		e = e->next;
+		test_expected(e->val->src == str + 10 &&
+		    e->val->src_len == 12);
+		e = node_object_get(e->val, "a");
+		test_expected(e->packing == NODE_PACKED_DOUBLE);
+		node_free(root);
+		parser_free(&parser);
+
+		/* all numbers: the root itself is packed */
+		parser = parser_new_with_string("[1, 2, 3, 4]");
+		parser.pack_numbers = 1;
+		parser_parse_parallel(&parser, 2);
+		test_expected(parser.error.kind == SUCCESS);
+		test_expected(parser.noderoot->packing == NODE_PACKED_INT64);
+		test_expected(parser.noderoot->packed_len == 4);
+		test_expected(parser.noderoot->head == NULL);
+		node_free(parser.noderoot);
+		parser_free(&parser);
+	}
+
+	/* errors */
+	{
+		struct {
+			char *text;
+			size_t ordinal;
+		} cases[] = {{"[1,]", 4}, {"[1, ]", 5}, {"[1 2]", 4},
+		    {"[1, \"a]", 7}, {"[1]]", 4}, {"[[1, 2]", 7}, {"[1] 2", 5},
+		    {"[1, nul]", 8}};
+
+		for (size_t i = 0; i < array_len(cases); i++) {
+			parser_t parser =
+			    parser_new_with_string(cases[i].text);
+
+			parser_parse_parallel(&parser, 3);
+			test_expected(parser.error.kind == ERROR_GENERAL);
+			test_expected(
+			    parser.error.ordinal == cases[i].ordinal);
+			test_expected(parser.noderoot == NULL);
+		}
+	}
+	/* input ending inside a string, right after a backslash or not */
+	{
+		char *texts[] = {
+		    "[\"\\\\\\\\\\\\\\\\\\", "[\"\\\\\\\\\\\\\\\\"};
+
+		for (size_t i = 0; i < array_len(texts); i++) {
+			for (size_t nthreads = 2; nthreads <= 4; nthreads++) {
+				parser_t parser =
+				    parser_new_with_string(texts[i]);
+
+				parser_parse_parallel(&parser, nthreads);
+				test_expected(
+				    parser.error.kind == ERROR_GENERAL);
+				test_expected(parser.error.ordinal ==
+				    strlen(texts[i]));
+				test_expected(parser.noderoot == NULL);
+			}
+		}
+	}
+}
+
+static void
+test_parse_pipelined(void)
+{
+	string_t text = string_new();
+
+	string_add_string(&text, "{\"items\": [");
+	for (size_t i = 0; i < 200; i++)
+		strprintf(&text,
+		    "%s{\"n\": %zu, \"s\": \"v%zu\", \"b\": [true, null]}",
+		    i == 0 ? "" : ", ", i, i);
+	string_add_string(&text, "], \"k\": \"end\"}");
+
+	parser_t serial = parser_new_with_buffer(text.bytes, text.len);
+	parser_parse(&serial);
+	test_expected(serial.error.kind == SUCCESS);
+	char *expected = node_dump_str(serial.noderoot);
+
+	size_t sizes[] = {1, 2, 7, 64, 4096};
+	for (size_t i = 0; i < array_len(sizes); i++) {
+		parser_t parser = parser_new_with_buffer(text.bytes, text.len);
+		parser_parse_pipelined(&parser, sizes[i]);
+		test_expected(parser.error.kind == SUCCESS);
+		char *actual = node_dump_str(parser.noderoot);
+		test_expected(strcmp(actual, expected) == 0);
+		free(actual);
+	}
+	free(expected);
+	free(text.bytes);
+
+	/* errors */
+	{
+		struct {
+			char *text;
+			size_t ordinal;
+		} cases[] = {{"[1, 2] 3", 8}, {"[1, 2", 0}, {"[1, ?]", 5},
+		    {"{\"a\" 1}", 6}, {"{\"a\": \"x\" \"b\": 1}", 11},
+		    {"[\"x\" \"y\"]", 6}, {"[\"x\"] \"y\"", 7}};
+
+		for (size_t i = 0; i < array_len(cases); i++) {
+			parser_t parser =
+			    parser_new_with_string(cases[i].text);
+
+			parser_parse_pipelined(&parser, 2);
+			test_expected(parser.error.kind == ERROR_GENERAL);
+			test_expected(
+			    parser.error.ordinal == cases[i].ordinal);
+			test_expected(parser.noderoot == NULL);
+			parser_free(&parser);
+		}
+	}
+}
+
+static void
+test_parse_batch(void)
+{
+	char *docs[300];
+	size_t lens[array_len(docs)];
+	jm_batch_result_t results[array_len(docs)];
+
+	for (size_t i = 0; i < array_len(docs); i++) {
+		if (i % 50 == 49)
+			xasprintf(&docs[i], "{\"n\": %zu,}", i);
+		else
+			xasprintf(&docs[i], "{\"n\": %zu, \"a\": [\"%zu\"]}",
+			    i, i);
+		lens[i] = strlen(docs[i]);
+	}
+
+	/* the pool is reused across batches */
+	for (size_t round = 0; round < 3; round++) {
+		size_t n = array_len(docs) - round * 100;
+
+		jm_parse_batch(docs, lens, n, results);
+		for (size_t i = 0; i < n; i++) {
+			if (i % 50 == 49) {
+				test_expected(
+				    results[i].error.kind == ERROR_GENERAL);
+				test_expected(results[i].noderoot == NULL);
+				continue;
+			}
+			test_expected(results[i].error.kind == SUCCESS);
+			node_t *node =
+			    node_object_get(results[i].noderoot, "n");
+			test_expected(node != NULL && node->num == i);
+		}
+	}
+
+	jm_parse_batch(docs, lens, 0, results);
+
+	/* the pool can be shut down and started again */
+	jm_parse_batch_shutdown();
+	jm_parse_batch_shutdown();
+	{
+		char *texts[] = {"{\"n\": 0} 1", "{\"n\": 1}"};
+		size_t text_lens[] = {strlen(texts[0]), strlen(texts[1])};
+
+		jm_parse_batch(texts, text_lens, 2, results);
+		test_expected(results[0].error.kind == ERROR_GENERAL);
+		test_expected(results[0].noderoot == NULL);
+		test_expected(results[1].error.kind == SUCCESS);
+		node_free(results[1].noderoot);
+	}
+	jm_parse_batch_shutdown();
+
+	for (size_t i = 0; i < array_len(docs); i++)
+		free(docs[i]);
+}
+
+/*
+ * 並行性のストレステスト
+ */
+
+static char *stress_corpus[] = {
+    "{\"store\": {\"book\": [{\"price\": 8.95, \"t\": \"a\\u00e9\\n\"}, "
+    "{\"price\": 12.99, \"t\": \"\\ud83d\\ude00\"}], \"open\": true}}",
+    "[1, -2.5e3, 0, null, false, \"\", [], {}, [[[\"deep\"]]]]",
+    "\"plain string with \\\"escapes\\\" and \\\\ slashes\"",
+    "{\"a\": {\"b\": {\"c\": {\"d\": [1, 2, 3, {\"price\": 1}]}}}}",
+    "  123.456  ",
+    "{\"price\": 0.5, \"tags\": [\"x\", \"y\", \"z\"], \"n\": -0}",
+};
+
+typedef struct stress_thread {
+	char **expected;
+	size_t *expected_matches;
+	const jm_query_t *query;
+	const jm_extractor_t *extractor;
+	size_t iterations;
+	size_t failures;
+} stress_thread_t;
+
+static int
+stress_count(node_t *match, void *ctx)
+{
+	(void)match;
+	(*(size_t *)ctx)++;
+	return 0;
+}
+
+static int
+stress_count_extract(size_t id, node_t *value, void *ctx)
+{
+	(void)id;
+	(void)value;
+	(*(size_t *)ctx)++;
+	return 0;
+}
+
+static void *
+stress_worker(void *arg)
+{
+	stress_thread_t *t = arg;
+	parser_t parser = parser_new_with_buffer(NULL, 0);
+
+	for (size_t n = 0; n < t->iterations; n++) {
+		for (size_t i = 0; i < array_len(stress_corpus); i++) {
+			parser_reset(
+			    &parser, file_new_with_string(stress_corpus[i]));
+			parser_parse(&parser);
+			if (parser.error.kind != SUCCESS) {
+				t->failures++;
+				continue;
+			}
+
+			char *dump = node_dump_str(parser.noderoot);
+			if (strcmp(dump, t->expected[i]) != 0)
+				t->failures++;
+			free(dump);
+
+			size_t matches = 0;
+			jm_query_run(t->query, parser.noderoot, stress_count,
+			    &matches);
+			if (matches != t->expected_matches[i])
+				t->failures++;
+
+			jm_reader_t r =
+			    jm_reader_new_with_string(stress_corpus[i]);
+			size_t extracted = 0;
+			if (jm_extractor_run(t->extractor, &r,
+			        stress_count_extract, &extracted) == -1 ||
+			    extracted != matches)
+				t->failures++;
+			jm_reader_free(&r);
+		}
+	}
+
+	parser_free(&parser);
+	return NULL;
+}
+
+static double
+stress_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+test_concurrency(void)
+{
+	char *expected[array_len(stress_corpus)];
+	size_t expected_matches[array_len(stress_corpus)];
+	jm_query_t *query = jm_query_compile("$.store.book[*].price");
+	jm_extractor_t *extractor = jm_extractor_new();
+
+	test_expected(query != NULL);
+	jm_extractor_add(extractor, "/store/book/0/price");
+	jm_extractor_add(extractor, "/store/book/1/price");
+
+	for (size_t i = 0; i < array_len(stress_corpus); i++) {
+		parser_t parser = parser_new_with_string(stress_corpus[i]);
+		parser_parse(&parser);
+		test_expected(parser.error.kind == SUCCESS);
+		expected[i] = node_dump_str(parser.noderoot);
+		expected_matches[i] = jm_query_run(
+		    query, parser.noderoot, stress_count, &(size_t){0});
+		parser_free(&parser);
+	}
+
+	for (size_t nthreads = 1; nthreads <= 8; nthreads *= 2) {
+		stress_thread_t threads[8];
+		pthread_t ids[8];
+		size_t iterations = 400 / nthreads;
+		double begin = stress_now();
+
+		for (size_t i = 0; i < nthreads; i++) {
+			threads[i] = (stress_thread_t){.expected = expected,
+			    .expected_matches = expected_matches,
+			    .query = query,
+			    .extractor = extractor,
+			    .iterations = iterations,
+			    .failures = 0};
+			test_expected(pthread_create(&ids[i], NULL,
+			                  stress_worker, &threads[i]) == 0);
+		}
+		for (size_t i = 0; i < nthreads; i++) {
+			pthread_join(ids[i], NULL);
+			test_expected(threads[i].failures == 0);
+		}
+
+		if (debug_dump) {
+			double docs = (double)iterations * nthreads *
+			    array_len(stress_corpus);
+			printf("concurrency: %zu threads: %.0f docs/s\n",
+			    nthreads, docs / (stress_now() - begin));
+		}
+	}
+
+	for (size_t i = 0; i < array_len(stress_corpus); i++)
+		free(expected[i]);
+	jm_query_free(query);
+	jm_extractor_free(extractor);
+}
+
+static void
+test_dtoa(void)
+{
+	struct {
+		double num;
+		char *expected;
+	} tests[] = {{0.0, "0"}, {-0.0, "-0"}, {1.0, "1"}, {-42.0, "-42"},
+	    {0.1, "0.1"}, {-3.25, "-3.25"}, {1.0 / 3, "0.3333333333333333"},
+	    {9007199254740992.0, "9007199254740992"},
+	    {1e20, "100000000000000000000"}, {1e21, "1e21"},
+	    {123456789012345678.0, "123456789012345680"},
+	    {0.000001, "0.000001"}, {1e-7, "1e-7"}, {1.5e-10, "1.5e-10"},
+	    {5e-324, "5e-324"},
+	    {2.2250738585072014e-308, "2.2250738585072014e-308"},
+	    {1.7976931348623157e308, "1.7976931348623157e308"},
+	    {2.7183163742986588e276, "2.718316374298659e276"},
+	    {1e23, "1e23"}, {9007199254740994.0, "9007199254740994"},
+	    {2.2250738585072009e-308, "2.225073858507201e-308"},
+	    {HUGE_VAL, "inf"}, {-HUGE_VAL, "-inf"}};
+	char buf[JM_DTOA_BUFSIZE];
+
+	for (size_t i = 0; i < array_len(tests); i++) {
+		size_t len = jm_dtoa(tests[i].num, buf);
+		test_expected(len == strlen(tests[i].expected));
+		test_expected(strcmp(buf, tests[i].expected) == 0);
+	}
+
+	/* round trip, and one digit fewer does not round trip */
+	{
+		uint64_t x = 88172645463325252ULL;
+
+		for (size_t i = 0; i < 100000; i++) {
+			double num, back;
+			char shorter[32];
+			int digits = 0, zeros = 0;
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			memcpy(&num, &x, sizeof(num));
+			if (!isfinite(num))
+				continue;
+			jm_dtoa(num, buf);
+			back = strtod(buf, NULL);
+			test_expected(memcmp(&num, &back, sizeof(num)) == 0);
+
+			for (char *p = buf; *p != '\0' && *p != 'e'; p++) {
+				if (*p == '0' && digits == 0)
+					continue;
+				if (*p < '0' || *p > '9')
+					continue;
+				zeros = *p == '0' ? zeros + 1 : 0;
+				digits++;
+			}
+			digits -= zeros;
+			if (digits <= 1)
+				continue;
+			snprintf(shorter, sizeof(shorter), "%.*e", digits - 2,
+			    num);
+			test_expected(strtod(shorter, NULL) != num);
+		}
+	}
+}
+
+static void
+test_serialize(void)
+{
+	/* compact */
+	{
+		char *texts[][2] = {{"null", "null"}, {" true ", "true"},
+		    {"[1, -2.5, 1e2, 0.1]",
+		        "[1,-2.5,100,0.1]"},
+		    {"{ \"a\" : [ ] , \"b\" : { } }", "{\"a\":[],\"b\":{}}"},
+		    {"[[[]], {\"k\": [null, false]}]",
+		        "[[[]],{\"k\":[null,false]}]"},
+		    {"\"q\\\"b\\\\s\\/n\\n\\u0001\\u001f\\u3042\"",
+		        "\"q\\\"b\\\\s/n\\n\\u0001\\u001f\xe3\x81\x82\""},
+		    {"\"\\u0000\"", "\"\\u0000\""}};
+
+		for (size_t i = 0; i < array_len(texts); i++) {
+			parser_t parser = parser_new_with_string(texts[i][0]);
+			string_t out = string_new();
+			parser_parse(&parser);
+			test_expected(parser.error.kind == SUCCESS);
+			test_expected(jm_serialize(parser.noderoot, &out,
+			                  JM_SERIALIZE_COMPACT) == 0);
+			test_expected(strcmp(out.bytes, texts[i][1]) == 0);
+
+			/* round trip */
+			parser_t again = parser_new_with_string(out.bytes);
+			string_t out2 = string_new();
+			parser_parse(&again);
+			test_expected(again.error.kind == SUCCESS);
+			jm_serialize(
+			    again.noderoot, &out2, JM_SERIALIZE_COMPACT);
+			test_expected(strcmp(out.bytes, out2.bytes) == 0);
+			free(out.bytes);
+			free(out2.bytes);
+			parser_free(&parser);
+			parser_free(&again);
+		}
+	}
+
+	/* pretty */
+	{
+		parser_t parser = parser_new_with_string(
+		    "{\"a\": [1, {}], \"b\": {\"c\": []}}");
+		string_t out = string_new();
+		parser_parse(&parser);
+		test_expected(jm_serialize(parser.noderoot, &out,
+		                  JM_SERIALIZE_PRETTY) == 0);
+		test_expected(strcmp(out.bytes,
+		                  "{\n"
+		                  "  \"a\": [\n"
+		                  "    1,\n"
+		                  "    {}\n"
+		                  "  ],\n"
+		                  "  \"b\": {\n"
+		                  "    \"c\": []\n"
+		                  "  }\n"
+		                  "}") == 0);
+		free(out.bytes);
+		parser_free(&parser);
+	}
+
+	/* deep nesting does not recurse */
+	{
+		size_t depth = 100000;
+		node_t *root = node_new_array(0);
+		string_t out = string_new();
+
+		for (size_t i = 1; i < depth; i++) {
+			node_t *inner = node_new_array(0);
+			inner->head = node_new_aelem(0, 0, root);
+			root = inner;
+		}
+		test_expected(jm_serialize(root, &out, 0) == 0);
+		test_expected(out.len == depth * 2);
+		test_expected(out.bytes[depth - 1] == '[' &&
+		    out.bytes[depth] == ']');
+		free(out.bytes);
+	}
+
+	/* not representable */
+	{
+		node_t *root = node_new_array(0);
+		string_t out = string_new();
+
+		root->head =
+		    node_new_aelem(0, 0, node_new_with_number(0, HUGE_VAL));
+		test_expected(jm_serialize(root, &out, 0) == -1);
+		free(out.bytes);
+	}
+}
+
+/*
+ * テスト用の文書をwに書く。
+ */
+static int
+writer_write_sample(jm_writer_t *w)
+{
+	int ret = 0;
+
+	ret |= jm_writer_begin_object(w);
+	ret |= jm_writer_key(w, "name");
+	ret |= jm_writer_value_string(w, "a\"b\n");
+	ret |= jm_writer_key(w, "list");
+	ret |= jm_writer_begin_array(w);
+	for (int i = 0; i < 3; i++)
+		ret |= jm_writer_value_number(w, i * 0.5);
+	ret |= jm_writer_begin_array(w);
+	ret |= jm_writer_end_array(w);
+	ret |= jm_writer_begin_object(w);
+	ret |= jm_writer_end_object(w);
+	ret |= jm_writer_end_array(w);
+	ret |= jm_writer_key(w, "flags");
+	ret |= jm_writer_begin_object(w);
+	ret |= jm_writer_key(w, "t");
+	ret |= jm_writer_value_bool(w, 1);
+	ret |= jm_writer_key(w, "n");
+	ret |= jm_writer_value_null(w);
+	ret |= jm_writer_end_object(w);
+	ret |= jm_writer_end_object(w);
+	return ret | jm_writer_finish(w);
+}
+
+static void
+test_writer(void)
+{
+	char *sample = "{\"name\": \"a\\\"b\\n\", "
+	               "\"list\": [0, 0.5, 1, [], {}], "
+	               "\"flags\": {\"t\": true, \"n\": null}}";
+	char *compact = "{\"name\":\"a\\\"b\\n\",\"list\":[0,0.5,1,[],{}],"
+	                "\"flags\":{\"t\":true,\"n\":null}}";
+
+	/* string */
+	{
+		int flags[] = {JM_SERIALIZE_COMPACT, JM_SERIALIZE_PRETTY};
+
+		for (size_t i = 0; i < array_len(flags); i++) {
+			parser_t parser = parser_new_with_string(sample);
+			string_t expected = string_new();
+			string_t out = string_new();
+			jm_writer_t w;
+
+			w = jm_writer_new_with_string(&out, flags[i]);
+			parser_parse(&parser);
+			jm_serialize(parser.noderoot, &expected, flags[i]);
+			test_expected(writer_write_sample(&w) == 0);
+			test_expected(strcmp(out.bytes, expected.bytes) == 0);
+
+			jm_writer_free(&w);
+			free(out.bytes);
+			free(expected.bytes);
+			parser_free(&parser);
+		}
+	}
+
+	/* FILE and fd, flushing many times */
+	for (int use_fd = 0; use_fd <= 1; use_fd++) {
+		FILE *fp = tmpfile();
+		char got[256];
+		size_t len;
+		jm_writer_t w;
+
+		test_expected(fp != NULL);
+		w = use_fd ? jm_writer_new_with_fd(fileno(fp), 0)
+		           : jm_writer_new_with_file(fp, 0);
+		w.flush_threshold = 4;
+		test_expected(writer_write_sample(&w) == 0);
+		test_expected(w.flushed == strlen(compact));
+		jm_writer_free(&w);
+
+		rewind(fp);
+		len = fread(got, 1, sizeof(got) - 1, fp);
+		got[len] = '\0';
+		test_expected(strcmp(got, compact) == 0);
+		fclose(fp);
+	}
+
+	/* misuse */
+	{
+		string_t out = string_new();
+		jm_writer_t w;
+
+		/* value after the root */
+		w = jm_writer_new_with_string(&out, 0);
+		test_expected(jm_writer_value_null(&w) == 0);
+		test_expected(jm_writer_value_null(&w) == -1);
+		test_expected(w.error.kind != SUCCESS && w.error.ordinal == 4);
+		jm_writer_free(&w);
+
+		/* key in an array */
+		w = jm_writer_new_with_string(&out, 0);
+		test_expected(jm_writer_begin_array(&w) == 0);
+		test_expected(jm_writer_key(&w, "k") == -1);
+		/* errors are sticky */
+		test_expected(jm_writer_end_array(&w) == -1);
+		jm_writer_free(&w);
+
+		/* value without a key */
+		w = jm_writer_new_with_string(&out, 0);
+		test_expected(jm_writer_begin_object(&w) == 0);
+		test_expected(jm_writer_value_bool(&w, 0) == -1);
+		jm_writer_free(&w);
+
+		/* mismatched end */
+		w = jm_writer_new_with_string(&out, 0);
+		test_expected(jm_writer_begin_object(&w) == 0);
+		test_expected(jm_writer_end_array(&w) == -1);
+		jm_writer_free(&w);
+
+		/* key without a value */
+		w = jm_writer_new_with_string(&out, 0);
+		test_expected(jm_writer_begin_object(&w) == 0);
+		test_expected(jm_writer_key(&w, "k") == 0);
+		test_expected(jm_writer_end_object(&w) == -1);
+		jm_writer_free(&w);
+
+		/* unclosed */
+		w = jm_writer_new_with_string(&out, 0);
+		test_expected(jm_writer_begin_array(&w) == 0);
+		test_expected(jm_writer_finish(&w) == -1);
+		jm_writer_free(&w);
+
+		/* next document before the root is done */
+		w = jm_writer_new_with_string(&out, 0);
+		test_expected(jm_writer_next_document(&w) == -1);
+		jm_writer_free(&w);
+		w = jm_writer_new_with_string(&out, 0);
+		test_expected(jm_writer_begin_object(&w) == 0);
+		test_expected(jm_writer_next_document(&w) == -1);
+		test_expected(w.error.kind != SUCCESS);
+		test_expected(jm_writer_end_object(&w) == -1);
+		jm_writer_free(&w);
+
+		/* not representable */
+		w = jm_writer_new_with_string(&out, 0);
+		test_expected(jm_writer_value_number(&w, NAN) == -1);
+		jm_writer_free(&w);
+
+		free(out.bytes);
+	}
+}
+
+static void
+test_reformat(void)
+{
+	char *text = " { \"a\" : [ 1.50 , \"x\\u0041\\n\" , true , null ] ,\n"
+	             "\"b\" : { } , \"c\": [] } ";
+	struct {
+		char *in;
+		int flags;
+		char *expected;
+	} tests[] = {
+	    {text, JM_SERIALIZE_COMPACT,
+	        "{\"a\":[1.50,\"x\\u0041\\n\",true,null],\"b\":{},\"c\":[]}"},
+	    {text, JM_SERIALIZE_PRETTY,
+	        "{\n"
+	        "  \"a\": [\n"
+	        "    1.50,\n"
+	        "    \"x\\u0041\\n\",\n"
+	        "    true,\n"
+	        "    null\n"
+	        "  ],\n"
+	        "  \"b\": {},\n"
+	        "  \"c\": []\n"
+	        "}"},
+	    {"-0 1e999", JM_SERIALIZE_COMPACT, "-0\n1e999"},
+	    {"{\"a\":1}\n[2, 3]\n\"s\"\n", JM_SERIALIZE_COMPACT,
+	        "{\"a\":1}\n[2,3]\n\"s\""},
+	};
+
+	for (size_t i = 0; i < array_len(tests); i++) {
+		file_t in = file_new_with_string(tests[i].in);
+		string_t out = string_new();
+		jm_writer_t w;
+		error_t error;
+
+		w = jm_writer_new_with_string(&out, tests[i].flags);
+		test_expected(jm_reformat(in, &w, &error) == 0);
+		test_expected(error.kind == SUCCESS);
+		test_expected(strcmp(out.bytes, tests[i].expected) == 0);
+		jm_writer_free(&w);
+		free(out.bytes);
+	}
+
+	/* errors */
+	{
+		struct {
+			char *in;
+			size_t ordinal;
+		} errors[] = {{"", 1}, {"[1, }", 5}, {"[1 2]", 4},
+		    {"{\"a\" 1}", 6}, {"[\"\\x\"]", 4}, {"[1.]", 4},
+		    {"1 ]", 3}};
+
+		for (size_t i = 0; i < array_len(errors); i++) {
+			string_t out = string_new();
+			jm_writer_t w = jm_writer_new_with_string(&out, 0);
+			error_t error;
+
+			file_t in = file_new_with_string(errors[i].in);
+			test_expected(jm_reformat(in, &w, &error) == -1);
+			test_expected(error.kind != SUCCESS);
+			test_expected(error.ordinal == errors[i].ordinal);
+			jm_writer_free(&w);
+			free(out.bytes);
+		}
+	}
+
+	/* FILE to fd */
+	{
+		FILE *in = tmpfile();
+		FILE *out = tmpfile();
+		char got[64];
+		size_t len;
+		jm_writer_t w;
+		error_t error;
+
+		test_expected(in != NULL && out != NULL);
+		fputs("[ {\"k\" : \"\\ud83d\\ude00\"} ,\n 2 ]", in);
+		rewind(in);
+		w = jm_writer_new_with_fd(fileno(out), 0);
+		test_expected(
+		    jm_reformat(file_new_with_file(in), &w, &error) == 0);
+		jm_writer_free(&w);
+
+		rewind(out);
+		len = fread(got, 1, sizeof(got) - 1, out);
+		got[len] = '\0';
+		test_expected(
+		    strcmp(got, "[{\"k\":\"\\ud83d\\ude00\"},2]") == 0);
+		fclose(in);
+		fclose(out);
+	}
+}
+
+static void
+test_passthrough(void)
+{
+	char *text = " {\"keep\": [1,  2.50], \"edit\": {\"x\": 1},\n"
+	             "  \"n\": 3} ";
+
+	/* untouched */
+	{
+		parser_t parser = parser_new_with_string(text);
+		string_t out = string_new();
+		node_t *keep;
+
+		parser.keep_spans = 1;
+		parser_parse(&parser);
+		test_expected(parser.error.kind == SUCCESS);
+		test_expected(parser.noderoot->src == text + 1);
+		keep = node_object_get(parser.noderoot, "keep");
+		test_expected(keep->src_len == strlen("[1,  2.50]") &&
+		    memcmp(keep->src, "[1,  2.50]", keep->src_len) == 0);
+
+		jm_serialize(parser.noderoot, &out, JM_SERIALIZE_PASSTHROUGH);
+		test_expected(strlen(out.bytes) == strlen(text) - 2 &&
+		    memcmp(out.bytes, text + 1, out.len) == 0);
+		parser_free(&parser);
+		free(out.bytes);
+	}
+
+	/* one field rewritten */
+	{
+		parser_t parser = parser_new_with_string(text);
+		jm_pointer_t *ptr = jm_pointer_compile("/edit/x");
+		string_t out = string_new();
+		node_t *x;
+
+		parser.keep_spans = 1;
+		parser_parse(&parser);
+		x = jm_pointer_eval_for_update(ptr, parser.noderoot);
+		test_expected(x != NULL);
+		x->num = 5;
+
+		jm_serialize(parser.noderoot, &out, JM_SERIALIZE_PASSTHROUGH);
+		test_expected(strcmp(out.bytes,
+		                  "{\"keep\":[1,  2.50],\"edit\":{\"x\":5},"
+		                  "\"n\":3}") == 0);
+
+		/* without the flag the spans are ignored */
+		string_clear(&out);
+		jm_serialize(parser.noderoot, &out, JM_SERIALIZE_COMPACT);
+		test_expected(strcmp(out.bytes,
+		                  "{\"keep\":[1,2.5],\"edit\":{\"x\":5},"
+		                  "\"n\":3}") == 0);
+		jm_pointer_free(ptr);
+		parser_free(&parser);
+		free(out.bytes);
+	}
+
+	/* not recorded unless asked */
+	{
+		parser_t parser = parser_new_with_string(text);
+
+		parser_parse(&parser);
+		test_expected(parser.noderoot->src == NULL);
+		parser_free(&parser);
+	}
+
+	/* records after the first and a buffer starting mid-input */
+	{
+		char *ndjson = "[1]\n  {\"a\": [ ]}\n";
+		parser_t parser = parser_new_with_string(ndjson);
+		node_t *a;
+
+		parser.keep_spans = 1;
+		test_expected(parser_parse_next(&parser) == 0);
+		test_expected(parser_parse_next(&parser) == 0);
+		a = node_object_get(parser.noderoot, "a");
+		test_expected(parser.noderoot->src == ndjson + 6);
+		test_expected(a->src == ndjson + 12 && a->src_len == 3);
+		parser_free(&parser);
+
+		parser = parser_new_with_buffer(ndjson + 6, 10);
+		parser.lexer.file.ordinal = 6;
+		parser.keep_spans = 1;
+		parser_parse(&parser);
+		test_expected(parser.error.kind == SUCCESS);
+		test_expected(parser.noderoot->src == ndjson + 6 &&
+		    parser.noderoot->src_len == 10);
+		parser_free(&parser);
+	}
+}
+
+static void
+test_dump(void)
+{
+	/* format */
+	{
+		parser_t parser =
+		    parser_new_with_string("{\"a\": [true, 1.5]}");
+		char *s;
+
+		parser_parse(&parser);
+		s = node_dump_str(parser.noderoot);
+		test_expected(strcmp(s,
+		                  "dump node:\n"
+		                  "--------------------\n"
+		                  "- ordinal: 1\n"
+		                  "  tag: object\n"
+		                  "  - ordinal: 7\n"
+		                  "    tag: object element\n"
+		                  "    key: a\n"
+		                  "    - ordinal: 7\n"
+		                  "      tag: array\n"
+		                  "      - ordinal: 8\n"
+		                  "        tag: array element\n"
+		                  "        index: 0\n"
+		                  "        - ordinal: 8\n"
+		                  "          tag: bool\n"
+		                  "          boolean: 1\n"
+		                  "      - ordinal: 14\n"
+		                  "        tag: array element\n"
+		                  "        index: 1\n"
+		                  "        - ordinal: 14\n"
+		                  "          tag: number\n"
+		                  "          number: 1.5\n"
+		                  "--------------------\n") == 0);
+		free(s);
+		parser_free(&parser);
+	}
+
+	/* limits */
+	{
+		parser_t parser =
+		    parser_new_with_string("[[[1]], 2, 3, 4, {\"k\": null}]");
+		char *s;
+		size_t len;
+		FILE *fp;
+
+		parser_parse(&parser);
+		fp = open_memstream(&s, &len);
+		test_expected(fp != NULL);
+		node_dump_fp(fp, parser.noderoot, 3, 2);
+		fclose(fp);
+		test_expected(strcmp(s,
+		                  "dump node:\n"
+		                  "--------------------\n"
+		                  "- ordinal: 1\n"
+		                  "  tag: array\n"
+		                  "  - ordinal: 2\n"
+		                  "    tag: array element\n"
+		                  "    index: 0\n"
+		                  "    - ordinal: 2\n"
+		                  "      tag: array\n"
+		                  "      - ... (truncated)\n"
+		                  "  - ordinal: 9\n"
+		                  "    tag: array element\n"
+		                  "    index: 1\n"
+		                  "    - ordinal: 9\n"
+		                  "      tag: number\n"
+		                  "      number: 2\n"
+		                  "  - ... (truncated)\n"
+		                  "--------------------\n") == 0);
+		free(s);
+
+		fp = open_memstream(&s, &len);
+		token_dump_fp(fp, parser.lexer.tokenhead, 1);
+		fclose(fp);
+		test_expected(strcmp(s,
+		                  "dump token:\n"
+		                  "--------------------\n"
+		                  "- ordinal: 1\n"
+		                  "  tag: begin array\n"
+		                  "- ... (truncated)\n"
+		                  "--------------------\n") == 0);
+		free(s);
+		parser_free(&parser);
+	}
+
+	/* deep nesting costs only up to the limit */
+	{
+		node_t *root = node_new_array(0);
+		FILE *fp = tmpfile();
+
+		for (size_t i = 1; i < 100000; i++) {
+			node_t *inner = node_new_array(0);
+			inner->head = node_new_aelem(0, 0, root);
+			root = inner;
+		}
+		test_expected(fp != NULL);
+		node_dump_fp(fp, root, 64, 0);
+		test_expected(ftell(fp) > 0 && ftell(fp) < 100000);
+		fclose(fp);
+		node_free(root);
+	}
+
+	/*
+	 * deep nesting without a limit does not recurse. The indentation
+	 * makes the output quadratic, so it goes to /dev/null.
+	 */
+	{
+		node_t *root = node_new_array(0);
+		FILE *fp = fopen("/dev/null", "w");
+
+		for (size_t i = 1; i < 100000; i++) {
+			node_t *inner = node_new_array(0);
+			inner->head = node_new_aelem(0, 0, root);
+			root = inner;
+		}
+		test_expected(fp != NULL);
+		node_dump_fp(fp, root, 0, 0);
+		test_expected(ferror(fp) == 0);
+		fclose(fp);
+		node_free(root);
+	}
+}
+
+static void
+test_string_builder(void)
+{
+	string_t s = string_new();
+	size_t capacity;
+
+	string_append_n(&s, "a\0b", 3);
+	test_expected(s.len == 3 && memcmp(s.bytes, "a\0b", 4) == 0);
+	string_clear(&s);
+
+	/* fits in the spare capacity */
+	test_expected(string_appendf(&s, "%d-%s", 42, "x") == 4);
+	test_expected(strcmp(s.bytes, "42-x") == 0);
+
+	/* grows and retries */
+	test_expected(string_appendf(&s, "%*d", 100, 7) == 100);
+	test_expected(s.len == 104 && s.bytes[103] == '7' &&
+	    s.bytes[104] == '\0');
+
+	string_reserve(&s, 1000);
+	capacity = s.capacity;
+	test_expected(capacity > s.len + 1000);
+	for (int i = 0; i < 100; i++)
+		string_appendf(&s, "%09d", i);
+	test_expected(s.capacity == capacity && s.len == 1004);
+	test_expected(strcmp(s.bytes + 995, "000000099") == 0);
+
+	test_expected(strprintf(&s, "%s", "!") == 1);
+	test_expected(s.len == 1005 && s.bytes[1004] == '!');
+	free(s.bytes);
+
+	/* an unallocated string is allocated on the first append */
+	s = (string_t){.bytes = NULL, .len = 0, .capacity = 0};
+	string_clear(&s);
+	string_add_char(&s, 'a');
+	test_expected(s.len == 1 && strcmp(s.bytes, "a") == 0);
+	free(s.bytes);
+	s = (string_t){.bytes = NULL, .len = 0, .capacity = 0};
+	string_append_n(&s, NULL, 0);
+	test_expected(s.len == 0 && s.bytes[0] == '\0');
+	free(s.bytes);
+	s = (string_t){.bytes = NULL, .len = 0, .capacity = 0};
+	test_expected(string_appendf(&s, "%d", 12) == 2);
+	test_expected(strcmp(s.bytes, "12") == 0);
+	free(s.bytes);
+}
+
+static void
+test_cbor(void)
+{
+	/* encode (RFC 8949 Appendix A) */
+	{
+		struct {
+			char *json;
+			char *cbor;
+			size_t len;
+		} tests[] = {{"0", "\x00", 1}, {"23", "\x17", 1},
+		    {"24", "\x18\x18", 2}, {"1000", "\x19\x03\xe8", 3},
+		    {"1000000", "\x1a\x00\x0f\x42\x40", 5},
+		    {"-1", "\x20", 1}, {"-1000", "\x39\x03\xe7", 3},
+		    {"1.5", "\xfa\x3f\xc0\x00\x00", 5},
+		    {"1.1", "\xfb\x3f\xf1\x99\x99\x99\x99\x99\x9a", 9},
+		    {"false", "\xf4", 1}, {"null", "\xf6", 1},
+		    {"\"a\"", "\x61\x61", 2},
+		    {"[1,2,3]", "\x83\x01\x02\x03", 4},
+		    {"{\"a\":1,\"b\":[2,3]}",
+		        "\xa2\x61\x61\x01\x61\x62\x82\x02\x03", 9}};
+
+		for (size_t i = 0; i < array_len(tests); i++) {
+			parser_t parser =
+			    parser_new_with_string(tests[i].json);
+			string_t out = string_new();
+			parser_parse(&parser);
+			test_expected(parser.error.kind == SUCCESS);
+			jm_cbor_encode(parser.noderoot, &out);
+			test_expected(out.len == tests[i].len &&
+			    memcmp(out.bytes, tests[i].cbor, out.len) == 0);
+			free(out.bytes);
+		}
+	}
+
+	/* decode */
+	{
+		struct {
+			char *cbor;
+			size_t len;
+			char *json;
+		} tests[] = {{"\x1b\x00\x00\x00\xe8\xd4\xa5\x10\x00", 9,
+		                 "1000000000000"},
+		    {"\x38\x63", 2, "-100"}, {"\xf9\x3e\x00", 3, "1.5"},
+		    {"\xf9\x80\x00", 3, "-0"},
+		    {"\xf9\x00\x01", 3, "5.960464477539063e-8"},
+		    {"\xf7", 1, "null"}, {"\xc1\x1a\x51\x4b\x67\xb0", 6,
+		                             "1363896240"},
+		    {"\x9f\xff", 2, "[]"},
+		    {"\x9f\x01\x82\x02\x03\x9f\x04\x05\xff\xff", 10,
+		        "[1,[2,3],[4,5]]"},
+		    {"\xbf\x63\x46\x75\x6e\xf5\x63\x41\x6d\x74\x21\xff", 12,
+		        "{\"Fun\":true,\"Amt\":-2}"},
+		    {"\x7f\x65strea\x64ming\xff", 13, "\"streaming\""},
+		    {"\x7f\x63\xe3\x81\x82\x61" "a\xff", 8,
+		        "\"\xe3\x81\x82" "a\""},
+		    {"\xa0", 1, "{}"}};
+
+		for (size_t i = 0; i < array_len(tests); i++) {
+			error_t error;
+			node_t *node = jm_cbor_decode(
+			    tests[i].cbor, tests[i].len, &error);
+			string_t out = string_new();
+			test_expected(node != NULL && error.kind == SUCCESS);
+			jm_serialize(node, &out, JM_SERIALIZE_COMPACT);
+			test_expected(strcmp(out.bytes, tests[i].json) == 0);
+			free(out.bytes);
+			node_free(node);
+		}
+	}
+
+	/* round trip */
+	{
+		char *text = "{\"n\":[0,-1,255,65536,4294967296,-4294967297,"
+		             "9007199254740992,-0.5,1e300,"
+		             "3.4028234663852886e38],"
+		             "\"s\":[\"\",\"\\u3042\\n\","
+		             "\"a string longer than 23 bytes\"],"
+		             "\"o\":{\"\":{\"x\":[[],{},null,true]}}}";
+		parser_t parser = parser_new_with_string(text);
+		string_t cbor = string_new(), out = string_new(),
+		         out2 = string_new();
+		error_t error;
+
+		parser_parse(&parser);
+		test_expected(parser.error.kind == SUCCESS);
+		jm_serialize(parser.noderoot, &out, JM_SERIALIZE_COMPACT);
+		jm_cbor_encode(parser.noderoot, &cbor);
+		test_expected(cbor.len < out.len);
+
+		node_t *node = jm_cbor_decode(cbor.bytes, cbor.len, &error);
+		test_expected(node != NULL && error.ordinal == cbor.len);
+		jm_serialize(node, &out2, JM_SERIALIZE_COMPACT);
+		test_expected(strcmp(out.bytes, out2.bytes) == 0);
+		free(cbor.bytes);
+		free(out.bytes);
+		free(out2.bytes);
+		node_free(node);
+	}
+
+	/* errors */
+	{
+		struct {
+			char *cbor;
+			size_t len;
+			size_t ordinal;
+		} tests[] = {{"", 0, 1}, {"\x19\x03", 2, 1},
+		    {"\x82\x01", 2, 3}, {"\x63" "ab", 3, 1},
+		    {"\x44\x01\x02\x03\x04", 5, 1}, {"\x00\x00", 2, 2},
+		    {"\xa1\x01\x02", 3, 2}, {"\x1c", 1, 1}, {"\xff", 1, 1},
+		    {"\x81\xff", 2, 2}, {"\xbf\x61\x61\xff", 4, 4},
+		    {"\x7f\x01\xff", 3, 2}, {"\x5f\xff", 2, 1},
+		    {"\xf8\x20", 2, 1}, {"\x82\x01\x40", 3, 3},
+		    {"\x9f\x01\xa1\x01", 4, 4},
+		    /* not UTF-8 */
+		    {"\x61\xff", 2, 1}, {"\x62\xc0\x80", 3, 1},
+		    {"\x63\xed\xa0\x80", 4, 1},
+		    {"\x64\xf4\x90\x80\x80", 5, 1},
+		    {"\x7f\x61\x61\x61\xc3\xff", 6, 4},
+		    /* a character split across chunks */
+		    {"\x7f\x62\xe3\x81\x61\x82\xff", 7, 2},
+		    /* NaN and infinities */
+		    {"\xf9\x7e\x00", 3, 1}, {"\xf9\x7c\x00", 3, 1},
+		    {"\xfa\xff\x80\x00\x00", 5, 1},
+		    {"\xfb\x7f\xf8\x00\x00\x00\x00\x00\x00", 9, 1},
+		    /* the largest definite length is not indefinite */
+		    {"\x9b\xff\xff\xff\xff\xff\xff\xff\xff\x01\xff", 11,
+		        11}};
+
+		for (size_t i = 0; i < array_len(tests); i++) {
+			error_t error;
+			node_t *node = jm_cbor_decode(
+			    tests[i].cbor, tests[i].len, &error);
+			test_expected(node == NULL);
+			test_expected(error.kind == ERROR_GENERAL &&
+			    error.ordinal == tests[i].ordinal);
+		}
+	}
+}
+
+static void
+test_snapshot(void)
+{
+	char path[] = "/tmp/jm_snapshot_XXXXXX";
+	char *text = "{\"a\":[1,-2.5,true,null,\"x\\u0000y\"],"
+	             "\"b\":{\"\":[],\"c\":{}},\"a\":0}";
+	parser_t parser = parser_new_with_string(text);
+	jm_snapshot_value_t root, v, name, value;
+	jm_snapshot_t *snap;
+	const char *str;
+	size_t len;
+	int fd = mkstemp(path);
+
+	test_expected(fd != -1);
+	close(fd);
+
+	parser_parse(&parser);
+	test_expected(parser.error.kind == SUCCESS);
+	test_expected(jm_snapshot_write(parser.noderoot, path) == 0);
+
+	snap = jm_snapshot_open(path);
+	test_expected(snap != NULL);
+	root = jm_snapshot_root(snap);
+	test_expected(jm_snapshot_tag(root) == NODE_TAG_OBJECT);
+	test_expected(jm_snapshot_len(root) == 3);
+
+	/* the first of duplicate names */
+	test_expected(jm_snapshot_object_get(root, "a", &v) == 0);
+	test_expected(jm_snapshot_tag(v) == NODE_TAG_ARRAY);
+	test_expected(jm_snapshot_len(v) == 5);
+	test_expected(jm_snapshot_array_get(v, 0, &value) == 0);
+	test_expected(jm_snapshot_number(value) == 1);
+	test_expected(jm_snapshot_array_get(v, 1, &value) == 0);
+	test_expected(jm_snapshot_number(value) == -2.5);
+	test_expected(jm_snapshot_array_get(v, 2, &value) == 0);
+	test_expected(jm_snapshot_bool(value) == 1);
+	test_expected(jm_snapshot_array_get(v, 3, &value) == 0);
+	test_expected(jm_snapshot_tag(value) == NODE_TAG_NULL);
+	test_expected(jm_snapshot_array_get(v, 4, &value) == 0);
+	str = jm_snapshot_string(value, &len);
+	test_expected(len == 3 && memcmp(str, "x\0y", 4) == 0);
+	test_expected(jm_snapshot_array_get(v, 5, &value) == -1);
+
+	test_expected(jm_snapshot_object_get(root, "b", &v) == 0);
+	test_expected(jm_snapshot_object_at(v, 1, &name, &value) == 0);
+	str = jm_snapshot_string(name, &len);
+	test_expected(len == 1 && strcmp(str, "c") == 0);
+	test_expected(jm_snapshot_tag(value) == NODE_TAG_OBJECT);
+	test_expected(jm_snapshot_len(value) == 0);
+	test_expected(jm_snapshot_object_get(v, "", &value) == 0);
+	test_expected(jm_snapshot_len(value) == 0);
+	test_expected(jm_snapshot_object_at(v, 2, &name, &value) == -1);
+	test_expected(jm_snapshot_object_get(root, "z", &v) == -1);
+	jm_snapshot_close(snap);
+
+	/* scalar root */
+	{
+		parser_t p = parser_new_with_string("\"abcdefgh\"");
+		parser_parse(&p);
+		test_expected(jm_snapshot_write(p.noderoot, path) == 0);
+		snap = jm_snapshot_open(path);
+		test_expected(snap != NULL);
+		str = jm_snapshot_string(jm_snapshot_root(snap), &len);
+		test_expected(len == 8 && strcmp(str, "abcdefgh") == 0);
+		jm_snapshot_close(snap);
+	}
+
+	/* a broken record is found by jm_snapshot_validate() */
+	{
+		struct {
+			char *json;
+			long pos;
+			uint64_t word;
+		} tests[] = {{"[1]", 56, 40}, {"[1]", 56, 48},
+		    {"[1]", 56, 1 << 20}, {"{\"a\":1}", 72, 48},
+		    {"\"abc\"", 32, NODE_TAG_STRING | 100 << 8},
+		    {"\"abcdefgh\"", 48, 1}, {"[]", 32, 9}};
+
+		for (size_t i = 0; i < array_len(tests); i++) {
+			parser_t p = parser_new_with_string(tests[i].json);
+			FILE *fp;
+
+			parser_parse(&p);
+			test_expected(
+			    jm_snapshot_write(p.noderoot, path) == 0);
+			snap = jm_snapshot_open(path);
+			test_expected(snap != NULL);
+			test_expected(jm_snapshot_validate(snap) == 0);
+			jm_snapshot_close(snap);
+
+			fp = fopen(path, "r+b");
+			test_expected(fp != NULL);
+			fseek(fp, tests[i].pos, SEEK_SET);
+			fwrite(&tests[i].word, sizeof(uint64_t), 1, fp);
+			fclose(fp);
+			/* only the header is checked when opening */
+			snap = jm_snapshot_open(path);
+			test_expected(snap != NULL);
+			test_expected(jm_snapshot_validate(snap) == -1);
+			jm_snapshot_close(snap);
+		}
+	}
+
+	/* not a snapshot */
+	{
+		FILE *fp = fopen(path, "w");
+		fputs("{\"a\": 1, \"b\": 2, \"c\": 3, \"d\": 4}", fp);
+		fclose(fp);
+		test_expected(jm_snapshot_open(path) == NULL);
+	}
+
+	remove(path);
+	test_expected(jm_snapshot_open(path) == NULL);
+}
+
+/*
+ * 文字列はnul文字を含むことがあるので、エスケープしてから書く
+ */
+static void
+tape_write_string(jm_writer_t *w, jm_tape_value_t v, int is_name)
+{
+	string_t json = string_new();
+	size_t len;
+	const char *str = jm_tape_string(v, &len);
+
+	serialize_string(&json, str, len);
+	if (is_name)
+		jm_writer_key_raw(w, json.bytes, json.len);
+	else
+		jm_writer_value_raw(w, json.bytes, json.len);
+	free(json.bytes);
+}
+
+static void
+tape_write_value(jm_writer_t *w, jm_tape_value_t v)
+{
+	jm_tape_value_t name, value;
+	jm_tape_iter_t it;
+
+	switch (jm_tape_tag(v)) {
+	case NODE_TAG_NULL:
+		jm_writer_value_null(w);
+		break;
+	case NODE_TAG_BOOL:
+		jm_writer_value_bool(w, jm_tape_bool(v));
+		break;
+	case NODE_TAG_NUMBER:
+		jm_writer_value_number(w, jm_tape_number(v));
+		break;
+	case NODE_TAG_STRING:
+		tape_write_string(w, v, 0);
+		break;
+	case NODE_TAG_ARRAY:
+		jm_writer_begin_array(w);
+		it = jm_tape_iter(v);
+		while (jm_tape_iter_next(&it, NULL, &value) == 0)
+			tape_write_value(w, value);
+		jm_writer_end_array(w);
+		break;
+	case NODE_TAG_OBJECT:
+		jm_writer_begin_object(w);
+		it = jm_tape_iter(v);
+		while (jm_tape_iter_next(&it, &name, &value) == 0) {
+			tape_write_string(w, name, 1);
+			tape_write_value(w, value);
+		}
+		jm_writer_end_object(w);
+		break;
+	default:
+		BUG(1);
+	}
+}
+
+static void
+test_tape(void)
+{
+	/* same as the tree */
+	{
+		char *texts[] = {"null", "-1.5", "\"a\\u0000b\"", "[]", "{}",
+		    "[1, [2, [3, {}]], \"x\", true, false, null]",
+		    "{\"a\": {\"b\": [{\"c\": 1}]}, \"\": \"\\u3042\"}"};
+
+		for (size_t i = 0; i < array_len(texts); i++) {
+			parser_t parser = parser_new_with_string(texts[i]);
+			jm_tape_t tape = jm_tape_new();
+			string_t expected = string_new(), out = string_new();
+			jm_writer_t w = jm_writer_new_with_string(
+			    &out, JM_SERIALIZE_COMPACT);
+
+			parser_parse(&parser);
+			test_expected(parser.error.kind == SUCCESS);
+			jm_serialize(
+			    parser.noderoot, &expected, JM_SERIALIZE_COMPACT);
+
+			file_t in = file_new_with_string(texts[i]);
+			test_expected(jm_tape_parse(&tape, in) == 0);
+			tape_write_value(&w, jm_tape_root(&tape));
+			test_expected(jm_writer_finish(&w) == 0);
+			test_expected(out.len == expected.len &&
+			    memcmp(out.bytes, expected.bytes, out.len) == 0);
+
+			jm_writer_free(&w);
+			jm_tape_free(&tape);
+			free(expected.bytes);
+			free(out.bytes);
+		}
+	}
+
+	/* access */
+	{
+		jm_tape_t tape = jm_tape_new(), copy;
+		jm_tape_value_t root, v;
+		const char *str;
+		size_t len;
+
+		test_expected(jm_tape_parse(&tape,
+		                  file_new_with_string(
+		                      "{\"a\": [[1, 2], {\"x\": []}, 3],"
+		                      " \"b\": \"bee\", \"a\": null}")) == 0);
+
+		copy = jm_tape_copy(&tape);
+		jm_tape_free(&tape);
+
+		root = jm_tape_root(&copy);
+		test_expected(jm_tape_object_get(root, "a", &v) == 0);
+		test_expected(jm_tape_tag(v) == NODE_TAG_ARRAY);
+		test_expected(jm_tape_array_get(v, 2, &v) == 0);
+		test_expected(jm_tape_number(v) == 3);
+		test_expected(jm_tape_object_get(root, "b", &v) == 0);
+		str = jm_tape_string(v, &len);
+		test_expected(len == 3 && strcmp(str, "bee") == 0);
+		test_expected(jm_tape_object_get(root, "c", &v) == -1);
+		test_expected(jm_tape_object_get(root, "a", &v) == 0);
+		test_expected(jm_tape_array_get(v, 3, &v) == -1);
+
+		/* reuse */
+		test_expected(
+		    jm_tape_parse(&copy, file_new_with_string("[true]")) == 0);
+		test_expected(
+		    jm_tape_array_get(jm_tape_root(&copy), 0, &v) == 0);
+		test_expected(jm_tape_bool(v) == 1);
+		jm_tape_free(&copy);
+
+		/* a freed tape can parse again, and copies without strings */
+		test_expected(
+		    jm_tape_parse(&tape, file_new_with_string("[1]")) == 0);
+		copy = jm_tape_copy(&tape);
+		jm_tape_free(&copy);
+		test_expected(
+		    jm_tape_parse(&tape, file_new_with_string("\"s\"")) == 0);
+		str = jm_tape_string(jm_tape_root(&tape), &len);
+		test_expected(len == 1 && strcmp(str, "s") == 0);
+		jm_tape_free(&tape);
+		jm_tape_free(&tape);
+	}
+
+	/* errors */
+	{
+		struct {
+			char *text;
+			size_t ordinal;
+		} tests[] = {{"[1, 2", 6}, {"{\"a\" 1}", 6}, {"1 2", 3},
+		    {"[1,]", 4}};
+
+		for (size_t i = 0; i < array_len(tests); i++) {
+			jm_tape_t tape = jm_tape_new();
+			file_t in = file_new_with_string(tests[i].text);
+			test_expected(jm_tape_parse(&tape, in) == -1);
+			test_expected(tape.error.kind == ERROR_GENERAL);
+			test_expected(tape.error.ordinal == tests[i].ordinal);
+			jm_tape_free(&tape);
+		}
+	}
+}
+
+typedef struct packed_query {
+	const jm_query_t *q;
+	node_t *root;
+	size_t matches;
+} packed_query_t;
+
+static void *
+packed_query_worker(void *arg)
+{
+	packed_query_t *pq = arg;
+
+	for (int i = 0; i < 100; i++)
+		pq->matches += jm_query_run(
+		    pq->q, pq->root, stress_count, &(size_t){0});
+	return NULL;
+}
+
+static node_t *
+parse_packed(char *text)
+{
+	parser_t parser = parser_new_with_string(text);
+
+	parser.pack_numbers = 1;
+	parser_parse(&parser);
+	test_expected(parser.error.kind == SUCCESS);
+	return parser.noderoot;
+}
+
+static void
+test_packed(void)
+{
+	/* same output as the tree */
+	{
+		char *texts[] = {"[1,2,3]", "[1.5,-2,1e300]", "[-0,0]", "[]",
+		    "[1,\"x\",2]", "[1,2,[3,4],5]",
+		    "[[1,2],[3.5],{\"a\":[6]}]",
+		    "{\"coordinates\":[[-122.4,37.8],[-122.5,37.7]]}"};
+
+		for (size_t i = 0; i < array_len(texts); i++) {
+			parser_t parser = parser_new_with_string(texts[i]);
+			node_t *packed = parse_packed(texts[i]);
+			string_t expected = string_new(), out = string_new();
+			string_t cbor = string_new(), cbor2 = string_new();
+
+			parser_parse(&parser);
+			for (int f = JM_SERIALIZE_COMPACT;
+			     f <= JM_SERIALIZE_PRETTY; f++) {
+				string_clear(&expected);
+				string_clear(&out);
+				jm_serialize(parser.noderoot, &expected, f);
+				jm_serialize(packed, &out, f);
+				test_expected(
+				    strcmp(out.bytes, expected.bytes) == 0);
+			}
+
+			jm_cbor_encode(parser.noderoot, &cbor);
+			jm_cbor_encode(packed, &cbor2);
+			test_expected(cbor.len == cbor2.len &&
+			    memcmp(cbor.bytes, cbor2.bytes, cbor.len) == 0);
+
+			free(expected.bytes);
+			free(out.bytes);
+			free(cbor.bytes);
+			free(cbor2.bytes);
+		}
+	}
+
+	/* element types */
+	{
+		node_t *node = parse_packed("[1, -2, 9007199254740992]");
+		const int64_t *ints;
+		const double *nums;
+		size_t len;
+		double num;
+
+		ints = node_packed_ints(node, &len);
+		test_expected(ints != NULL && len == 3);
+		test_expected(ints[1] == -2 && ints[2] == INT64_C(1) << 53);
+		test_expected(node_packed_doubles(node, &len) == NULL);
+
+		node = parse_packed("[1, 0.5, -0]");
+		nums = node_packed_doubles(node, &len);
+		test_expected(nums != NULL && len == 3);
+		test_expected(nums[1] == 0.5 && signbit(nums[2]));
+		test_expected(node_array_len(node) == 3);
+		test_expected(node_array_get_number(node, 1, &num) == 0);
+		test_expected(num == 0.5);
+		test_expected(node_array_get_number(node, 3, &num) == -1);
+		test_expected(node->packing == NODE_PACKED_DOUBLE);
+
+		/* not packed */
+		node = parse_packed("[1, 2, null]");
+		test_expected(node->packing == NODE_PACKED_NONE);
+		test_expected(node_array_len(node) == 3);
+		test_expected(node_array_get_number(node, 1, &num) == 0);
+		test_expected(num == 2);
+		test_expected(node_array_get_number(node, 2, &num) == -1);
+		test_expected(array_elem(node, 1)->ordinal == 5);
+		test_expected(parse_packed("[]")->packing == NODE_PACKED_NONE);
+	}
+
+	/* lookups read packed arrays without unpacking them */
+	{
+		node_t *node = parse_packed("{\"a\": [10, 20, 30]}");
+		node_t *array = node_object_get(node, "a");
+		jm_pointer_t *ptr = jm_pointer_compile("/a/2");
+		struct {
+			const char *query;
+			double expected[4];
+			size_t len;
+		} cases[] = {
+		    {"$.a[-2]", {20}, 1},
+		    {"$.a[0]", {10}, 1},
+		    {"$.a[3]", {0}, 0},
+		    {"$.a[*]", {10, 20, 30}, 3},
+		    {"$.a[::2]", {10, 30}, 2},
+		    {"$.a[1:9]", {20, 30}, 2},
+		    {"$.a..*", {10, 20, 30}, 3},
+		    {"$.a.b", {0}, 0},
+		};
+		double num;
+
+		for (size_t i = 0; i < array_len(cases); i++) {
+			jm_query_t *q = jm_query_compile(cases[i].query);
+			query_result_t res = {.len = 0};
+
+			test_expected(jm_query_run(q, node, query_collect,
+			                  &res) == cases[i].len);
+			for (size_t j = 0; j < res.len; j++)
+				test_expected(
+				    res.nums[j] == cases[i].expected[j]);
+			jm_query_free(q);
+		}
+
+		/* packed elements have no node, but are told from absent */
+		node_t *match = NULL;
+		jm_query_t *q = jm_query_compile("$.a[-2]");
+		test_expected(jm_query_first(q, node, &match, &num) == 1);
+		test_expected(match == NULL && num == 20);
+		jm_query_free(q);
+		q = jm_query_compile("$.a[9]");
+		test_expected(jm_query_first(q, node, &match, &num) == -1);
+		jm_query_free(q);
+		test_expected(jm_pointer_eval(ptr, node) == NULL);
+		test_expected(node_array_get(array, 0, &match, &num) == 1);
+		test_expected(match == NULL && num == 10);
+		test_expected(node_array_get(array, 4, &match, &num) == -1);
+		test_expected(node_array_get_number(array, 2, &num) == 0);
+		test_expected(num == 30);
+		test_expected(array->packing == NODE_PACKED_INT64);
+
+		/* updating needs element nodes */
+		node_t *elem = jm_pointer_eval_for_update(ptr, node);
+		test_expected(elem != NULL && elem->num == 30);
+		test_expected(array->packing == NODE_PACKED_NONE);
+		test_expected(array_elem(array, 0)->num == 10);
+		test_expected(node_array_get(array, 3, &match, NULL) == -1);
+		jm_pointer_free(ptr);
+		node_free(node);
+	}
+
+	/* several threads query the same packed tree */
+	{
+		node_t *node = parse_packed("{\"a\": [1, 2, 3, 4]}");
+		jm_query_t *q = jm_query_compile("$.a[1:]");
+		packed_query_t pqs[4];
+		pthread_t ids[4];
+
+		for (size_t i = 0; i < array_len(ids); i++) {
+			pqs[i] = (packed_query_t){
+			    .q = q, .root = node, .matches = 0};
+			test_expected(pthread_create(&ids[i], NULL,
+			                  packed_query_worker, &pqs[i]) == 0);
+		}
+		for (size_t i = 0; i < array_len(ids); i++) {
+			pthread_join(ids[i], NULL);
+			test_expected(pqs[i].matches == 300);
+		}
+		test_expected(node_object_get(node, "a")->packing ==
+		    NODE_PACKED_INT64);
+		jm_query_free(q);
+		node_free(node);
+	}
+
+	/* snapshot */
+	{
+		char path[] = "/tmp/jm_packed_XXXXXX";
+		jm_snapshot_value_t v;
+		jm_snapshot_t *snap;
+		int fd = mkstemp(path);
+
+		test_expected(fd != -1);
+		close(fd);
+		test_expected(
+		    jm_snapshot_write(parse_packed("[[0.5,-1]]"), path) == 0);
+		snap = jm_snapshot_open(path);
+		test_expected(snap != NULL);
+		test_expected(
+		    jm_snapshot_array_get(jm_snapshot_root(snap), 0, &v) == 0);
+		test_expected(jm_snapshot_len(v) == 2);
+		test_expected(jm_snapshot_array_get(v, 1, &v) == 0);
+		test_expected(jm_snapshot_number(v) == -1);
+		jm_snapshot_close(snap);
+		remove(path);
+	}
+
+	/* errors */
+	{
+		char *texts[] = {"[1, 2", "[1, 2,]", "[1 2]", "[1, 2, x]"};
+
+		for (size_t i = 0; i < array_len(texts); i++) {
+			parser_t parser = parser_new_with_string(texts[i]);
+			parser.pack_numbers = 1;
+			parser_parse(&parser);
+			test_expected(parser.error.kind == ERROR_GENERAL);
+		}
+	}
+}
+
 int
 main(void)
 {
@@ -818,6 +3361,31 @@ main(void)
 	test_parse_string();
 	test_parse_array();
 	test_parse_object();
+	test_parse_next();
+	test_parser_reset();
+	test_reader();
+	test_parse_projected();
+	test_node_get();
+	test_pointer();
+	test_query();
+	test_lazy();
+	test_extract();
+	test_ndjson_parallel();
+	test_parse_parallel();
+	test_parse_pipelined();
+	test_parse_batch();
+	test_concurrency();
+	test_dtoa();
+	test_serialize();
+	test_writer();
+	test_reformat();
+	test_passthrough();
+	test_dump();
+	test_string_builder();
+	test_cbor();
+	test_snapshot();
+	test_tape();
+	test_packed();
 
 	printf("done.\n");
 }
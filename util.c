@@ -11,7 +11,7 @@ xmalloc(size_t size)
 	void *ret = malloc(size);
 	if (ret == NULL) {
 		logmsg("malloc failed.\n");
-		exit(1);
+		abort();
 	}
 
 	return ret;
@@ -30,7 +30,7 @@ xrealloc(void *ptr, size_t size)
 	void *ret = realloc(ptr, size);
 	if (ret == NULL) {
 		logmsg("realloc failed\n");
-		exit(1);
+		abort();
 	}
 
 	return ret;
@@ -42,7 +42,7 @@ xvasprintf(char **strp, const char *fmt, va_list ap)
 	int ret = vasprintf(strp, fmt, ap);
 	if (ret == -1) {
 		logmsg("vasprintf failed.\n");
-		exit(1);
+		abort();
 	}
 	return ret;
 }
@@ -58,15 +58,21 @@ xasprintf(char **strp, const char *fmt, ...)
 	return ret;
 }
 
+/*
+ * 複数のスレッドから呼び出されても1つのメッセージが混ざらないように、
+ * stderrをロックしてから書き込む。
+ */
 void
 vlogmsg2(const char *progfile, const char *pos, const char *fmt, va_list ap)
 {
+	flockfile(stderr);
 	if (progfile != NULL)
 		fprintf(stderr, "%s: ", progfile);
 	if (pos != NULL)
 		fprintf(stderr, "%s: ", pos);
 
 	vfprintf(stderr, fmt, ap);
+	funlockfile(stderr);
 }
 
 void
@@ -81,12 +87,7 @@ logmsg2(const char *progfile, const char *pos, const char *fmt, ...)
 int
 vstrprintf(string_t *dst, const char *fmt, va_list ap)
 {
-	int len;
-	char *tmp;
-	len = xvasprintf(&tmp, fmt, ap);
-	string_add_string(dst, tmp);
-	free(tmp);
-	return len;
+	return string_vappendf(dst, fmt, ap);
 }
 
 int
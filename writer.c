@@ -0,0 +1,435 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "jsonmodoki.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * ストリーミングライター
+ *
+ * 木を作らずに、呼び出しの順にJSONを書き出す。出力はいったん内部のバッ
+ * ファにため、flush_thresholdバイトを超えたら書き出し先に渡す。入れ子
+ * の状態をスタックに積み、順序の誤った呼び出しはエラーにする。エスケー
+ * プと数値の書式はjm_serialize()と共有する。
+ */
+
+/* stackの要素 */
+enum writer_frame {
+	WRITER_ARRAY_BEGIN,
+	WRITER_ARRAY_VALUE,
+	WRITER_OBJECT_BEGIN,
+	WRITER_OBJECT_NAME,
+	WRITER_OBJECT_VALUE
+};
+
+jm_writer_t
+jm_writer_new(enum jm_writer_sink sink, int flags)
+{
+	return (jm_writer_t){.sink = sink,
+	    .str = NULL,
+	    .fp = NULL,
+	    .fd = -1,
+	    .buf = string_new(),
+	    .flush_threshold = JM_WRITER_FLUSH_THRESHOLD,
+	    .flushed = 0,
+	    .flags = flags,
+	    .stack = string_new(),
+	    .root_done = 0,
+	    .error = (error_t){.kind = SUCCESS, .ordinal = 0}};
+}
+
+/*
+ * outの末尾に追記する。
+ */
+jm_writer_t
+jm_writer_new_with_string(string_t *out, int flags)
+{
+	jm_writer_t w = jm_writer_new(JM_WRITER_SINK_STRING, flags);
+	w.str = out;
+	return w;
+}
+
+jm_writer_t
+jm_writer_new_with_file(FILE *fp, int flags)
+{
+	jm_writer_t w = jm_writer_new(JM_WRITER_SINK_FILE, flags);
+	w.fp = fp;
+	return w;
+}
+
+jm_writer_t
+jm_writer_new_with_fd(int fd, int flags)
+{
+	jm_writer_t w = jm_writer_new(JM_WRITER_SINK_FD, flags);
+	w.fd = fd;
+	return w;
+}
+
+void
+jm_writer_free(jm_writer_t *w)
+{
+	free(w->buf.bytes);
+	free(w->stack.bytes);
+	w->buf = w->stack = (string_t){.bytes = NULL, .len = 0, .capacity = 0};
+}
+
+/*
+ * 書き込み先の文字列。文字列に書き出すときはバッファを介さない。
+ */
+string_t *
+jm_writer_out(jm_writer_t *w)
+{
+	return w->sink == JM_WRITER_SINK_STRING ? w->str : &w->buf;
+}
+
+void
+jm_writer_set_error(jm_writer_t *w)
+{
+	w->error = (error_t){.kind = ERROR_GENERAL,
+	    .ordinal = w->flushed + jm_writer_out(w)->len};
+}
+
+/*
+ * バッファの中身を書き出し先に渡す。
+ *
+ * return: 成功なら0。書き込みに失敗したら-1。
+ */
+int
+jm_writer_flush(jm_writer_t *w)
+{
+	size_t done = 0;
+
+	if (w->error.kind != SUCCESS)
+		return -1;
+
+	switch (w->sink) {
+	case JM_WRITER_SINK_STRING:
+		return 0;
+	case JM_WRITER_SINK_FILE:
+		done = fwrite(w->buf.bytes, 1, w->buf.len, w->fp);
+		if (done < w->buf.len || fflush(w->fp) == EOF) {
+			logmsg("write failed: %s\n", strerror(errno));
+			goto error;
+		}
+		break;
+	case JM_WRITER_SINK_FD:
+		while (done < w->buf.len) {
+			ssize_t n = write(
+			    w->fd, w->buf.bytes + done, w->buf.len - done);
+			if (n == -1) {
+				if (errno == EINTR)
+					continue;
+				logmsg("write failed: %s\n", strerror(errno));
+				goto error;
+			}
+			done += n;
+		}
+		break;
+	default:
+		BUG(1);
+	}
+
+	w->flushed += w->buf.len;
+	string_clear(&w->buf);
+	return 0;
+
+error:
+	w->flushed += done;
+	jm_writer_set_error(w);
+	return -1;
+}
+
+#define writer_top(w) ((w)->stack.bytes[(w)->stack.len - 1])
+
+/*
+ * 値を書く前に、区切りと字下げを書き、状態を遷移する。
+ *
+ * return: ここに値を書けるなら0。書けなければ-1。
+ */
+int
+jm_writer_before_value(jm_writer_t *w)
+{
+	string_t *out = jm_writer_out(w);
+
+	if (w->error.kind != SUCCESS)
+		return -1;
+
+	if (w->root_done) {
+		logmsg("unexpected value after the root value.\n");
+		goto error;
+	}
+
+	if (w->stack.len == 0)
+		return 0;
+
+	switch (writer_top(w)) {
+	case WRITER_ARRAY_VALUE:
+		string_add_char(out, ',');
+		/* FALLTHROUGH */
+	case WRITER_ARRAY_BEGIN:
+		serialize_newline(out, w->flags, w->stack.len);
+		writer_top(w) = WRITER_ARRAY_VALUE;
+		return 0;
+	case WRITER_OBJECT_NAME:
+		writer_top(w) = WRITER_OBJECT_VALUE;
+		return 0;
+	default:
+		logmsg("expected a key in the object.\n");
+		goto error;
+	}
+
+error:
+	jm_writer_set_error(w);
+	return -1;
+}
+
+/*
+ * 値を書き終えたら呼び出す。
+ */
+int
+jm_writer_after_value(jm_writer_t *w)
+{
+	if (w->stack.len == 0)
+		w->root_done = 1;
+
+	if (w->sink != JM_WRITER_SINK_STRING &&
+	    w->buf.len >= w->flush_threshold)
+		return jm_writer_flush(w);
+	return 0;
+}
+
+/*
+ * 名前の前の区切りと字下げを書く。
+ *
+ * return: ここに名前を書けるなら0。書けなければ-1。
+ */
+int
+jm_writer_before_key(jm_writer_t *w)
+{
+	string_t *out = jm_writer_out(w);
+
+	if (w->error.kind != SUCCESS)
+		return -1;
+
+	if (w->stack.len == 0 || (writer_top(w) != WRITER_OBJECT_BEGIN &&
+	                             writer_top(w) != WRITER_OBJECT_VALUE)) {
+		logmsg("unexpected key outside an object.\n");
+		jm_writer_set_error(w);
+		return -1;
+	}
+
+	if (writer_top(w) == WRITER_OBJECT_VALUE)
+		string_add_char(out, ',');
+	serialize_newline(out, w->flags, w->stack.len);
+	return 0;
+}
+
+void
+jm_writer_after_key(jm_writer_t *w)
+{
+	string_t *out = jm_writer_out(w);
+
+	if (w->flags & JM_SERIALIZE_PRETTY)
+		string_append_n(out, ": ", 2);
+	else
+		string_add_char(out, ':');
+	writer_top(w) = WRITER_OBJECT_NAME;
+}
+
+int
+jm_writer_key(jm_writer_t *w, const char *name)
+{
+	if (jm_writer_before_key(w) == -1)
+		return -1;
+
+	serialize_string(jm_writer_out(w), name, strlen(name));
+	jm_writer_after_key(w);
+	return 0;
+}
+
+/*
+ * 引用符で囲まれ、エスケープ済みの名前をそのまま書く。中身は検査しな
+ * い。
+ */
+int
+jm_writer_key_raw(jm_writer_t *w, const char *json, size_t len)
+{
+	if (jm_writer_before_key(w) == -1)
+		return -1;
+
+	string_append_n(jm_writer_out(w), json, len);
+	jm_writer_after_key(w);
+	return 0;
+}
+
+int
+jm_writer_begin(jm_writer_t *w, int c, enum writer_frame frame)
+{
+	if (jm_writer_before_value(w) == -1)
+		return -1;
+
+	string_add_char(jm_writer_out(w), c);
+	string_add_char(&w->stack, frame);
+	return 0;
+}
+
+int
+jm_writer_end(jm_writer_t *w, int c, int begin, int value)
+{
+	string_t *out = jm_writer_out(w);
+
+	if (w->error.kind != SUCCESS)
+		return -1;
+
+	if (w->stack.len == 0 ||
+	    (writer_top(w) != begin && writer_top(w) != value)) {
+		logmsg("unexpected end of %s.\n",
+		    c == ']' ? "array" : "object");
+		jm_writer_set_error(w);
+		return -1;
+	}
+
+	w->stack.len--;
+	if (w->stack.bytes[w->stack.len] == value)
+		serialize_newline(out, w->flags, w->stack.len);
+	string_add_char(out, c);
+	return jm_writer_after_value(w);
+}
+
+int
+jm_writer_begin_array(jm_writer_t *w)
+{
+	return jm_writer_begin(w, '[', WRITER_ARRAY_BEGIN);
+}
+
+int
+jm_writer_end_array(jm_writer_t *w)
+{
+	return jm_writer_end(w, ']', WRITER_ARRAY_BEGIN, WRITER_ARRAY_VALUE);
+}
+
+int
+jm_writer_begin_object(jm_writer_t *w)
+{
+	return jm_writer_begin(w, '{', WRITER_OBJECT_BEGIN);
+}
+
+int
+jm_writer_end_object(jm_writer_t *w)
+{
+	return jm_writer_end(
+	    w, '}', WRITER_OBJECT_BEGIN, WRITER_OBJECT_VALUE);
+}
+
+int
+jm_writer_value_null(jm_writer_t *w)
+{
+	if (jm_writer_before_value(w) == -1)
+		return -1;
+
+	string_append_n(jm_writer_out(w), "null", 4);
+	return jm_writer_after_value(w);
+}
+
+int
+jm_writer_value_bool(jm_writer_t *w, int boolean)
+{
+	if (jm_writer_before_value(w) == -1)
+		return -1;
+
+	if (boolean)
+		string_append_n(jm_writer_out(w), "true", 4);
+	else
+		string_append_n(jm_writer_out(w), "false", 5);
+	return jm_writer_after_value(w);
+}
+
+/*
+ * return: 成功なら0。無限大やNaNなど、JSONで表せない数値なら-1。
+ */
+int
+jm_writer_value_number(jm_writer_t *w, double num)
+{
+	if (!isfinite(num)) {
+		logmsg("cannot write non-finite number.\n");
+		jm_writer_set_error(w);
+		return -1;
+	}
+
+	if (jm_writer_before_value(w) == -1)
+		return -1;
+
+	serialize_number(jm_writer_out(w), num);
+	return jm_writer_after_value(w);
+}
+
+int
+jm_writer_value_string(jm_writer_t *w, const char *str)
+{
+	if (jm_writer_before_value(w) == -1)
+		return -1;
+
+	serialize_string(jm_writer_out(w), str, strlen(str));
+	return jm_writer_after_value(w);
+}
+
+/*
+ * JSONとして正しいスカラー値をそのまま書く。中身は検査しない。
+ */
+int
+jm_writer_value_raw(jm_writer_t *w, const char *json, size_t len)
+{
+	if (jm_writer_before_value(w) == -1)
+		return -1;
+
+	string_append_n(jm_writer_out(w), json, len);
+	return jm_writer_after_value(w);
+}
+
+/*
+ * ルートの値を書き終えたあとで、改行に続けて次のルートの値を書けるよ
+ * うにする。NDJSONなど、複数の文書を書くときに使う。
+ *
+ * return: 成功なら0。ルートの値を書き終えていなければ-1。
+ */
+int
+jm_writer_next_document(jm_writer_t *w)
+{
+	if (w->error.kind != SUCCESS)
+		return -1;
+
+	if (!w->root_done) {
+		logmsg("unexpected end of document.\n");
+		jm_writer_set_error(w);
+		return -1;
+	}
+
+	string_add_char(jm_writer_out(w), '\n');
+	w->root_done = 0;
+	return 0;
+}
+
+/*
+ * ルートの値を書き終えたことを確かめ、残りを書き出す。
+ *
+ * return: 成功なら0。値が閉じていないか、書き込みに失敗したら-1。
+ */
+int
+jm_writer_finish(jm_writer_t *w)
+{
+	if (w->error.kind != SUCCESS)
+		return -1;
+
+	if (!w->root_done) {
+		logmsg("unexpected end of output.\n");
+		jm_writer_set_error(w);
+		return -1;
+	}
+
+	return jm_writer_flush(w);
+}